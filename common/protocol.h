@@ -1,15 +1,168 @@
 #ifndef PROTOCOL_H
 #define PROTOCOL_H
 
-// Every file will be split into chunks of 256,000 bytes (256 KB)
-#define PIECE_SIZE 256000
+// Every file is split into pieces of a power-of-two size picked for it
+// (choose_piece_size() in file_ops.c): about PIECE_TARGET_COUNT pieces per
+// file, never smaller than MIN_PIECE_SIZE or bigger than MAX_PIECE_SIZE.
+// Small files get small pieces (little to send again when one is bad), big
+// files get big ones (fewer hashes, bitfield bits and requests to track)
+#define MIN_PIECE_SIZE (16 * 1024)
+#define MAX_PIECE_SIZE (16 * 1024 * 1024)
+#define PIECE_TARGET_COUNT 2048
+
+// Older peers split every file into pieces of 256,000 bytes; a file from a
+// peer that doesn't tell us its piece size uses this one
+#define LEGACY_PIECE_SIZE 256000
+
+// Pieces are transferred in blocks of up to 16 KB, so several peers can work on one piece
+#define BLOCK_SIZE 16384
+
+// Content is identified by a SHA-256 Merkle root (see peer/piece_hash.h),
+// sent as 64 hex characters in text commands
+#define HASH_SIZE 32
+#define HASH_HEX_SIZE (2 * HASH_SIZE + 1)
 
 //Tracker server will listen on port 8080 (common for testing)
 #define TRACKER_PORT 8080
 
+// Peers send ANNOUNCE to the tracker every 30 seconds
+#define ANNOUNCE_INTERVAL 30
+
+// Tracker forgets a peer that has been silent for 3 announce intervals
+#define PEER_TTL (3 * ANNOUNCE_INTERVAL)
+
 // Filename can be maximum 100 characters
 #define MAX_FILENAME 100
 
 #define MSG_FILE_INFO "FILE_INFO"    // Ask peer for file information
 
+// Peer connections are keep-alive: a downloader sends any number of
+// FILE_INFO / REQUEST_PIECE commands on one connection, one reply each, in order.
+// Failed requests get "ERROR <message>\n" and the connection stays usable.
+//   "FILE_INFO <filename> [PIECE_SIZE]\n"
+//       reply "INFO <num_pieces> <file_size> [<root>]\n" (root: content root in hex, if known)
+//       PIECE_SIZE (newer peers) asks for the file's piece size as well:
+//       reply "INFO <num_pieces> <file_size> <root or -> <piece_size>\n"
+//       A file whose pieces are not LEGACY_PIECE_SIZE can't be shared with
+//       a peer that doesn't ask: it gets ERROR
+//   "REQUEST_BLOCK <filename> <piece> <offset> <length> [PROOF]\n"
+//       reply "SEND_BLOCK <piece> <offset> <length> [<count>]\n" + [proof] + <length> bytes
+//       (offset is a multiple of BLOCK_SIZE, length at most BLOCK_SIZE)
+//       PROOF asks for the block's Merkle proof: <count> sibling hashes (32 bytes
+//       each, leaf level first) that lead from the block to its piece hash.
+//       Older peers ignore PROOF and leave <count> out
+//
+// Which pieces a peer has (peers that are still downloading serve what they finished)
+//   "BITFIELD <filename>\n"
+//       reply "BITFIELD <num_pieces> <seq>\n" + (num_pieces + 7) / 8 bytes,
+//       bit (0x80 >> (i % 8)) of byte i / 8 set = the peer has piece i
+//   "HAVE <filename> <seq>\n"
+//       reply "HAVE <new seq> <count>\n" + count x piece index (4 bytes, big-endian):
+//       pieces finished since position <seq> of the peer's completion log
+//       (a seeder answers "HAVE <num_pieces> 0"). Ask again from <new seq>
+#define MAX_HAVES_PER_REPLY 1024
+//
+// Endgame: a block requested from several peers that arrived from one of them
+//   "CANCEL <filename> <piece> <offset>\n"
+//       no reply of its own; if the REQUEST_BLOCK is still queued the peer
+//       answers it with "CANCELLED <piece> <offset>\n" instead of the data.
+//       Only sent to peers that know BITFIELD (older peers would answer ERROR)
+//
+// Piece hashes, so a downloader can check every piece it receives
+//   "MANIFEST <filename>\n"
+//       reply "MANIFEST <num_pieces>\n" + num_pieces x Merkle root of the piece (32 bytes)
+//       (older peers answer ERROR: pieces from them can't be checked)
+//       The Merkle root over these hashes is the content root the tracker knows
+//
+// Content-defined chunks of a shared file (peers started with --cdc), so a
+// downloader with an older version can copy what didn't change
+//   "CHUNKS <filename>\n"
+//       reply "CHUNKS <count>\n" + count x { length (4, big-endian), SHA-256 (32) },
+//       in file order (ERROR if the peer keeps no chunk list for the file)
+// An uploader closes a connection that has been idle this many seconds
+#define PEER_IDLE_TIMEOUT 60
+
+// Peer wire protocol v2: binary frames, all fields big-endian
+//   magic (1)  FRAME_MAGIC, never the first byte of a text command
+//   type  (1)  FRAME_* below
+//   flags (2)  0
+//   length (4) payload bytes after the header
+//   id    (4)  request id, copied into the reply (CANCEL names it)
+// A downloader opens each connection with HELLO. The payload ends in '\n' so a
+// text-only peer sees one unknown command and answers ERROR (the oldest peers
+// just hang up): either way the connection falls back to the text commands.
+// A v2 peer answers HELLO with the version and capabilities both sides have.
+#define FRAME_MAGIC 0xF2
+#define FRAME_HEADER_SIZE 12
+#define WIRE_VERSION 2
+#define FRAME_MAX_PAYLOAD (16 * 1024 * 1024)
+#define HELLO_TIMEOUT 5         // Seconds to wait for the answer to HELLO
+
+#define FRAME_HELLO         1   // version (2), capabilities (4), 0 (1), '\n' (1)
+#define FRAME_FILE_INFO     2   // filename
+#define FRAME_INFO          3   // num_pieces (4), file size (8), [content root (32) with CAP_MERKLE],
+                                //   [piece size (4) with CAP_PIECE_SIZE]
+#define FRAME_REQUEST_BLOCK 4   // piece (4), offset (4), length (4), filename
+#define FRAME_BLOCK         5   // piece (4), offset (4), [count (4), count x proof hash (32) with CAP_MERKLE], data
+#define FRAME_BITFIELD      6   // request: filename / reply: num_pieces (4), seq (4), bits
+#define FRAME_HAVE          7   // request: seq (4), filename / reply: new seq (4), count (4), count x piece (4)
+#define FRAME_CANCEL        8   // id (4) of a queued REQUEST_BLOCK, no reply of its own
+#define FRAME_CANCELLED     9   // reply to a cancelled REQUEST_BLOCK, empty
+#define FRAME_ERROR         10  // message
+#define FRAME_MANIFEST      11  // request: filename / reply: num_pieces (4), num_pieces x SHA-256 (32)
+#define FRAME_CHUNKS        12  // request: filename / reply: count (4), count x { length (4), SHA-256 (32) }
+#define FRAME_ZBLOCK        13  // Same as BLOCK, data zlib-compressed; inflates to the requested length
+
+// Capabilities (HELLO); keep every byte of the mask free of '\n'
+#define CAP_BLOCKS   0x01       // REQUEST_BLOCK
+#define CAP_BITFIELD 0x02       // BITFIELD and HAVE
+#define CAP_CANCEL   0x04       // CANCEL
+#define CAP_MANIFEST 0x08       // MANIFEST
+#define CAP_MERKLE   0x10       // Content root in INFO, Merkle proof in every BLOCK
+#define CAP_CHUNKS   0x20       // CHUNKS
+#define CAP_PIECE_SIZE 0x40     // Piece size in INFO (without it: LEGACY_PIECE_SIZE pieces only)
+#define CAP_COMPRESS 0x80       // Blocks may come back as ZBLOCK (peer/compress.h)
+#define WIRE_CAPS (CAP_BLOCKS | CAP_BITFIELD | CAP_CANCEL | CAP_MANIFEST | CAP_MERKLE | CAP_CHUNKS | \
+                   CAP_PIECE_SIZE | CAP_COMPRESS)
+
+// Compact peer list: "QUERY_COMPACT <filename> <limit> <cursor> [ranked]\n"
+// Binary reply, all fields big-endian:
+//   status (1)   0 = OK, 1 = file not found
+//   unused (1)
+//   count  (2)   peers in this reply
+//   total  (4)   peers in the whole swarm
+//   cursor (8)   send back to get the next page, 0 = no more peers
+//   count x { ipv4 (4), port (2) }
+// Cursor 0 starts a new walk in random order, so <limit> works as a random sample size
+// A cursor belongs to one swarm size: if peers joined or left since, the next
+// page starts a new walk (it may repeat peers already listed)
+// ranked = 1: best <limit> peers for the requester out of a bigger random sample
+// (complete, idle, same subnet first), cursor in the reply is always 0
+#define COMPACT_HEADER_SIZE 16
+#define COMPACT_PEER_SIZE 6
+#define COMPACT_MAX_PEERS 200   // Keeps one reply around one packet (16 + 200*6 bytes)
+
+// Batches: many files in one round trip on one tracker connection
+//   "REGISTER_BATCH <port> <count>\n" then <count> lines "<filename>\n"
+//       reply "OK <newly registered>\n"
+//   "QUERY_BATCH <limit> <count>\n" then <count> lines "<filename>\n"
+//       reply: <count> ranked QUERY_COMPACT replies back to back, in request order
+//   REGISTER_BATCH lines may be "<filename> <completion>" like REGISTER
+//
+// Load and completion reports (all optional, old peers still work)
+//   "REGISTER <filename> <port> <completion percent>\n"
+//   "ANNOUNCE <port> <active uploads> <upload kbps>\n"
+//
+// Content roots: a seeder registers the Merkle root of its file, downloaders
+// check every piece hash they get from peers against it
+//   "REGISTER <filename> <port> <completion> <root>\n"  (REGISTER_BATCH line "<filename> <completion> <root>")
+//       a file has one root at a time. A complete copy (100) with a new root
+//       is a new version: it becomes the file's root and the peers of the old
+//       one are dropped. A partial copy with another root gets "ERROR Different
+//       content", a root the file had before "ERROR Outdated content"
+//       (neither is counted in REGISTER_BATCH)
+//   "ROOT <filename>\n"
+//       reply "ROOT <root>\n", or "ERROR No root" (unknown file, or only older peers share it)
+#define BATCH_MAX_FILES 1000
+
 #endif
\ No newline at end of file
@@ -1,8 +1,12 @@
 // Splitting files into pieces and reassembling them
 
+#define _GNU_SOURCE   // fallocate(), copy_file_range()
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <sys/stat.h>
 #include "protocol.h"
 
@@ -16,9 +20,27 @@ long get_file_size(char *filename) {
 }
 
 
-// Determine how many 256KB pieces we need for a file
-int calculate_num_pieces(long file_size) {
-    return (file_size + PIECE_SIZE - 1) / PIECE_SIZE;
+// Pick the piece size for a file: the smallest power of two that keeps it
+// at PIECE_TARGET_COUNT pieces or fewer (within MIN/MAX_PIECE_SIZE)
+int choose_piece_size(long file_size) {
+    int piece_size = MIN_PIECE_SIZE;
+    while (piece_size < MAX_PIECE_SIZE && file_size > (long)piece_size * PIECE_TARGET_COUNT) {
+        piece_size *= 2;
+    }
+    return piece_size;
+}
+
+// Is this a piece size we can work with? (a power of two in range, or the old fixed one)
+int valid_piece_size(int piece_size) {
+    if (piece_size == LEGACY_PIECE_SIZE) return 1;
+    return piece_size >= MIN_PIECE_SIZE && piece_size <= MAX_PIECE_SIZE &&
+           (piece_size & (piece_size - 1)) == 0;
+}
+
+
+// Determine how many pieces of piece_size bytes we need for a file
+int calculate_num_pieces(long file_size, int piece_size) {
+    return (file_size + piece_size - 1) / piece_size;
 }
 
 
@@ -46,12 +68,13 @@ int split_file(char *filepath, char *output_dir) {
         filename = filepath;  // No '/' found, use whole string
     }
     
-    // Calculate number of pieces
-    int num_pieces = calculate_num_pieces(file_size);
+    // Pick the piece size, then calculate number of pieces
+    int piece_size = choose_piece_size(file_size);
+    int num_pieces = calculate_num_pieces(file_size, piece_size);
     
     printf("File size: %ld bytes\n", file_size);
     printf("Number of pieces: %d\n", num_pieces);
-    printf("Piece size: %d bytes\n", PIECE_SIZE);
+    printf("Piece size: %d bytes\n", piece_size);
     
     // Create output directory if it doesn't exist
     char mkdir_cmd[512];
@@ -59,7 +82,7 @@ int split_file(char *filepath, char *output_dir) {
     system(mkdir_cmd);
     
     // Buffer to hold one piece
-    char *buffer = (char*)malloc(PIECE_SIZE);
+    char *buffer = (char*)malloc(piece_size);
     if (!buffer) {
         printf("✗ Memory allocation failed\n");
         fclose(file);
@@ -69,7 +92,7 @@ int split_file(char *filepath, char *output_dir) {
     // Split file into pieces
     for (int i = 0; i < num_pieces; i++) {
         // Read one piece from file
-        size_t bytes_read = fread(buffer, 1, PIECE_SIZE, file);
+        size_t bytes_read = fread(buffer, 1, piece_size, file);
         
         if (bytes_read == 0) {
             break;
@@ -79,6 +102,10 @@ int split_file(char *filepath, char *output_dir) {
         char piece_filename[512];
         sprintf(piece_filename, "%s/%s.piece%d", output_dir, filename, i);
         
+        // An old piece file may be a link into the piece store, shared with
+        // other files: drop our link instead of writing through it
+        unlink(piece_filename);
+        
         // Write piece to file
         FILE *piece_file = fopen(piece_filename, "wb");
         if (!piece_file) {
@@ -92,6 +119,13 @@ int split_file(char *filepath, char *output_dir) {
         printf("✓ Created piece %d (%zu bytes)\n", i, bytes_read);
     }
     
+    // An earlier split (other piece size, longer file) may have left more pieces
+    for (int i = num_pieces; ; i++) {
+        char piece_filename[512];
+        sprintf(piece_filename, "%s/%s.piece%d", output_dir, filename, i);
+        if (unlink(piece_filename) != 0) break;
+    }
+    
     free(buffer);
     fclose(file);
     
@@ -100,14 +134,14 @@ int split_file(char *filepath, char *output_dir) {
 }
 
 // Assemble pieces back into original file
-int assemble_file(char *filename, char *pieces_dir, int num_pieces, char *output_filename) {
+int assemble_file(char *filename, char *pieces_dir, int num_pieces, int piece_size, char *output_filename) {
     FILE *output_file = fopen(output_filename, "wb");
     if (!output_file) {
         printf("✗ Cannot create output file: %s\n", output_filename);
         return -1;
     }
     
-    char *buffer = (char*)malloc(PIECE_SIZE);
+    char *buffer = (char*)malloc(piece_size);
     if (!buffer) {
         printf("✗ Memory allocation failed\n");
         fclose(output_file);
@@ -132,7 +166,7 @@ int assemble_file(char *filename, char *pieces_dir, int num_pieces, char *output
         }
         
         // Read piece
-        size_t bytes_read = fread(buffer, 1, PIECE_SIZE, piece_file);
+        size_t bytes_read = fread(buffer, 1, piece_size, piece_file);
         
         // Write to output file
         fwrite(buffer, 1, bytes_read, output_file);
@@ -148,7 +182,7 @@ int assemble_file(char *filename, char *pieces_dir, int num_pieces, char *output
     return 0;
 }
 
-// Read a specific piece from disk
+// Read a specific piece from disk (buffer holds MAX_PIECE_SIZE bytes)
 int read_piece(char *filename, char *pieces_dir, int piece_index, char *buffer, int *bytes_read) {
     char piece_filename[512];
     sprintf(piece_filename, "%s/%s.piece%d", pieces_dir, filename, piece_index);
@@ -159,7 +193,29 @@ int read_piece(char *filename, char *pieces_dir, int piece_index, char *buffer,
         return -1;
     }
     
-    *bytes_read = fread(buffer, 1, PIECE_SIZE, piece_file);
+    *bytes_read = fread(buffer, 1, MAX_PIECE_SIZE, piece_file);
+    fclose(piece_file);
+    
+    return 0;
+}
+
+// Read one block of a piece from disk (no need to load the whole piece)
+int read_block(char *filename, char *pieces_dir, int piece_index, int offset, int length, char *buffer, int *bytes_read) {
+    char piece_filename[512];
+    sprintf(piece_filename, "%s/%s.piece%d", pieces_dir, filename, piece_index);
+    
+    FILE *piece_file = fopen(piece_filename, "rb");
+    if (!piece_file) {
+        printf("✗ Cannot open piece %d\n", piece_index);
+        return -1;
+    }
+    
+    if (fseek(piece_file, offset, SEEK_SET) != 0) {
+        fclose(piece_file);
+        return -1;
+    }
+    
+    *bytes_read = fread(buffer, 1, length, piece_file);
     fclose(piece_file);
     
     return 0;
@@ -184,5 +240,107 @@ int save_piece(char *filename, char *pieces_dir, int piece_index, char *data, in
     fwrite(data, 1, data_size, piece_file);
     fclose(piece_file);
     
+    return 0;
+}
+
+// Create the destination file of a download at its full size
+// The space is reserved up front (no fragmentation, no "disk full" halfway);
+// filesystems without fallocate() get a sparse file instead
+int create_output_file(char *path, long file_size) {
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        return -1;
+    }
+    
+    if (file_size > 0 && fallocate(fd, 0, 0, file_size) != 0) {
+        if ((errno != EOPNOTSUPP && errno != ENOSYS) || ftruncate(fd, file_size) != 0) {
+            close(fd);
+            unlink(path);
+            return -1;
+        }
+    }
+    
+    return fd;
+}
+
+// Reopen the destination file of an interrupted download
+// Returns an open file descriptor, or -1 if it is missing or has the wrong size
+int open_output_file(char *path, long file_size) {
+    int fd = open(path, O_RDWR);
+    if (fd < 0) {
+        return -1;
+    }
+    
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size != file_size) {
+        close(fd);
+        return -1;
+    }
+    
+    return fd;
+}
+
+// Write a whole piece at its place in the file: piece_index * piece_size
+int write_piece_at(int fd, int piece_size, int piece_index, char *data, int data_size) {
+    off_t position = (off_t)piece_index * piece_size;
+    
+    // pwrite() may write less than asked: keep going
+    while (data_size > 0) {
+        ssize_t written = pwrite(fd, data, data_size, position);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        data += written;
+        data_size -= written;
+        position += written;
+    }
+    
+    return 0;
+}
+
+// read_block() for a piece stored in place in a whole file
+int read_block_at(int fd, int piece_size, int piece_index, int offset, int length, char *buffer, int *bytes_read) {
+    ssize_t got = pread(fd, buffer, length, (off_t)piece_index * piece_size + offset);
+    if (got < 0) {
+        return -1;
+    }
+    
+    *bytes_read = got;
+    return 0;
+}
+
+// Copy part of one file into another without passing it through our memory
+// copy_file_range() lets btrfs and XFS share the blocks instead of copying
+// them; older kernels (or two filesystems) get a plain read and write
+int copy_file_part(int in_fd, long in_offset, int out_fd, long out_offset, long length) {
+    loff_t in_pos = in_offset;
+    loff_t out_pos = out_offset;
+    long done = 0;
+    
+    while (done < length) {
+        ssize_t n = copy_file_range(in_fd, &in_pos, out_fd, &out_pos, length - done, 0);
+        if (n <= 0) break;
+        done += n;
+    }
+    
+    char buffer[65536];
+    while (done < length) {
+        long want = (length - done < (long)sizeof(buffer)) ? length - done : (long)sizeof(buffer);
+        ssize_t got = pread(in_fd, buffer, want, in_offset + done);
+        if (got <= 0) {
+            return -1;
+        }
+        for (ssize_t written = 0; written < got; ) {
+            ssize_t n = pwrite(out_fd, buffer + written, got - written, out_offset + done + written);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                return -1;
+            }
+            written += n;
+        }
+        done += got;
+    }
+    
     return 0;
 }
\ No newline at end of file
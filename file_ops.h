@@ -4,19 +4,45 @@
 // Get file size
 long get_file_size(char *filename);
 
+// Piece size for a file of file_size bytes (a power of two, see protocol.h)
+int choose_piece_size(long file_size);
+
+// 1 if a peer may use this piece size, 0 if not
+int valid_piece_size(int piece_size);
+
 // Calculate number of pieces needed
-int calculate_num_pieces(long file_size);
+int calculate_num_pieces(long file_size, int piece_size);
 
-// Split file into pieces
+// Split file into pieces (of choose_piece_size() bytes)
 int split_file(char *filename, char *output_dir);
 
 // Assemble pieces into complete file
-int assemble_file(char *filename, char *pieces_dir, int num_pieces, char *output_filename);
+int assemble_file(char *filename, char *pieces_dir, int num_pieces, int piece_size, char *output_filename);
 
-// Read a specific piece
+// Read a specific piece (buffer holds MAX_PIECE_SIZE bytes)
 int read_piece(char *filename, char *pieces_dir, int piece_index, char *buffer, int *bytes_read);
 
+// Read part of a piece (length bytes starting at offset)
+int read_block(char *filename, char *pieces_dir, int piece_index, int offset, int length, char *buffer, int *bytes_read);
+
 // Save a piece
 int save_piece(char *filename, char *pieces_dir, int piece_index, char *data, int data_size);
 
+// Create a file of file_size bytes (space reserved) to write pieces into
+// Returns an open file descriptor, or -1
+int create_output_file(char *path, long file_size);
+
+// Reopen that file to resume a download. -1 if it is missing or has the wrong size
+int open_output_file(char *path, long file_size);
+
+// Write a piece at its position in the file (piece_index * piece_size)
+int write_piece_at(int fd, int piece_size, int piece_index, char *data, int data_size);
+
+// Read part of a piece from a file written with write_piece_at()
+int read_block_at(int fd, int piece_size, int piece_index, int offset, int length, char *buffer, int *bytes_read);
+
+// Copy length bytes from one open file to another, at the given offsets
+// (in the kernel with copy_file_range(); shared blocks where the filesystem can)
+int copy_file_part(int in_fd, long in_offset, int out_fd, long out_offset, long length);
+
 #endif
\ No newline at end of file
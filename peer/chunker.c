@@ -0,0 +1,305 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <openssl/sha.h>
+#include "chunker.h"
+#include "piece_hash.h"
+#include "wire.h"
+#include "../file_ops.h"
+
+// The gear hash: h = (h << 1) + gear[byte]. After 64 bytes every older byte
+// has been shifted out, so h at a position depends on the 64 bytes ending
+// there and nothing else - which is what lets several lanes compute it at
+// once, each from its own part of the file.
+//
+// A boundary needs the top bits of h to be zero (the top bits have seen the
+// most bytes). Before the average size the test is harder (more bits), after
+// it easier, so chunk sizes bunch up around the average ("normalized
+// chunking" in FastCDC).
+#define CDC_MASK_HARD 0xFFFFC00000000000ULL   // 18 bits: before CDC_AVG_SIZE
+#define CDC_MASK_EASY 0xFFFC000000000000ULL   // 14 bits: after it
+#define CDC_WINDOW (4 * 1024 * 1024)          // Candidates are found this many bytes at a time
+#define CDC_LANES 4
+
+#define CANDIDATE_EASY 1
+#define CANDIDATE_HARD 2      // Passes the hard test (and so the easy one)
+
+static unsigned long long gear[256];
+static pthread_once_t gear_once = PTHREAD_ONCE_INIT;
+
+// Every peer must cut at the same places: the table comes from a fixed seed (splitmix64)
+static void init_gear() {
+    unsigned long long state = 0x50325043444321ULL;
+    for (int i = 0; i < 256; i++) {
+        unsigned long long z = (state += 0x9E3779B97F4A7C15ULL);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        gear[i] = z ^ (z >> 31);
+    }
+}
+
+static unsigned char candidate(unsigned long long h) {
+    if ((h & CDC_MASK_HARD) == 0) return CANDIDATE_HARD | CANDIDATE_EASY;
+    return ((h & CDC_MASK_EASY) == 0) ? CANDIDATE_EASY : 0;
+}
+
+// Gear hash just before position `start`: the 63 bytes before it are all that count
+static unsigned long long warm_up(const unsigned char *data, long start) {
+    unsigned long long h = 0;
+    for (long i = (start > 63) ? start - 63 : 0; i < start; i++) {
+        h = (h << 1) + gear[data[i]];
+    }
+    return h;
+}
+
+// Mark every position in [from, to) where a chunk could end
+// The range is cut in CDC_LANES parts whose hashes are computed side by side:
+// one hash chain is a long line of dependent shift-and-adds, four of them
+// keep the CPU's execution units busy (and candidates are rare, so each
+// position costs a load, a shift, an add and a well-predicted branch)
+static void find_candidates(const unsigned char *data, long from, long to, unsigned char *flags) {
+    memset(flags, 0, to - from);
+
+    long lane_length = (to - from) / CDC_LANES;
+    const unsigned char *p0 = data + from;
+    const unsigned char *p1 = p0 + lane_length;
+    const unsigned char *p2 = p1 + lane_length;
+    const unsigned char *p3 = p2 + lane_length;
+    unsigned long long h0 = warm_up(data, from);
+    unsigned long long h1 = warm_up(data, from + lane_length);
+    unsigned long long h2 = warm_up(data, from + 2 * lane_length);
+    unsigned long long h3 = warm_up(data, from + 3 * lane_length);
+
+    for (long i = 0; i < lane_length; i++) {
+        h0 = (h0 << 1) + gear[p0[i]];
+        h1 = (h1 << 1) + gear[p1[i]];
+        h2 = (h2 << 1) + gear[p2[i]];
+        h3 = (h3 << 1) + gear[p3[i]];
+        if (!(h0 & CDC_MASK_EASY)) flags[i] = candidate(h0);
+        if (!(h1 & CDC_MASK_EASY)) flags[lane_length + i] = candidate(h1);
+        if (!(h2 & CDC_MASK_EASY)) flags[2 * lane_length + i] = candidate(h2);
+        if (!(h3 & CDC_MASK_EASY)) flags[3 * lane_length + i] = candidate(h3);
+    }
+
+    // What's left after the last lane carries on its hash
+    for (long i = from + CDC_LANES * lane_length; i < to; i++) {
+        h3 = (h3 << 1) + gear[data[i]];
+        flags[i - from] = candidate(h3);
+    }
+}
+
+// Work shared by the threads that hash chunks
+typedef struct {
+    const unsigned char *data;
+    Chunk *chunks;
+    int count;
+    int next;            // Next chunk nobody took yet (atomic)
+} ChunkHashJob;
+
+static void* chunk_hash_worker(void *arg) {
+    ChunkHashJob *job = (ChunkHashJob*)arg;
+    while (1) {
+        int i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED);
+        if (i >= job->count) break;
+        SHA256(job->data + job->chunks[i].offset, job->chunks[i].length, job->chunks[i].hash);
+    }
+    return NULL;
+}
+
+int chunk_buffer(const unsigned char *data, long size, Chunk **chunks) {
+    pthread_once(&gear_once, init_gear);
+
+    int cap = (int)(size / CDC_AVG_SIZE) + 16;
+    Chunk *list = (Chunk*)malloc(cap * sizeof(Chunk));
+    unsigned char *flags = (unsigned char*)malloc(CDC_WINDOW);
+    if (!list || !flags) {
+        free(list);
+        free(flags);
+        return -1;
+    }
+
+    // Boundaries: candidates for a window of the file, then FastCDC's rules
+    // (skip CDC_MIN_SIZE, hard test up to CDC_AVG_SIZE, easy test up to CDC_MAX_SIZE)
+    int count = 0;
+    long window_start = 0, window_end = 0;
+    long start = 0;
+    while (start < size) {
+        long limit = (size - start < CDC_MAX_SIZE) ? size : start + CDC_MAX_SIZE;
+        long normal = (size - start < CDC_AVG_SIZE) ? size : start + CDC_AVG_SIZE;
+        long end = limit;
+
+        if (size - start > CDC_MIN_SIZE) {
+            if (limit > window_end) {
+                window_start = start;
+                window_end = (size - start < CDC_WINDOW) ? size : start + CDC_WINDOW;
+                find_candidates(data, window_start, window_end, flags);
+            }
+            long i;
+            for (i = start + CDC_MIN_SIZE; i < normal; i++) {
+                if (flags[i - window_start] & CANDIDATE_HARD) break;
+            }
+            if (i == normal) {
+                for (; i < limit; i++) {
+                    if (flags[i - window_start] & CANDIDATE_EASY) break;
+                }
+            }
+            if (i < limit) end = i + 1;
+        }
+
+        if (count == cap) {
+            cap *= 2;
+            Chunk *grown = (Chunk*)realloc(list, cap * sizeof(Chunk));
+            if (!grown) {
+                free(list);
+                free(flags);
+                return -1;
+            }
+            list = grown;
+        }
+        list[count].offset = start;
+        list[count].length = (int)(end - start);
+        count++;
+        start = end;
+    }
+    free(flags);
+
+    // Hashes: each chunk on its own, on every core
+    ChunkHashJob job = { data, list, count, 0 };
+    int thread_count = hash_thread_count();
+    if (thread_count > count) thread_count = count;
+
+    pthread_t threads[MAX_HASH_THREADS];
+    int started = 0;
+    for (int i = 1; i < thread_count; i++) {
+        if (pthread_create(&threads[started], NULL, chunk_hash_worker, &job) != 0) break;
+        started++;
+    }
+    chunk_hash_worker(&job);
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    *chunks = list;
+    return count;
+}
+
+int chunk_file(char *path, Chunk **chunks) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return -1;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return -1;
+    }
+    if (st.st_size == 0) {
+        close(fd);
+        *chunks = NULL;
+        return 0;
+    }
+
+    unsigned char *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) return -1;
+    madvise(data, st.st_size, MADV_SEQUENTIAL);
+
+    int count = chunk_buffer(data, st.st_size, chunks);
+    munmap(data, st.st_size);
+    return count;
+}
+
+int create_chunk_manifest(char *filepath, char *chunks_path) {
+    Chunk *chunks = NULL;
+    long file_size;
+    FileStamp stamp;
+    int count = (get_file_stamp(filepath, &file_size, &stamp) == 0) ? chunk_file(filepath, &chunks) : -1;
+    if (count < 0) return -1;
+
+    // Temporary name, then rename: readers never see half a manifest
+    char temp_path[600];
+    snprintf(temp_path, sizeof(temp_path), "%s.tmp%lu", chunks_path, (unsigned long)pthread_self());
+
+    FILE *fp = fopen(temp_path, "wb");
+    if (!fp) {
+        free(chunks);
+        return -1;
+    }
+
+    ChunksHeader header = { CHUNKS_MAGIC, CHUNKS_VERSION, CDC_MIN_SIZE, CDC_AVG_SIZE, CDC_MAX_SIZE,
+                            count, file_size, stamp };
+    int written = (fwrite(&header, sizeof(header), 1, fp) == 1);
+    for (int i = 0; i < count && written; i++) {
+        unsigned char entry[CHUNK_ENTRY_SIZE];
+        put_u32(entry, chunks[i].length);
+        memcpy(entry + 4, chunks[i].hash, HASH_SIZE);
+        written = (fwrite(entry, CHUNK_ENTRY_SIZE, 1, fp) == 1);
+    }
+    written = (fclose(fp) == 0) && written;
+    free(chunks);
+
+    if (!written || rename(temp_path, chunks_path) != 0) {
+        unlink(temp_path);
+        return -1;
+    }
+    return count;
+}
+
+unsigned char* load_chunk_manifest(char *chunks_path, char *filepath, int *count) {
+    long file_size;
+    FileStamp stamp;
+    if (get_file_stamp(filepath, &file_size, &stamp) != 0) return NULL;
+
+    FILE *fp = fopen(chunks_path, "rb");
+    if (!fp) return NULL;
+
+    ChunksHeader header;
+    if (fread(&header, sizeof(header), 1, fp) != 1 ||
+        header.magic != CHUNKS_MAGIC || header.version != CHUNKS_VERSION ||
+        header.min_size != CDC_MIN_SIZE || header.avg_size != CDC_AVG_SIZE ||
+        header.max_size != CDC_MAX_SIZE || header.file_size != file_size ||
+        memcmp(&header.stamp, &stamp, sizeof(stamp)) != 0 ||
+        (long long)header.num_chunks * CDC_MIN_SIZE > file_size + CDC_MIN_SIZE) {
+        fclose(fp);
+        return NULL;  // Missing, damaged, made with other sizes, or for an older version of the file
+    }
+
+    size_t size = (size_t)header.num_chunks * CHUNK_ENTRY_SIZE;
+    unsigned char *entries = (unsigned char*)malloc(size + 1);
+    if (entries && fread(entries, 1, size, fp) != size) {
+        free(entries);
+        entries = NULL;
+    }
+    fclose(fp);
+
+    *count = header.num_chunks;
+    return entries;
+}
+
+Chunk* parse_chunk_entries(const unsigned char *entries, int count, long file_size) {
+    Chunk *chunks = (Chunk*)malloc((count + 1) * sizeof(Chunk));
+    if (!chunks) return NULL;
+
+    long long offset = 0;
+    for (int i = 0; i < count; i++) {
+        int length = (int)get_u32(entries + (size_t)i * CHUNK_ENTRY_SIZE);
+        if (length <= 0 || length > CDC_MAX_SIZE || offset + length > file_size) {
+            free(chunks);
+            return NULL;
+        }
+        chunks[i].offset = offset;
+        chunks[i].length = length;
+        memcpy(chunks[i].hash, entries + (size_t)i * CHUNK_ENTRY_SIZE + 4, HASH_SIZE);
+        offset += length;
+    }
+
+    if (offset != file_size) {
+        free(chunks);
+        return NULL;
+    }
+    return chunks;
+}
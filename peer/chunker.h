@@ -0,0 +1,66 @@
+#ifndef CHUNKER_H
+#define CHUNKER_H
+
+#include "../common/protocol.h"
+#include "piece_hash.h"
+
+// Content-defined chunking (FastCDC), so a new version of a file can be
+// built from the old one
+// Fixed pieces move when bytes are inserted: one byte at the start changes
+// every piece. Chunk boundaries are picked by the content instead, where a
+// rolling "gear" hash of the last 64 bytes has enough zero bits, so they
+// move with the data and only the chunks around a change are new.
+//
+// Chunks are only used to find data we already have. Transfers still use
+// the fixed pieces: a downloader with an older version copies every chunk
+// both versions have into place, and fetches only the pieces that are
+// still missing something.
+//
+// A shared file gets a chunk manifest (pieces/<file>.chunks) next to its
+// piece manifest: one entry per chunk, its length and SHA-256.
+
+#define CDC_MIN_SIZE  16384     // No boundary closer than this to the last one
+#define CDC_AVG_SIZE  65536     // Chunks are around this size (a power of two)
+#define CDC_MAX_SIZE  262144    // Always a boundary here
+
+#define CHUNKS_MAGIC 0x43503250    // "P2PC"
+#define CHUNKS_VERSION 2           // 1 had no FileStamp
+#define CHUNK_ENTRY_SIZE (4 + HASH_SIZE)   // length (4, big-endian), SHA-256 (32)
+
+typedef struct {
+    unsigned int magic;
+    unsigned int version;
+    unsigned int min_size;
+    unsigned int avg_size;
+    unsigned int max_size;
+    unsigned int num_chunks;
+    long long file_size;
+    FileStamp stamp;           // The version of the file it lists (see piece_hash.h)
+} ChunksHeader;
+
+typedef struct {
+    long long offset;
+    int length;
+    unsigned char hash[HASH_SIZE];
+} Chunk;
+
+// Split a buffer into chunks and hash them (on every core)
+// Returns the number of chunks in *chunks (the caller frees it), or -1
+int chunk_buffer(const unsigned char *data, long size, Chunk **chunks);
+
+// Chunk a whole file (mmap'd). Returns the number of chunks, or -1
+int chunk_file(char *path, Chunk **chunks);
+
+// Chunk a file and write its chunk manifest. Returns the number of chunks, or -1
+int create_chunk_manifest(char *filepath, char *chunks_path);
+
+// Read a chunk manifest, only if it was made from the file at filepath as it
+// is now (same size, inode and mtime)
+// Returns count * CHUNK_ENTRY_SIZE bytes (wire format) the caller frees, or NULL
+unsigned char* load_chunk_manifest(char *chunks_path, char *filepath, int *count);
+
+// Turn count wire entries into chunks (offsets added up)
+// Returns the chunks (caller frees), or NULL if they don't add up to file_size
+Chunk* parse_chunk_entries(const unsigned char *entries, int count, long file_size);
+
+#endif
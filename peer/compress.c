@@ -0,0 +1,90 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+#include <zlib.h>
+#include <openssl/sha.h>
+#include "compress.h"
+
+// One cached block: its SHA-256 and its compressed form (length 0 = goes out raw)
+typedef struct {
+    unsigned char key[HASH_SIZE];
+    int used;
+    int length;
+    unsigned char *data;
+} CachedBlock;
+
+// Direct-mapped: the hash picks a block's one slot, and a newer block that
+// lands there takes it over. Every upload thread shares it
+static CachedBlock cache[COMPRESS_CACHE_BLOCKS];
+static pthread_mutex_t cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+int looks_incompressible(const char *data, int length) {
+    int counts[256] = { 0 };
+    int samples = 0;
+    for (int i = 0; i < length; i += COMPRESS_PROBE_STRIDE) {
+        counts[(unsigned char)data[i]]++;
+        samples++;
+    }
+    if (samples < 256) return 0;  // Too few bytes to tell: let zlib try
+
+    // Shannon entropy of the sample: 8 bits per byte means no redundancy left
+    double bits = 0;
+    for (int b = 0; b < 256; b++) {
+        if (counts[b] == 0) continue;
+        double p = (double)counts[b] / samples;
+        bits -= p * log2(p);
+    }
+    return bits > COMPRESS_ENTROPY_LIMIT;
+}
+
+int compress_block(const char *data, int length, unsigned char *out) {
+    // Random-looking data goes out raw before it costs a hash or a cache slot
+    if (looks_incompressible(data, length)) return 0;
+
+    unsigned char key[HASH_SIZE];
+    SHA256((const unsigned char*)data, length, key);
+    CachedBlock *slot = &cache[((key[0] << 8) | key[1]) % COMPRESS_CACHE_BLOCKS];
+
+    pthread_mutex_lock(&cache_mutex);
+    if (slot->used && memcmp(slot->key, key, HASH_SIZE) == 0) {
+        int cached = slot->length;
+        if (cached > 0) memcpy(out, slot->data, cached);
+        pthread_mutex_unlock(&cache_mutex);
+        return cached;
+    }
+    pthread_mutex_unlock(&cache_mutex);
+
+    // Not cached: compress outside the lock (other uploads go on).
+    // zlib gets only as much room as we'd accept: a block that doesn't fit
+    // (Z_BUF_ERROR) didn't shrink enough and goes out raw
+    int packed = 0;
+    uLongf size = length - length / COMPRESS_MIN_SAVING;
+    if (compress2(out, &size, (const Bytef*)data, length, COMPRESS_LEVEL) == Z_OK && size < (uLongf)length) {
+        packed = (int)size;
+    }
+
+    unsigned char *copy = (packed > 0) ? (unsigned char*)malloc(packed) : NULL;
+    if (packed > 0 && !copy) return packed;  // Sent compressed, just not cached
+    if (copy) memcpy(copy, out, packed);
+
+    // Every block zlib went through is cached, the ones that didn't shrink
+    // too (length 0): they aren't tried again
+    pthread_mutex_lock(&cache_mutex);
+    free(slot->data);
+    memcpy(slot->key, key, HASH_SIZE);
+    slot->used = 1;
+    slot->length = packed;
+    slot->data = copy;
+    pthread_mutex_unlock(&cache_mutex);
+    return packed;
+}
+
+int inflate_block(const unsigned char *in, int in_length, char *out, int length) {
+    uLongf size = length;
+    if (uncompress((Bytef*)out, &size, in, in_length) != Z_OK || size != (uLongf)length) {
+        return -1;
+    }
+    return 0;
+}
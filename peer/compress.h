@@ -0,0 +1,35 @@
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include "../common/protocol.h"
+
+// Block compression for uploads (zlib), offered with CAP_COMPRESS
+// Logs, CSVs and text dumps shrink several times over, and on a slow link
+// that is several times the speed. Data that is already compressed (video,
+// archives, random bytes) doesn't shrink at all, so a quick entropy probe
+// sends it raw before it is hashed, cached or given to zlib.
+//
+// Hot blocks are requested by many downloaders: the compressed form of every
+// block that passed the probe is kept in a cache named by the block's
+// SHA-256, so each is compressed once. One that passed but didn't shrink
+// is remembered the same way and sent raw.
+
+#define COMPRESS_LEVEL 1              // zlib's fastest level: it has to keep up with the link
+#define COMPRESS_ENTROPY_LIMIT 7.5    // Bits per byte above which a block is sent as it is
+#define COMPRESS_PROBE_STRIDE 4       // The probe looks at every 4th byte
+#define COMPRESS_MIN_SAVING 8         // Compressed form must be 1/8 smaller to be worth it
+#define COMPRESS_CACHE_BLOCKS 4096    // Blocks kept (64 MB of data, less once compressed)
+
+// Does a block look like it won't compress? 1 = yes (random-looking bytes), 0 = no
+int looks_incompressible(const char *data, int length);
+
+// Compressed form of a block, from the cache or made now (and cached)
+// out holds at least `length` bytes
+// Returns the compressed length, or 0 if the block should go out raw
+int compress_block(const char *data, int length, unsigned char *out);
+
+// Inflate a compressed block into exactly `length` bytes
+// Returns 0, or -1 if it is damaged or has another size
+int inflate_block(const unsigned char *in, int in_length, char *out, int length);
+
+#endif
@@ -0,0 +1,964 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "download_engine.h"
+#include "hash_pool.h"
+#include "wire.h"
+#include "compress.h"
+
+// Connection states
+#define CONN_CLOSED 0       // No socket: (re)connect on the next tick
+#define CONN_CONNECTING 1   // Non-blocking connect() in progress
+#define CONN_HELLO 2        // HELLO sent, waiting for the peer's answer
+#define CONN_READY 3        // Asking for blocks
+#define CONN_DEAD 4         // Given up on this peer
+
+// What a request asked for
+#define REQ_BLOCK 0
+#define REQ_HAVE 1
+#define REQ_BITFIELD 2
+
+#define TEXT_LINE_MAX 256   // Longest reply line a text peer sends
+
+// A request we sent to a peer and are waiting on
+typedef struct {
+    int kind;
+    int piece;
+    int offset;             // REQ_HAVE: the HAVE log position we asked from
+    int length;
+    struct timespec sent;   // For the peer's RTT estimate
+    int cancelled;          // Endgame: another peer delivered it first, CANCEL sent
+    unsigned int id;        // Frame request id (protocol v2)
+} PendingRequest;
+
+// One peer connection and where it is in its conversation
+typedef struct {
+    int peer_index;
+    int fd;                 // -1 while closed
+    int state;
+    time_t state_since;     // When the current connect or HELLO started
+    time_t last_heard;      // Last time the peer sent us something
+    time_t idle_since;      // Nothing to ask this peer for since then (0 = busy)
+    int errors;             // Failed requests in a row
+
+    // Protocol, agreed on with HELLO
+    int plain;              // The peer hung up on HELLO: talk text right away
+    int version;
+    unsigned int caps;
+    unsigned int next_id;
+    int have_bitfield;      // We know which pieces it has: blocks may be requested
+    int can_cancel;
+
+    // Requests sent and not answered yet, oldest first (replies come in this order)
+    PendingRequest in_flight[MAX_PIPELINE_DEPTH];
+    int head;
+    int outstanding;
+
+    // Bytes received but not parsed yet
+    char *in_buf;
+    int in_len;
+    int in_cap;
+
+    // Requests the socket could not take yet (sent when EPOLLOUT fires)
+    char *out_buf;
+    int out_len;
+    int out_cap;
+    int out_sent;
+} EngineConn;
+
+typedef struct {
+    DownloadContext *ctx;
+    int epoll_fd;
+    EngineConn *conns;      // conns[i] talks to ctx->peers[i]
+    int conn_count;
+    HashPool pool;          // Checks and writes finished pieces
+    unsigned char *unproven; // Per piece: a block came without a proof, hash the whole piece
+    char inflated[BLOCK_SIZE]; // A ZBLOCK's data, inflated (on_block copies it out)
+} DownloadEngine;
+
+
+// Milliseconds since a request was sent
+static double ms_since(struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000.0 + (now.tv_nsec - start->tv_nsec) / 1e6;
+}
+
+// Make a socket non-blocking so one slow peer can never stall the loop
+static int set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0) return -1;
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+static void watch(DownloadEngine *e, EngineConn *c, int op, unsigned int events) {
+    struct epoll_event ev;
+    ev.events = events;
+    ev.data.ptr = c;
+    epoll_ctl(e->epoll_fd, op, c->fd, &ev);
+}
+
+static void close_conn(DownloadEngine *e, EngineConn *c) {
+    if (c->fd >= 0) {
+        epoll_ctl(e->epoll_fd, EPOLL_CTL_DEL, c->fd, NULL);
+        close(c->fd);
+    }
+    c->fd = -1;
+    c->in_len = 0;
+    c->out_len = 0;
+    c->out_sent = 0;
+}
+
+// Put every outstanding block back so other peers can fetch it
+static void give_back_requests(DownloadEngine *e, EngineConn *c) {
+    while (c->outstanding > 0) {
+        PendingRequest *req = &c->in_flight[c->head];
+        if (req->kind == REQ_BLOCK) {
+            mark_block_failed(e->ctx, c->peer_index, req->piece, req->offset);
+        }
+        c->head = (c->head + 1) % MAX_PIPELINE_DEPTH;
+        c->outstanding--;
+    }
+    c->head = 0;
+}
+
+// Stop using this peer for the rest of the download
+static void give_up(DownloadEngine *e, EngineConn *c) {
+    give_back_requests(e, c);
+    close_conn(e, c);
+    c->state = CONN_DEAD;
+}
+
+// The connection broke or went out of sync: everything still outstanding on
+// it is lost. We reconnect on the next tick, unless the peer keeps failing
+static void conn_failed(DownloadEngine *e, EngineConn *c, int count_error) {
+    give_back_requests(e, c);
+    close_conn(e, c);
+    c->state = CONN_CLOSED;
+
+    if (count_error) {
+        shrink_pipeline_window(e->ctx, c->peer_index);
+        if (++c->errors >= MAX_PEER_ERRORS) c->state = CONN_DEAD;
+    }
+}
+
+// The connection ended: hung up (eof = 1), reset, or sent something we can't read
+static void conn_broken(DownloadEngine *e, EngineConn *c, int eof) {
+    if (c->state == CONN_HELLO) {
+        // The oldest peers close the connection on a command they don't know:
+        // talk text to them on a fresh one
+        close_conn(e, c);
+        c->plain = 1;
+        c->state = CONN_CLOSED;
+        return;
+    }
+
+    // A peer closing an idle keep-alive connection is no error
+    conn_failed(e, c, !(eof && c->outstanding == 0));
+}
+
+// Queue bytes for the peer
+// We try to send right away, whatever the socket does not accept is kept
+// in out_buf and flushed later when epoll reports the socket writable
+static int queue_output(DownloadEngine *e, EngineConn *c, const char *data, int len) {
+    // Nothing waiting in front of us: try to send directly
+    if (c->out_len == c->out_sent) {
+        c->out_len = 0;
+        c->out_sent = 0;
+
+        while (len > 0) {
+            ssize_t sent = send(c->fd, data, len, MSG_NOSIGNAL);
+            if (sent < 0) {
+                if (errno == EINTR) continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+                return -1;
+            }
+            data += sent;
+            len -= sent;
+        }
+
+        if (len == 0) return 0;
+    }
+
+    // Keep the rest for later
+    if (c->out_len + len > c->out_cap) {
+        int new_cap = c->out_cap ? c->out_cap : 1024;
+        while (new_cap < c->out_len + len) new_cap *= 2;
+
+        char *grown = realloc(c->out_buf, new_cap);
+        if (!grown) return -1;
+        c->out_buf = grown;
+        c->out_cap = new_cap;
+    }
+    memcpy(c->out_buf + c->out_len, data, len);
+    c->out_len += len;
+
+    // Ask epoll to tell us when the socket can take more
+    watch(e, c, EPOLL_CTL_MOD, EPOLLIN | EPOLLOUT);
+    return 0;
+}
+
+// Send as much of the queued output as the socket accepts
+static int flush_output(DownloadEngine *e, EngineConn *c) {
+    while (c->out_sent < c->out_len) {
+        ssize_t sent = send(c->fd, c->out_buf + c->out_sent, c->out_len - c->out_sent, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            return -1;
+        }
+        c->out_sent += sent;
+    }
+
+    // Everything is out, stop watching for EPOLLOUT
+    c->out_len = 0;
+    c->out_sent = 0;
+    watch(e, c, EPOLL_CTL_MOD, EPOLLIN);
+    return 0;
+}
+
+// Send a request and add it to the connection's outstanding requests
+// REQ_HAVE asks from HAVE log position `offset`. Returns 0, or -1 if the connection broke
+static int send_request(DownloadEngine *e, EngineConn *c, int kind, int piece, int offset, int length) {
+    char *filename = e->ctx->filename;
+    PendingRequest *req = &c->in_flight[(c->head + c->outstanding) % MAX_PIPELINE_DEPTH];
+    req->kind = kind;
+    req->piece = piece;
+    req->offset = offset;
+    req->length = length;
+    req->cancelled = 0;
+    req->id = 0;
+    clock_gettime(CLOCK_MONOTONIC, &req->sent);
+
+    unsigned char message[FRAME_HEADER_SIZE + 12 + sizeof(e->ctx->filename) + 64];
+    int len;
+
+    if (c->version >= 2) {
+        unsigned char fields[12];
+        int fields_len = 0;
+        int type = FRAME_BITFIELD;
+        if (kind == REQ_BLOCK) {
+            put_u32(fields, piece);
+            put_u32(fields + 4, offset);
+            put_u32(fields + 8, length);
+            fields_len = 12;
+            type = FRAME_REQUEST_BLOCK;
+        } else if (kind == REQ_HAVE) {
+            put_u32(fields, offset);
+            fields_len = 4;
+            type = FRAME_HAVE;
+        }
+        req->id = c->next_id++;
+        len = wire_encode(message, type, req->id, fields, fields_len, filename, strlen(filename));
+    } else if (kind == REQ_BLOCK) {
+        // With piece hashes to check them against, ask for proofs (older peers ignore PROOF)
+        len = sprintf((char*)message, "REQUEST_BLOCK %s %d %d %d%s\n", filename, piece, offset, length,
+                      e->ctx->piece_hashes ? " PROOF" : "");
+    } else if (kind == REQ_HAVE) {
+        len = sprintf((char*)message, "HAVE %s %d\n", filename, offset);
+    } else {
+        len = sprintf((char*)message, "BITFIELD %s\n", filename);
+    }
+
+    // The peer's time to answer starts now if it had nothing to do
+    if (c->outstanding == 0) c->last_heard = time(NULL);
+    c->outstanding++;
+    return queue_output(e, c, (char*)message, len);
+}
+
+// Endgame: tell the peer to skip a request another peer already answered
+static int send_cancel(DownloadEngine *e, EngineConn *c, PendingRequest *req) {
+    char message[FRAME_HEADER_SIZE + sizeof(e->ctx->filename) + 64];
+    int len;
+
+    if (c->version >= 2) {
+        unsigned char target[4];
+        put_u32(target, req->id);
+        len = wire_encode((unsigned char*)message, FRAME_CANCEL, req->id, target, 4, NULL, 0);
+    } else {
+        len = sprintf(message, "CANCEL %s %d %d\n", e->ctx->filename, req->piece, req->offset);
+    }
+    req->cancelled = 1;
+    return queue_output(e, c, message, len);
+}
+
+// A block arrived from `from`: cancel the duplicate requests for it on the other connections
+static void cancel_duplicates(DownloadEngine *e, EngineConn *from, int piece, int offset) {
+    for (int i = 0; i < e->conn_count; i++) {
+        EngineConn *c = &e->conns[i];
+        if (c == from || c->state != CONN_READY || !c->can_cancel) continue;
+
+        for (int j = 0; j < c->outstanding; j++) {
+            PendingRequest *req = &c->in_flight[(c->head + j) % MAX_PIPELINE_DEPTH];
+            if (req->kind != REQ_BLOCK || req->cancelled) continue;
+            if (req->piece != piece || req->offset != offset) continue;
+
+            if (send_cancel(e, c, req) != 0) conn_failed(e, c, 1);
+            break;
+        }
+    }
+}
+
+// Keep the pipe full: up to the peer's window of requests waiting for replies
+// Returns 0, or -1 if the connection broke
+static int fill_window(DownloadEngine *e, EngineConn *c, time_t now) {
+    DownloadContext *ctx = e->ctx;
+    if (c->state != CONN_READY || !c->have_bitfield) return 0;
+
+    int window = get_pipeline_window(ctx, c->peer_index);
+
+    // A peer that is still downloading tells us about its new pieces
+    int seq;
+    if (c->outstanding < window && peer_have_poll_due(ctx, c->peer_index, &seq)) {
+        if (send_request(e, c, REQ_HAVE, -1, seq, 0) != 0) return -1;
+    }
+
+    int piece, offset, length;
+    while (c->outstanding < window &&
+           get_next_block(ctx, c->peer_index, &piece, &offset, &length) == 0) {
+        if (send_request(e, c, REQ_BLOCK, piece, offset, length) != 0) return -1;
+    }
+
+    if (c->outstanding > 0) {
+        c->idle_since = 0;
+        return 0;
+    }
+
+    // This peer has nothing we still need right now. A seed stays: blocks may
+    // fail back to it, or the download may reach endgame and need duplicates
+    if (peer_is_seed(ctx, c->peer_index)) return 0;
+
+    // A peer that is still downloading may get more: wait for HAVE, but not forever
+    if (c->idle_since == 0) {
+        c->idle_since = now;
+    } else if (now - c->idle_since > PARTIAL_PEER_PATIENCE) {
+        give_up(e, c);
+    }
+    return 0;
+}
+
+// HELLO is done (or skipped): learn which pieces the peer has before asking for any
+static int start_requests(DownloadEngine *e, EngineConn *c) {
+    c->state = CONN_READY;
+
+    if (c->version >= 2 && !(c->caps & CAP_BITFIELD)) {
+        set_peer_bitfield(e->ctx, c->peer_index, NULL, e->ctx->num_pieces);  // Can't tell: assume a full copy
+        c->have_bitfield = 1;
+        c->can_cancel = (c->caps & CAP_CANCEL) != 0;
+        return 0;
+    }
+    return send_request(e, c, REQ_BITFIELD, -1, 0, 0);
+}
+
+// Open a non-blocking connection to the peer; the rest happens in the event loop
+static void start_connect(DownloadEngine *e, EngineConn *c) {
+    PeerConnection *peer = &e->ctx->peers[c->peer_index];
+
+    c->version = 1;
+    c->caps = 0;
+    c->next_id = 1;
+    c->have_bitfield = 0;
+    c->can_cancel = 0;
+    c->head = 0;
+    c->outstanding = 0;
+    c->state_since = time(NULL);
+
+    c->fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (c->fd < 0 || set_nonblocking(c->fd) < 0) {
+        give_up(e, c);
+        return;
+    }
+
+    // Requests are small: send them right away instead of waiting to fill a packet
+    int opt = 1;
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+
+    struct sockaddr_in peer_addr;
+    memset(&peer_addr, 0, sizeof(peer_addr));
+    peer_addr.sin_family = AF_INET;
+    peer_addr.sin_port = htons(peer->port);
+    peer_addr.sin_addr.s_addr = inet_addr(peer->ip);
+
+    // Usually returns EINPROGRESS; epoll reports the socket writable once connected
+    if (connect(c->fd, (struct sockaddr *)&peer_addr, sizeof(peer_addr)) < 0 && errno != EINPROGRESS) {
+        give_up(e, c);  // Peer unreachable, the others carry on
+        return;
+    }
+
+    c->state = CONN_CONNECTING;
+    watch(e, c, EPOLL_CTL_ADD, EPOLLIN | EPOLLOUT);
+}
+
+// connect() finished: say HELLO, or go straight to text requests
+static void finish_connect(DownloadEngine *e, EngineConn *c) {
+    int error = 0;
+    socklen_t len = sizeof(error);
+    if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &error, &len) < 0 || error != 0) {
+        give_up(e, c);
+        return;
+    }
+
+    watch(e, c, EPOLL_CTL_MOD, EPOLLIN);
+    c->state_since = time(NULL);
+    c->last_heard = c->state_since;
+
+    if (c->plain) {
+        if (start_requests(e, c) != 0) conn_failed(e, c, 1);
+        return;
+    }
+
+    unsigned char hello[8];
+    unsigned char frame[FRAME_HEADER_SIZE + sizeof(hello)];
+    wire_hello(hello);
+
+    // Proofs are no use without piece hashes to check them against
+    if (!e->ctx->piece_hashes) put_u32(hello + 2, WIRE_CAPS & ~CAP_MERKLE);
+    int frame_len = wire_encode(frame, FRAME_HELLO, 0, hello, sizeof(hello), NULL, 0);
+
+    c->state = CONN_HELLO;
+    if (queue_output(e, c, (char*)frame, frame_len) != 0) conn_broken(e, c, 0);
+}
+
+// Take the oldest outstanding request, its reply is here
+static PendingRequest pop_request(EngineConn *c) {
+    PendingRequest req = c->in_flight[c->head];
+    c->head = (c->head + 1) % MAX_PIPELINE_DEPTH;
+    c->outstanding--;
+    return req;
+}
+
+// A block arrived. proof: its Merkle proof (merkle_proof_hashes() hashes), NULL if the peer sent none
+static void on_block(DownloadEngine *e, EngineConn *c, PendingRequest *req, char *data,
+                     unsigned char *proof) {
+    DownloadContext *ctx = e->ctx;
+    c->errors = 0;
+    record_peer_latency(ctx, c->peer_index, ms_since(&req->sent));
+
+    if (ctx->piece_hashes && proof) {
+        // Checked on its own: a peer that sends bad data is caught at its first block
+        if (!verify_block(ctx->piece_hashes + (size_t)req->piece * HASH_SIZE, ctx->piece_size,
+                          req->offset / BLOCK_SIZE, data, req->length, proof)) {
+            printf("\n✗ Peer %d sent a bad block (piece %d, offset %d), dropping it\n",
+                   c->peer_index + 1, req->piece, req->offset);
+            mark_block_failed(ctx, c->peer_index, req->piece, req->offset);
+            ban_peer(ctx, c->peer_index);
+            give_up(e, c);
+            return;
+        }
+    } else {
+        e->unproven[req->piece] = 1;
+    }
+
+    char *piece_data = mark_block_received(ctx, c->peer_index, req->piece, req->offset,
+                                           data, req->length);
+    if (piece_data) {
+        // That was the last block: a worker checks the piece's hash (unless every
+        // block was proven already) and saves it (see on_piece_checked), we go on
+        // with the sockets
+        int proven = !e->unproven[req->piece];
+        e->unproven[req->piece] = 0;
+        if (hash_pool_submit(&e->pool, req->piece, c->peer_index, piece_data,
+                             get_piece_length(ctx, req->piece), proven) != 0) {
+            mark_piece_failed(ctx, req->piece);
+        }
+    }
+
+    // Endgame: the other peers needn't send this block any more
+    if (in_endgame(ctx)) cancel_duplicates(e, c, req->piece, req->offset);
+}
+
+// A worker is done with a piece: count it, or fetch it again if it was corrupt
+static void on_piece_checked(DownloadEngine *e, PieceJob *job) {
+    DownloadContext *ctx = e->ctx;
+
+    if (job->result == PIECE_SAVE_FAILED) {
+        printf("\n✗ Cannot save piece %d\n", job->piece_index);
+        ctx->failed = 1;  // Disk full or gone: no point downloading more
+        return;
+    }
+
+    if (job->result == PIECE_CORRUPT) {
+        printf("\n✗ Piece %d failed its hash check, fetching it again\n", job->piece_index);
+        mark_piece_corrupt(ctx, job->piece_index);
+
+        // A peer that keeps sending bad data is no use to us
+        for (int i = 0; i < e->conn_count; i++) {
+            EngineConn *c = &e->conns[i];
+            if (c->state != CONN_DEAD && peer_is_banned(ctx, c->peer_index)) {
+                printf("✗ Dropping peer %d: too many corrupt pieces\n", c->peer_index + 1);
+                give_up(e, c);
+            }
+        }
+        return;
+    }
+
+    mark_piece_completed(ctx, job->piece_index, job->peer_index);
+
+    update_progress(ctx->progress, job->length);
+    display_progress(ctx->progress);
+
+    // Show which peer just contributed (color coded!)
+    printf(" [P%d]", job->peer_index + 1);
+    fflush(stdout);
+}
+
+// Results from the hash pool (its eventfd fired, or the download is over)
+static void collect_pieces(DownloadEngine *e, PieceJob *jobs) {
+    while (jobs) {
+        PieceJob *next = jobs->next;
+        on_piece_checked(e, jobs);
+        free(jobs);
+        jobs = next;
+    }
+}
+
+// Ask every ready peer for more (a corrupt piece is free again: idle peers fetch it right away)
+static void fill_all_windows(DownloadEngine *e) {
+    time_t now = time(NULL);
+    for (int i = 0; i < e->conn_count; i++) {
+        if (fill_window(e, &e->conns[i], now) != 0) conn_failed(e, &e->conns[i], 1);
+    }
+}
+
+static void on_bitfield(DownloadEngine *e, EngineConn *c, unsigned char *bits, int seq) {
+    set_peer_bitfield(e->ctx, c->peer_index, bits, seq);
+    c->have_bitfield = 1;
+    c->can_cancel = (c->version >= 2) ? (c->caps & CAP_CANCEL) != 0 : 1;
+}
+
+static void on_haves(DownloadEngine *e, EngineConn *c, int new_seq, unsigned char *raw, int count) {
+    int pieces[MAX_HAVES_PER_REPLY];
+    for (int i = 0; i < count; i++) {
+        pieces[i] = get_u32(raw + i * 4);
+    }
+    add_peer_haves(e->ctx, c->peer_index, pieces, count, new_seq);
+}
+
+// The peer answered ERROR. unknown_command: it doesn't know the request at all
+static void on_error(DownloadEngine *e, EngineConn *c, PendingRequest *req, int unknown_command) {
+    if (req->kind == REQ_BITFIELD) {
+        if (unknown_command) {
+            // An old seeder: it has everything, but doesn't know CANCEL either
+            set_peer_bitfield(e->ctx, c->peer_index, NULL, e->ctx->num_pieces);
+            c->have_bitfield = 1;
+            c->can_cancel = 0;
+        } else {
+            // "File not found": the peer doesn't have it (any more)
+            unsigned char *none = (unsigned char*)calloc((e->ctx->num_pieces + 7) / 8, 1);
+            if (!none) {
+                give_up(e, c);
+                return;
+            }
+            on_bitfield(e, c, none, 0);
+            free(none);
+        }
+        return;
+    }
+
+    // Peer doesn't have it - let someone else try, give up on a peer that keeps refusing
+    if (req->kind == REQ_BLOCK) {
+        mark_block_failed(e->ctx, c->peer_index, req->piece, req->offset);
+    }
+    if (++c->errors >= MAX_PEER_ERRORS) give_up(e, c);
+}
+
+// Answer to our HELLO at the start of the buffer
+// Returns the bytes used, 0 if it isn't all here yet, -1 if it isn't a HELLO
+static int parse_hello(DownloadEngine *e, EngineConn *c, unsigned char *p, int avail) {
+    int used;
+
+    if (p[0] != FRAME_MAGIC) {
+        // A text peer: it answered our HELLO like any unknown command
+        unsigned char *newline = memchr(p, '\n', avail);
+        if (!newline) return (avail > TEXT_LINE_MAX) ? -1 : 0;
+        used = newline - p + 1;
+        c->version = 1;
+    } else {
+        if (avail < FRAME_HEADER_SIZE) return 0;
+        unsigned int length = get_u32(p + 4);
+        if (p[1] != FRAME_HELLO || length < 6 || length > 64) return -1;
+        if (avail < FRAME_HEADER_SIZE + (int)length) return 0;
+
+        unsigned char *hello = p + FRAME_HEADER_SIZE;
+        c->version = (hello[0] << 8) | hello[1];
+        c->caps = get_u32(hello + 2) & WIRE_CAPS;
+        used = FRAME_HEADER_SIZE + length;
+    }
+
+    return (start_requests(e, c) == 0) ? used : -1;
+}
+
+// Reply (protocol v2) to the oldest outstanding request at the start of the buffer
+// Returns the bytes used, 0 if it isn't all here yet, -1 if the stream is out of sync
+static int parse_frame_reply(DownloadEngine *e, EngineConn *c, unsigned char *p, int avail) {
+    DownloadContext *ctx = e->ctx;
+    if (avail < FRAME_HEADER_SIZE) return 0;
+
+    PendingRequest *req = &c->in_flight[c->head];
+    unsigned int length = get_u32(p + 4);
+    if (p[0] != FRAME_MAGIC || length > FRAME_MAX_PAYLOAD || get_u32(p + 8) != req->id) return -1;
+    if (avail < FRAME_HEADER_SIZE + (int)length) return 0;
+
+    int type = p[1];
+    unsigned char *payload = p + FRAME_HEADER_SIZE;
+    int used = FRAME_HEADER_SIZE + length;
+
+    if (type == FRAME_ERROR) {
+        PendingRequest done = pop_request(c);
+        on_error(e, c, &done, 0);
+        return used;
+    }
+
+    if (req->kind == REQ_BLOCK) {
+        if (type == FRAME_CANCELLED && length == 0) {
+            pop_request(c);  // Cancelled duplicate, the block came from another peer
+            return used;
+        }
+        // With CAP_MERKLE the proof sits between the position and the data
+        // (one hash per tree level: how many depends on the piece size)
+        int proof_hashes = merkle_proof_hashes(ctx->piece_size);
+        int proof_size = (c->caps & CAP_MERKLE) ? 4 + proof_hashes * HASH_SIZE : 0;
+        int data_len = (int)length - 8 - proof_size;
+        int valid = (type == FRAME_BLOCK) ? data_len == req->length :
+                    (type == FRAME_ZBLOCK && (c->caps & CAP_COMPRESS)) ? data_len > 0 && data_len < req->length : 0;
+        if (!valid ||
+            (int)get_u32(payload) != req->piece || (int)get_u32(payload + 4) != req->offset ||
+            (proof_size && (int)get_u32(payload + 8) != proof_hashes)) {
+            return -1;
+        }
+
+        // A ZBLOCK is inflated first: the proof and piece hash cover the real data
+        char *data = (char*)payload + 8 + proof_size;
+        if (type == FRAME_ZBLOCK) {
+            if (inflate_block((unsigned char*)data, data_len, e->inflated, req->length) != 0) return -1;
+            ctx->peers[c->peer_index].zblock_bytes += req->length;
+            ctx->peers[c->peer_index].zblock_wire_bytes += data_len;
+            data = e->inflated;
+        }
+        PendingRequest done = pop_request(c);
+        on_block(e, c, &done, data, proof_size ? payload + 12 : NULL);
+        return used;
+    }
+
+    if (req->kind == REQ_HAVE) {
+        if (type != FRAME_HAVE || length < 8) return -1;
+        int count = get_u32(payload + 4);
+        if (count < 0 || count > MAX_HAVES_PER_REPLY || length != 8 + (unsigned int)count * 4) return -1;
+        pop_request(c);
+        on_haves(e, c, get_u32(payload), payload + 8, count);
+        return used;
+    }
+
+    int size = (ctx->num_pieces + 7) / 8;
+    if (type != FRAME_BITFIELD || length != 8 + (unsigned int)size ||
+        (int)get_u32(payload) != ctx->num_pieces) {
+        return -1;
+    }
+    pop_request(c);
+    on_bitfield(e, c, payload + 8, get_u32(payload + 4));
+    return used;
+}
+
+// parse_frame_reply() for text peers: a reply line, then its binary data (if any)
+static int parse_text_reply(DownloadEngine *e, EngineConn *c, unsigned char *p, int avail) {
+    DownloadContext *ctx = e->ctx;
+    unsigned char *newline = memchr(p, '\n', avail);
+    if (!newline) return (avail > TEXT_LINE_MAX) ? -1 : 0;
+
+    int line_len = newline - p + 1;
+    if (line_len > TEXT_LINE_MAX) return -1;
+    char line[TEXT_LINE_MAX];
+    memcpy(line, p, line_len - 1);
+    line[line_len - 1] = '\0';
+
+    PendingRequest *req = &c->in_flight[c->head];
+
+    if (strncmp(line, "ERROR", 5) == 0) {
+        PendingRequest done = pop_request(c);
+        on_error(e, c, &done, strstr(line, "Unknown command") != NULL);
+        return line_len;
+    }
+
+    int a, b, n, k;
+    if (req->kind == REQ_BLOCK) {
+        if (sscanf(line, "CANCELLED %d %d", &a, &b) == 2) {
+            if (a != req->piece || b != req->offset) return -1;
+            pop_request(c);
+            return line_len;
+        }
+        // A fourth number is the proof's hash count (peers that don't know PROOF leave it out)
+        int fields = sscanf(line, "SEND_BLOCK %d %d %d %d", &a, &b, &n, &k);
+        if (fields < 3 || a != req->piece || b != req->offset || n != req->length ||
+            (fields == 4 && k != merkle_proof_hashes(ctx->piece_size))) {
+            return -1;
+        }
+        int proof_size = (fields == 4) ? k * HASH_SIZE : 0;
+        if (avail < line_len + proof_size + n) return 0;
+        PendingRequest done = pop_request(c);
+        on_block(e, c, &done, (char*)p + line_len + proof_size, (fields == 4) ? p + line_len : NULL);
+        return line_len + proof_size + n;
+    }
+
+    if (req->kind == REQ_HAVE) {
+        if (sscanf(line, "HAVE %d %d", &a, &n) != 2 || n < 0 || n > MAX_HAVES_PER_REPLY) return -1;
+        if (avail < line_len + n * 4) return 0;
+        pop_request(c);
+        on_haves(e, c, a, p + line_len, n);
+        return line_len + n * 4;
+    }
+
+    if (sscanf(line, "BITFIELD %d %d", &a, &b) != 2 || a != ctx->num_pieces) return -1;
+    int size = (a + 7) / 8;
+    if (avail < line_len + size) return 0;
+    pop_request(c);
+    on_bitfield(e, c, p + line_len, b);
+    return line_len + size;
+}
+
+// Handle every complete reply in the input buffer
+// Returns 0, 1 if we gave up on the peer on the way, -1 if the stream is out of sync
+static int process_input(DownloadEngine *e, EngineConn *c) {
+    int used = 0;
+
+    while (c->fd >= 0 && used < c->in_len) {
+        unsigned char *p = (unsigned char*)c->in_buf + used;
+        int avail = c->in_len - used;
+        int n;
+
+        if (c->state == CONN_HELLO) {
+            n = parse_hello(e, c, p, avail);
+        } else if (c->outstanding == 0) {
+            n = -1;  // Nothing asked, nothing expected
+        } else if (c->version >= 2) {
+            n = parse_frame_reply(e, c, p, avail);
+        } else {
+            n = parse_text_reply(e, c, p, avail);
+        }
+
+        if (n < 0) return -1;
+        if (n == 0) break;  // Rest of the reply is still on its way
+        used += n;
+    }
+
+    if (c->fd < 0) return 1;
+
+    // Keep the start of an incomplete reply for the next read
+    memmove(c->in_buf, c->in_buf + used, c->in_len - used);
+    c->in_len -= used;
+    return 0;
+}
+
+// Read everything the socket has and handle the replies in it
+// Returns 0, 1 if we gave up on the peer, -1 on error, -2 if the peer hung up
+static int handle_readable(DownloadEngine *e, EngineConn *c) {
+    while (1) {
+        if (c->in_cap - c->in_len < ENGINE_READ_SIZE) {
+            char *grown = realloc(c->in_buf, c->in_len + ENGINE_READ_SIZE);
+            if (!grown) return -1;
+            c->in_buf = grown;
+            c->in_cap = c->in_len + ENGINE_READ_SIZE;
+        }
+
+        ssize_t n = recv(c->fd, c->in_buf + c->in_len, c->in_cap - c->in_len, 0);
+        if (n > 0) {
+            c->in_len += n;
+            c->last_heard = time(NULL);
+
+            int result = process_input(e, c);
+            if (result != 0) return result;
+            if (c->in_len > FRAME_MAX_PAYLOAD + FRAME_HEADER_SIZE) return -1;  // No reply is that big
+            continue;
+        }
+        if (n == 0) return -2;
+        if (errno == EINTR) continue;
+        if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+        return -1;
+    }
+}
+
+static void handle_event(DownloadEngine *e, EngineConn *c, unsigned int events) {
+    if (c->fd < 0) return;  // Closed earlier in this round
+
+    if (c->state == CONN_CONNECTING) {
+        finish_connect(e, c);
+        return;
+    }
+
+    if ((events & EPOLLOUT) && flush_output(e, c) != 0) {
+        conn_broken(e, c, 0);
+        return;
+    }
+
+    if (events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+        int result = handle_readable(e, c);
+        if (result == 1) return;
+        if (result < 0) {
+            conn_broken(e, c, result == -2);
+            return;
+        }
+    }
+
+    // Replies make room in the window: ask for more right away
+    if (fill_window(e, c, time(NULL)) != 0) conn_failed(e, c, 1);
+}
+
+// Timeouts, reconnects, and new requests for peers that had no events
+static void engine_tick(DownloadEngine *e) {
+    time_t now = time(NULL);
+
+    for (int i = 0; i < e->conn_count; i++) {
+        EngineConn *c = &e->conns[i];
+
+        if (c->state == CONN_CLOSED) {
+            start_connect(e, c);
+        } else if (c->state == CONN_CONNECTING) {
+            if (now - c->state_since > PEER_REQUEST_TIMEOUT) give_up(e, c);
+        } else if (c->state == CONN_HELLO) {
+            // A peer that reads HELLO and says nothing: try text
+            if (now - c->state_since > HELLO_TIMEOUT) conn_broken(e, c, 1);
+        } else if (c->state == CONN_READY) {
+            // A peer that stops answering must not hold its blocks forever
+            if (c->outstanding > 0 && now - c->last_heard > PEER_REQUEST_TIMEOUT) {
+                conn_failed(e, c, 1);
+            } else if (fill_window(e, c, now) != 0) {
+                conn_failed(e, c, 1);
+            }
+        }
+    }
+}
+
+// Connections for peers added to the context since we last looked
+static void add_new_peers(DownloadEngine *e) {
+    while (e->conn_count < e->ctx->peer_count) {
+        EngineConn *c = &e->conns[e->conn_count];
+        memset(c, 0, sizeof(EngineConn));
+        c->peer_index = e->conn_count;
+        c->fd = -1;
+        e->conn_count++;
+        start_connect(e, c);
+    }
+}
+
+// Is there nothing left to wait for?
+static int engine_finished(DownloadEngine *e) {
+    if (is_download_complete(e->ctx) || e->ctx->failed) return 1;
+
+    // Pieces still being checked may fail and have to be fetched again
+    if (e->pool.pending > 0) return 0;
+
+    for (int i = 0; i < e->conn_count; i++) {
+        EngineConn *c = &e->conns[i];
+        if (c->state == CONN_DEAD) continue;
+
+        // Still connecting, or waiting for replies
+        if (c->state != CONN_READY || c->outstanding > 0) return 0;
+
+        // An idle partial peer may still get pieces (fill_window gives up on it in time)
+        if (!peer_is_seed(e->ctx, c->peer_index)) return 0;
+    }
+
+    // Only idle seeds are left: what they have, nobody can give us
+    return 1;
+}
+
+int run_download_engine(DownloadContext *ctx, PeerRefreshFn refresh) {
+    DownloadEngine engine;
+    DownloadEngine *e = &engine;
+    e->ctx = ctx;
+    e->conn_count = 0;
+
+    e->epoll_fd = epoll_create1(0);
+    if (e->epoll_fd < 0) {
+        printf("✗ epoll_create failed\n");
+        return -1;
+    }
+
+    e->conns = (EngineConn*)calloc(MAX_PEERS, sizeof(EngineConn));
+    e->unproven = (unsigned char*)calloc(ctx->num_pieces + 1, 1);
+    if (!e->conns || !e->unproven) {
+        free(e->conns);
+        free(e->unproven);
+        close(e->epoll_fd);
+        return -1;
+    }
+
+    if (hash_pool_start(&e->pool, ctx) != 0) {
+        printf("✗ Cannot start the hashing threads\n");
+        free(e->conns);
+        free(e->unproven);
+        close(e->epoll_fd);
+        return -1;
+    }
+
+    // The pool's eventfd sits in the same epoll set as the sockets (data.ptr NULL)
+    struct epoll_event pool_event;
+    pool_event.events = EPOLLIN;
+    pool_event.data.ptr = NULL;
+    epoll_ctl(e->epoll_fd, EPOLL_CTL_ADD, e->pool.event_fd, &pool_event);
+
+    add_new_peers(e);
+
+    struct epoll_event events[ENGINE_MAX_EVENTS];
+    struct timespec last_tick = { 0, 0 };
+    time_t last_refresh = time(NULL);
+
+    // MAIN LOOP: every connection of the download, one thread
+    while (1) {
+        if (ms_since(&last_tick) >= ENGINE_TICK_MS) {
+            clock_gettime(CLOCK_MONOTONIC, &last_tick);
+            engine_tick(e);
+
+            // Bring in more peers from the tracker while the download runs
+            if (refresh && time(NULL) - last_refresh >= PEER_REFRESH_INTERVAL) {
+                last_refresh = time(NULL);
+                if (ctx->peer_count < MAX_PEERS && !is_download_complete(ctx)) {
+                    refresh(ctx);
+                    add_new_peers(e);
+                }
+            }
+        }
+
+        if (engine_finished(e)) break;
+
+        int n = epoll_wait(e->epoll_fd, events, ENGINE_MAX_EVENTS, ENGINE_TICK_MS);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            printf("✗ epoll_wait failed\n");
+            break;
+        }
+
+        for (int i = 0; i < n; i++) {
+            if (events[i].data.ptr == NULL) {
+                collect_pieces(e, hash_pool_collect(&e->pool));
+                fill_all_windows(e);
+            } else {
+                handle_event(e, events[i].data.ptr, events[i].events);
+            }
+        }
+    }
+
+    // Pieces handed to the workers still count
+    collect_pieces(e, hash_pool_stop(&e->pool));
+
+    // Endgame leaves duplicate requests behind: we don't wait for their replies
+    for (int i = 0; i < e->conn_count; i++) {
+        give_back_requests(e, &e->conns[i]);
+        close_conn(e, &e->conns[i]);
+        free(e->conns[i].in_buf);
+        free(e->conns[i].out_buf);
+    }
+    free(e->conns);
+    free(e->unproven);
+    close(e->epoll_fd);
+
+    return is_download_complete(ctx) ? 0 : -1;
+}
@@ -0,0 +1,25 @@
+#ifndef DOWNLOAD_ENGINE_H
+#define DOWNLOAD_ENGINE_H
+
+#include "multi_source.h"
+
+// Download engine: one thread drives every peer connection of a download
+// Each connection is a small state machine (connecting -> HELLO -> requests)
+// on a non-blocking socket, and one epoll loop waits on all of them at once.
+// A slow peer only costs a few buffers, not a blocked thread, so a download
+// can talk to as many peers as the tracker gives us (MAX_PEERS).
+
+#define ENGINE_MAX_EVENTS 256   // Socket events handled per epoll_wait()
+#define ENGINE_TICK_MS 100      // Timeouts and new requests are checked this often
+#define ENGINE_READ_SIZE 65536  // Bytes read from a socket at a time
+
+// Called every PEER_REFRESH_INTERVAL seconds while the download runs
+// It may add peers to the context (add_peer_to_context); the engine connects to them
+typedef void (*PeerRefreshFn)(DownloadContext *ctx);
+
+// Download from every peer in the context until the file is complete, or no
+// peer can give us anything more. refresh may be NULL
+// Returns 0 when the download is complete, -1 otherwise
+int run_download_engine(DownloadContext *ctx, PeerRefreshFn refresh);
+
+#endif
@@ -0,0 +1,149 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include "hash_pool.h"
+#include "../file_ops.h"
+
+// Hash, then write: a piece only reaches the disk (and the journal) if it is good
+static int check_and_store(DownloadContext *ctx, PieceJob *job) {
+    if (ctx->piece_hashes && !job->proven &&
+        !piece_hash_matches(ctx->piece_hashes + (size_t)job->piece_index * HASH_SIZE, job->data, job->length,
+                            ctx->piece_size)) {
+        return PIECE_CORRUPT;
+    }
+
+    int saved = (ctx->output_fd >= 0)
+        ? write_piece_at(ctx->output_fd, ctx->piece_size, job->piece_index, job->data, job->length)
+        : save_piece(ctx->filename, ctx->downloads_dir, job->piece_index, job->data, job->length);
+    if (saved != 0) return PIECE_SAVE_FAILED;
+
+    journal_mark(&ctx->journal, job->piece_index);  // Data first, then the record that it's there
+    return PIECE_STORED;
+}
+
+static void* hash_pool_worker(void *arg) {
+    HashPool *pool = (HashPool*)arg;
+
+    pthread_mutex_lock(&pool->mutex);
+    while (1) {
+        while (!pool->todo_head && !pool->stop) {
+            pthread_cond_wait(&pool->wake, &pool->mutex);
+        }
+        if (!pool->todo_head) break;  // Stopping, and the queue is empty
+
+        PieceJob *job = pool->todo_head;
+        pool->todo_head = job->next;
+        if (!pool->todo_head) pool->todo_tail = NULL;
+        pthread_mutex_unlock(&pool->mutex);
+
+        // The slow part runs without the lock: pieces are checked side by side
+        job->result = check_and_store(pool->ctx, job);
+        free(job->data);
+        job->data = NULL;
+
+        pthread_mutex_lock(&pool->mutex);
+        job->next = pool->finished;
+        pool->finished = job;
+
+        // Wake the engine (the counter just grows, one read resets it)
+        uint64_t one = 1;
+        if (write(pool->event_fd, &one, sizeof(one)) < 0) {
+            // Only fails if the counter is about to overflow: the engine has been told already
+        }
+    }
+    pthread_mutex_unlock(&pool->mutex);
+    return NULL;
+}
+
+int hash_pool_start(HashPool *pool, DownloadContext *ctx) {
+    pool->ctx = ctx;
+    pool->todo_head = NULL;
+    pool->todo_tail = NULL;
+    pool->finished = NULL;
+    pool->stop = 0;
+    pool->pending = 0;
+    pool->thread_count = 0;
+
+    pool->event_fd = eventfd(0, EFD_NONBLOCK);
+    if (pool->event_fd < 0) return -1;
+
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init(&pool->wake, NULL);
+
+    int wanted = hash_thread_count();
+    for (int i = 0; i < wanted; i++) {
+        if (pthread_create(&pool->threads[i], NULL, hash_pool_worker, pool) != 0) break;
+        pool->thread_count++;
+    }
+
+    if (pool->thread_count == 0) {
+        close(pool->event_fd);
+        pthread_mutex_destroy(&pool->mutex);
+        pthread_cond_destroy(&pool->wake);
+        return -1;
+    }
+    return 0;
+}
+
+int hash_pool_submit(HashPool *pool, int piece_index, int peer_index, char *data, int length, int proven) {
+    PieceJob *job = (PieceJob*)malloc(sizeof(PieceJob));
+    if (!job) {
+        free(data);
+        return -1;
+    }
+    job->piece_index = piece_index;
+    job->peer_index = peer_index;
+    job->data = data;
+    job->length = length;
+    job->proven = proven;
+    job->next = NULL;
+
+    pthread_mutex_lock(&pool->mutex);
+    if (pool->todo_tail) {
+        pool->todo_tail->next = job;
+    } else {
+        pool->todo_head = job;
+    }
+    pool->todo_tail = job;
+    pthread_cond_signal(&pool->wake);
+    pthread_mutex_unlock(&pool->mutex);
+
+    pool->pending++;
+    return 0;
+}
+
+PieceJob* hash_pool_collect(HashPool *pool) {
+    uint64_t count;
+    if (read(pool->event_fd, &count, sizeof(count)) < 0) {
+        // Nothing signalled since the last read: the list may still have jobs
+    }
+
+    pthread_mutex_lock(&pool->mutex);
+    PieceJob *jobs = pool->finished;
+    pool->finished = NULL;
+    pthread_mutex_unlock(&pool->mutex);
+
+    for (PieceJob *job = jobs; job; job = job->next) {
+        pool->pending--;
+    }
+    return jobs;
+}
+
+PieceJob* hash_pool_stop(HashPool *pool) {
+    pthread_mutex_lock(&pool->mutex);
+    pool->stop = 1;
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->mutex);
+
+    for (int i = 0; i < pool->thread_count; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+    PieceJob *jobs = hash_pool_collect(pool);
+
+    close(pool->event_fd);
+    pthread_mutex_destroy(&pool->mutex);
+    pthread_cond_destroy(&pool->wake);
+    return jobs;
+}
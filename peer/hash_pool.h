@@ -0,0 +1,59 @@
+#ifndef HASH_POOL_H
+#define HASH_POOL_H
+
+#include <pthread.h>
+#include "multi_source.h"
+#include "piece_hash.h"
+
+// Hash pool: checks finished pieces and writes them, on worker threads
+// The download engine hands over each piece as its last block arrives and
+// goes straight back to its sockets. A worker hashes the piece, compares it
+// with the manifest, writes it to disk if it matches, and queues the result.
+// Pieces whose blocks were all proven on arrival are only written.
+// An eventfd wakes the engine's epoll loop to pick the results up.
+
+// What happened to a piece
+#define PIECE_STORED 0         // Hash matched (or no manifest), written and journaled
+#define PIECE_CORRUPT 1        // Hash mismatch: not written, must be fetched again
+#define PIECE_SAVE_FAILED 2    // Could not write it
+
+typedef struct PieceJob {
+    int piece_index;
+    int peer_index;            // Peer whose block completed the piece
+    char *data;
+    int length;
+    int proven;                // Every block passed its Merkle proof: no need to hash it again
+    int result;                // PIECE_* once checked
+    struct PieceJob *next;
+} PieceJob;
+
+typedef struct {
+    DownloadContext *ctx;
+    pthread_t threads[MAX_HASH_THREADS];
+    int thread_count;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t wake;
+    PieceJob *todo_head;       // Waiting for a worker, oldest first
+    PieceJob *todo_tail;
+    PieceJob *finished;        // Checked, waiting for the engine
+    int stop;
+
+    int event_fd;              // Readable while there are finished jobs
+    int pending;               // Submitted and not collected yet (engine thread only)
+} HashPool;
+
+// Start the workers. Returns 0, or -1 if nothing could be started
+int hash_pool_start(HashPool *pool, DownloadContext *ctx);
+
+// Check and store a piece (the pool frees data). Returns 0, or -1 if out of memory
+int hash_pool_submit(HashPool *pool, int piece_index, int peer_index, char *data, int length, int proven);
+
+// Take every finished job (any order, NULL if none). The caller frees them
+PieceJob* hash_pool_collect(HashPool *pool);
+
+// Let the workers finish what is queued, then stop them
+// Returns the jobs finished since the last hash_pool_collect() (caller frees them)
+PieceJob* hash_pool_stop(HashPool *pool);
+
+#endif
@@ -2,96 +2,792 @@
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <unistd.h>
 #include "multi_source.h"
 
+static int blocks_in_piece(DownloadContext *ctx, int piece_index);
+static void release_piece(DownloadContext *ctx, int piece_index);
+
+// Piece bitmaps: atomic so readers don't need status_mutex
+// (writers still hold it, so a piece never changes state twice at once)
+static int bitmap_test(unsigned long long *bits, int i) {
+    return (__atomic_load_n(&bits[i / 64], __ATOMIC_ACQUIRE) >> (i % 64)) & 1;
+}
+
+static void bitmap_set(unsigned long long *bits, int i) {
+    __atomic_fetch_or(&bits[i / 64], 1ULL << (i % 64), __ATOMIC_RELEASE);
+}
+
+static void bitmap_clear(unsigned long long *bits, int i) {
+    __atomic_fetch_and(&bits[i / 64], ~(1ULL << (i % 64)), __ATOMIC_RELEASE);
+}
+
+// Sets of peers (endgame: who a block was requested from), status_mutex held
+static void peer_set_add(unsigned long long *set, int peer_index) {
+    set[peer_index / 64] |= 1ULL << (peer_index % 64);
+}
+
+static int peer_set_has(unsigned long long *set, int peer_index) {
+    return (set[peer_index / 64] >> (peer_index % 64)) & 1;
+}
+
+static int peer_set_count(unsigned long long *set) {
+    int count = 0;
+    for (int w = 0; w < PEER_WORDS; w++) count += __builtin_popcountll(set[w]);
+    return count;
+}
+
 void init_download_context(DownloadContext *ctx, char *filename, int num_pieces, 
-                           long file_size, char *downloads_dir) {
+                           long file_size, int piece_size, char *downloads_dir) {
     strcpy(ctx->filename, filename);
     ctx->num_pieces = num_pieces;
     ctx->file_size = file_size;
+    ctx->piece_size = piece_size;
     ctx->peer_count = 0;
     ctx->failed = 0;
     
     strcpy(ctx->downloads_dir, downloads_dir);
+    ctx->output_fd = -1;
+    ctx->journal.fd = -1;
+    ctx->journal.map = NULL;
     
-    // Allocate piece status array
-    ctx->piece_status = (int*)calloc(num_pieces, sizeof(int)); // Track status of each piece (0=not downloaded, 1=downloading, 2=completed)
+    // Piece state bitmaps (one bit per piece, rounded up to whole words)
+    int words = (num_pieces + 63) / 64;
+    ctx->claimed_bits = (unsigned long long*)calloc(words, sizeof(unsigned long long));
+    ctx->done_bits = (unsigned long long*)calloc(words, sizeof(unsigned long long));
+    ctx->pieces_completed = 0;
     ctx->piece_source = (int*)calloc(num_pieces, sizeof(int)); // Track which peer downloaded each piece
     
+    // No manifest yet (the caller sets piece_hashes), nobody sent a bad piece
+    ctx->piece_hashes = NULL;
+    ctx->rejected_by = (int*)malloc(num_pieces * sizeof(int));
+    ctx->suspect = (unsigned char*)calloc(num_pieces, 1);
+    ctx->solo_peer = (int*)malloc(num_pieces * sizeof(int));
+    for (int i = 0; i < num_pieces; i++) {
+        ctx->rejected_by[i] = -1;
+        ctx->solo_peer[i] = -1;
+    }
+    
+    // Block bookkeeping
+    ctx->blocks_per_piece = (piece_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    ctx->block_status = (unsigned char*)calloc((size_t)num_pieces * ctx->blocks_per_piece, 1);
+    ctx->block_owner = (unsigned char*)calloc((size_t)num_pieces * ctx->blocks_per_piece, 1);
+    ctx->blocks_done = (int*)calloc(num_pieces, sizeof(int));
+    ctx->piece_buffers = (char**)calloc(num_pieces, sizeof(char*));
+    ctx->active_pieces = (int*)malloc(num_pieces * sizeof(int));
+    ctx->active_count = 0;
+    
+    // Nobody is known to have anything yet: every piece sits in bucket 0
+    ctx->availability = (int*)calloc(num_pieces, sizeof(int));
+    ctx->pick_order = (int*)malloc(num_pieces * sizeof(int));
+    ctx->pick_pos = (int*)malloc(num_pieces * sizeof(int));
+    for (int i = 0; i < num_pieces; i++) {
+        ctx->pick_order[i] = i;
+        ctx->pick_pos[i] = i;
+    }
+    ctx->bucket_start[0] = 0;
+    for (int a = 1; a <= MAX_PEERS + 1; a++) {
+        ctx->bucket_start[a] = num_pieces;
+    }
+    ctx->pieces_started = 0;
+    
+    ctx->have_log = (int*)malloc(num_pieces * sizeof(int));
+    ctx->have_count = 0;
+    
+    // Every block is missing; endgame starts once only a few are
+    ctx->blocks_remaining = 0;
+    for (int i = 0; i < num_pieces; i++) {
+        ctx->blocks_remaining += blocks_in_piece(ctx, i);
+    }
+    ctx->endgame = 0;
+    ctx->endgame_count = 0;
+    
     // Initialize mutex
-    pthread_mutex_init(&ctx->status_mutex, NULL); // Prevent race conditions when multiple threads access piece_status array
+    pthread_mutex_init(&ctx->status_mutex, NULL); // Prevent race conditions when multiple threads pick blocks
     
     // Initialize progress tracker
     ctx->progress = (ProgressTracker*)malloc(sizeof(ProgressTracker));
     init_progress(ctx->progress, num_pieces, file_size);
 }
 
-void add_peer_to_context(DownloadContext *ctx, char *ip, int port) {
-    if (ctx->peer_count >= MAX_PEERS) return;
+int add_peer_to_context(DownloadContext *ctx, char *ip, int port) {
+    pthread_mutex_lock(&ctx->status_mutex);
+    
+    for (int i = 0; i < ctx->peer_count; i++) {
+        if (strcmp(ctx->peers[i].ip, ip) == 0 && ctx->peers[i].port == port) {
+            pthread_mutex_unlock(&ctx->status_mutex);
+            return -1;
+        }
+    }
+    
+    if (ctx->peer_count >= MAX_PEERS) {
+        pthread_mutex_unlock(&ctx->status_mutex);
+        return -1;
+    }
+    
+    PeerConnection *peer = &ctx->peers[ctx->peer_count];
+    strcpy(peer->ip, ip);
+    peer->port = port;
+    peer->active_downloads = 0;
+    peer->pieces_downloaded = 0;
+    peer->bytes_downloaded = 0;
+    peer->zblock_bytes = 0;
+    peer->zblock_wire_bytes = 0;
+    peer->start_time = time(NULL);
+    peer->last_download_time = 0;
+    peer->pipeline_window = PIPELINE_INITIAL_DEPTH;
+    peer->round_bytes = 0;
+    peer->round_blocks = 0;
+    clock_gettime(CLOCK_MONOTONIC, &peer->round_start);
+    peer->last_round_rate = 0;
+    peer->throughput = 0;
+    peer->min_rtt_ms = 0;
+    peer->min_rtt_time = 0;
+    peer->have_bits = NULL;
+    peer->pieces_held = 0;
+    peer->is_seed = 0;
+    peer->have_seq = 0;
+    peer->last_have_poll = 0;
+    peer->bad_pieces = 0;
+    
+    int index = ctx->peer_count++;
+    pthread_mutex_unlock(&ctx->status_mutex);
+    return index;
+}
+
+// ---- Rarest-first picker ----
+// Free pieces live in pick_order, sorted by availability into buckets.
+// Moving a piece to the next bucket is one swap with the bucket edge, so
+// BITFIELD/HAVE updates are O(1) per piece and picking only looks at the
+// rarest buckets. All of these run with status_mutex held.
+
+static int has_bit(unsigned char *bits, int i) {
+    return (bits[i >> 3] >> (7 - (i & 7))) & 1;
+}
+
+static void set_bit(unsigned char *bits, int i) {
+    bits[i >> 3] |= 0x80 >> (i & 7);
+}
+
+static int peer_has_piece(PeerConnection *peer, int piece_index) {
+    return peer->have_bits && has_bit(peer->have_bits, piece_index);
+}
+
+// Can we ask this peer for the piece? It must have it, not be the one whose
+// copy of it failed the hash check, and a suspect piece that has started
+// belongs to the peer fetching it
+static int peer_may_send(DownloadContext *ctx, int peer_index, int piece_index) {
+    if (!peer_has_piece(&ctx->peers[peer_index], piece_index)) return 0;
+    if (ctx->rejected_by[piece_index] == peer_index) return 0;
+    return !ctx->suspect[piece_index] || ctx->solo_peer[piece_index] < 0 ||
+           ctx->solo_peer[piece_index] == peer_index;
+}
+
+static void swap_pick(DownloadContext *ctx, int i, int j) {
+    int a = ctx->pick_order[i];
+    int b = ctx->pick_order[j];
+    ctx->pick_order[i] = b;
+    ctx->pick_pos[b] = i;
+    ctx->pick_order[j] = a;
+    ctx->pick_pos[a] = j;
+}
+
+// One more peer has this piece: last slot of its bucket becomes first slot of the next
+static void raise_availability(DownloadContext *ctx, int piece_index) {
+    int a = ctx->availability[piece_index];
+    if (a >= MAX_PEERS) return;
+    ctx->availability[piece_index]++;
     
-    strcpy(ctx->peers[ctx->peer_count].ip, ip);
-    ctx->peers[ctx->peer_count].port = port;
-    ctx->peers[ctx->peer_count].active_downloads = 0;
-    ctx->peers[ctx->peer_count].pieces_downloaded = 0;
-    ctx->peers[ctx->peer_count].bytes_downloaded = 0;
-    ctx->peers[ctx->peer_count].start_time = time(NULL);
-    ctx->peers[ctx->peer_count].last_download_time = 0;
-    ctx->peer_count++;
+    int pos = ctx->pick_pos[piece_index];
+    if (pos < 0) return;  // Not free, not in pick_order
+    
+    int last = ctx->bucket_start[a + 1] - 1;
+    swap_pick(ctx, pos, last);
+    ctx->bucket_start[a + 1]--;
 }
 
-int get_next_piece(DownloadContext *ctx) {
-    pthread_mutex_lock(&ctx->status_mutex); // Ensure only ONE thread can access piece_status array at a time
+// Take a piece out of pick_order (it is being downloaded)
+// Walk it to the end of each bucket above it: O(number of buckets)
+static void pick_remove(DownloadContext *ctx, int piece_index) {
+    int pos = ctx->pick_pos[piece_index];
+    for (int b = ctx->availability[piece_index]; b <= MAX_PEERS; b++) {
+        int last = ctx->bucket_start[b + 1] - 1;
+        swap_pick(ctx, pos, last);
+        pos = last;
+        ctx->bucket_start[b + 1]--;
+    }
+    ctx->pick_pos[piece_index] = -1;
+}
+
+// Put a piece back into pick_order (download failed)
+static void pick_insert(DownloadContext *ctx, int piece_index) {
+    int pos = ctx->bucket_start[MAX_PEERS + 1]++;
+    ctx->pick_order[pos] = piece_index;
+    ctx->pick_pos[piece_index] = pos;
+    
+    for (int b = MAX_PEERS; b > ctx->availability[piece_index]; b--) {
+        int first = ctx->bucket_start[b];
+        swap_pick(ctx, pos, first);
+        pos = first;
+        ctx->bucket_start[b]++;
+    }
+}
+
+// Choose a free piece this peer has: rarest first, random among equally rare
+// (so downloaders that start together spread out). Returns -1 if none
+static int pick_piece(DownloadContext *ctx, int peer_index) {
+    int begin = ctx->bucket_start[1];  // Bucket 0: nobody has these
+    int end = ctx->bucket_start[MAX_PEERS + 1];
+    if (begin >= end || !ctx->peers[peer_index].have_bits) return -1;
     
-    int piece = -1;
+    // The first few pieces are random: we get something to share quickly
+    if (ctx->pieces_started < RANDOM_FIRST_PIECES) {
+        for (int tries = 0; tries < 32; tries++) {
+            int piece = ctx->pick_order[begin + rand() % (end - begin)];
+            if (peer_may_send(ctx, peer_index, piece)) return piece;
+        }
+    }
+    
+    for (int a = 1; a <= MAX_PEERS; a++) {
+        int first = ctx->bucket_start[a];
+        int size = ctx->bucket_start[a + 1] - first;
+        if (size == 0) continue;
+        
+        int start = rand() % size;
+        for (int k = 0; k < size; k++) {
+            int piece = ctx->pick_order[first + (start + k) % size];
+            if (peer_may_send(ctx, peer_index, piece)) return piece;
+        }
+    }
+    return -1;
+}
+
+void set_peer_bitfield(DownloadContext *ctx, int peer_index, unsigned char *bits, int seq) {
+    pthread_mutex_lock(&ctx->status_mutex);
+    
+    PeerConnection *peer = &ctx->peers[peer_index];
+    if (peer->have_bits) {
+        // Another worker on the same peer got here first
+        pthread_mutex_unlock(&ctx->status_mutex);
+        return;
+    }
+    
+    peer->have_bits = (unsigned char*)calloc((ctx->num_pieces + 7) / 8, 1);
+    if (!peer->have_bits) {
+        pthread_mutex_unlock(&ctx->status_mutex);
+        return;
+    }
     
-    // Find first piece that's not downloaded or downloading
     for (int i = 0; i < ctx->num_pieces; i++) {
-        if (ctx->piece_status[i] == 0) {
-            ctx->piece_status[i] = 1;  // Mark as downloading
-            piece = i;
-            break;
+        if (!bits || has_bit(bits, i)) {
+            set_bit(peer->have_bits, i);
+            raise_availability(ctx, i);
+            peer->pieces_held++;
+        }
+    }
+    peer->is_seed = (peer->pieces_held == ctx->num_pieces);
+    peer->have_seq = seq;
+    
+    pthread_mutex_unlock(&ctx->status_mutex);
+}
+
+void add_peer_haves(DownloadContext *ctx, int peer_index, int *pieces, int count, int new_seq) {
+    pthread_mutex_lock(&ctx->status_mutex);
+    
+    PeerConnection *peer = &ctx->peers[peer_index];
+    if (peer->have_bits) {
+        for (int i = 0; i < count; i++) {
+            int piece = pieces[i];
+            if (piece < 0 || piece >= ctx->num_pieces || has_bit(peer->have_bits, piece)) continue;
+            
+            set_bit(peer->have_bits, piece);
+            raise_availability(ctx, piece);
+            peer->pieces_held++;
+        }
+        peer->is_seed = (peer->pieces_held == ctx->num_pieces);
+        if (new_seq > peer->have_seq) peer->have_seq = new_seq;
+    }
+    
+    pthread_mutex_unlock(&ctx->status_mutex);
+}
+
+int peer_have_poll_due(DownloadContext *ctx, int peer_index, int *seq) {
+    pthread_mutex_lock(&ctx->status_mutex);
+    
+    PeerConnection *peer = &ctx->peers[peer_index];
+    time_t now = time(NULL);
+    int due = 0;
+    
+    // One worker per interval asks, the others use what it learned
+    if (peer->have_bits && !peer->is_seed && now - peer->last_have_poll >= HAVE_POLL_INTERVAL) {
+        peer->last_have_poll = now;
+        *seq = peer->have_seq;
+        due = 1;
+    }
+    
+    pthread_mutex_unlock(&ctx->status_mutex);
+    return due;
+}
+
+int peer_is_seed(DownloadContext *ctx, int peer_index) {
+    pthread_mutex_lock(&ctx->status_mutex);
+    int seed = ctx->peers[peer_index].is_seed;
+    pthread_mutex_unlock(&ctx->status_mutex);
+    return seed;
+}
+
+int build_bitfield(DownloadContext *ctx, unsigned char *bits) {
+    pthread_mutex_lock(&ctx->status_mutex);
+    
+    memset(bits, 0, (ctx->num_pieces + 7) / 8);
+    for (int i = 0; i < ctx->have_count; i++) {
+        set_bit(bits, ctx->have_log[i]);
+    }
+    int seq = ctx->have_count;
+    
+    pthread_mutex_unlock(&ctx->status_mutex);
+    return seq;
+}
+
+int get_haves_since(DownloadContext *ctx, int seq, int *pieces, int max, int *new_seq) {
+    pthread_mutex_lock(&ctx->status_mutex);
+    
+    if (seq < 0) seq = 0;
+    int count = 0;
+    while (seq + count < ctx->have_count && count < max) {
+        pieces[count] = ctx->have_log[seq + count];
+        count++;
+    }
+    *new_seq = seq + count;
+    
+    pthread_mutex_unlock(&ctx->status_mutex);
+    return count;
+}
+
+int get_piece_length(DownloadContext *ctx, int piece_index) {
+    long remaining = ctx->file_size - (long)piece_index * ctx->piece_size;
+    return (remaining < ctx->piece_size) ? (int)remaining : ctx->piece_size;
+}
+
+static int blocks_in_piece(DownloadContext *ctx, int piece_index) {
+    return (get_piece_length(ctx, piece_index) + BLOCK_SIZE - 1) / BLOCK_SIZE;
+}
+
+static void remove_active_piece(DownloadContext *ctx, int piece_index) {
+    for (int i = 0; i < ctx->active_count; i++) {
+        if (ctx->active_pieces[i] == piece_index) {
+            ctx->active_pieces[i] = ctx->active_pieces[--ctx->active_count];
+            return;
+        }
+    }
+}
+
+static EndgameBlock* find_endgame_block(DownloadContext *ctx, int piece_index, int offset) {
+    for (int i = 0; i < ctx->endgame_count; i++) {
+        if (ctx->endgame_blocks[i].piece == piece_index && ctx->endgame_blocks[i].offset == offset) {
+            return &ctx->endgame_blocks[i];
+        }
+    }
+    return NULL;
+}
+
+// Called with status_mutex held when a peer has no normal work left
+// Near the end a few slow peers hold the last blocks and everybody else sits
+// idle. Once every piece is started and few blocks are missing, we list them
+// and hand each one to more peers; whichever copy arrives first is used.
+static int get_endgame_block(DownloadContext *ctx, int peer_index, int *piece_index, int *block) {
+    if (!ctx->endgame) {
+        // pick_order[0 .. bucket_start[MAX_PEERS + 1]) holds the pieces nobody started.
+        // Bucket 0 (no peer has them yet) can't be fetched anyway, so it doesn't
+        // hold back endgame for the blocks that can
+        int unavailable = ctx->bucket_start[1] - ctx->bucket_start[0];
+        int free_pieces = ctx->bucket_start[MAX_PEERS + 1] - unavailable;
+        int last = ctx->num_pieces - 1;
+        int unavailable_blocks = unavailable * ctx->blocks_per_piece;
+        if (ctx->pick_pos[last] >= 0 && ctx->pick_pos[last] < ctx->bucket_start[1]) {
+            unavailable_blocks -= ctx->blocks_per_piece - blocks_in_piece(ctx, last);  // Shorter last piece
+        }
+        if (free_pieces > 0 || ctx->blocks_remaining - unavailable_blocks > ENDGAME_BLOCKS) return -1;
+        
+        // Enter endgame: remember who already has each missing block in flight
+        ctx->endgame = 1;
+        ctx->endgame_count = 0;
+        for (int i = 0; i < ctx->active_count; i++) {
+            int p = ctx->active_pieces[i];
+            int blocks = blocks_in_piece(ctx, p);
+            for (int b = 0; b < blocks && ctx->endgame_count < ENDGAME_BLOCKS; b++) {
+                size_t slot = (size_t)p * ctx->blocks_per_piece + b;
+                if (ctx->block_status[slot] == 2) continue;
+                
+                EndgameBlock *e = &ctx->endgame_blocks[ctx->endgame_count++];
+                e->piece = p;
+                e->offset = b * BLOCK_SIZE;
+                int piece_length = get_piece_length(ctx, p);
+                e->length = (piece_length - e->offset < BLOCK_SIZE) ? piece_length - e->offset : BLOCK_SIZE;
+                memset(e->requested_by, 0, sizeof(e->requested_by));
+                if (ctx->block_status[slot] == 1) peer_set_add(e->requested_by, ctx->block_owner[slot]);
+            }
+        }
+    }
+    
+    // The missing block with the fewest copies in flight that this peer can send
+    EndgameBlock *best = NULL;
+    int best_copies = MAX_PEERS + 1;
+    for (int i = 0; i < ctx->endgame_count; i++) {
+        EndgameBlock *e = &ctx->endgame_blocks[i];
+        if (peer_set_has(e->requested_by, peer_index)) continue;
+        if (!peer_may_send(ctx, peer_index, e->piece)) continue;
+        if (ctx->block_status[(size_t)e->piece * ctx->blocks_per_piece + e->offset / BLOCK_SIZE] == 2) continue;
+        
+        int copies = peer_set_count(e->requested_by);
+        if (copies < best_copies) {
+            best = e;
+            best_copies = copies;
+        }
+    }
+    if (!best) return -1;
+    
+    peer_set_add(best->requested_by, peer_index);
+    *piece_index = best->piece;
+    *block = best->offset / BLOCK_SIZE;
+    return 0;
+}
+
+int get_next_block(DownloadContext *ctx, int peer_index, int *piece_index, int *offset, int *length) {
+    pthread_mutex_lock(&ctx->status_mutex);
+    
+    int piece = -1, block = -1;
+    
+    // Free blocks of started pieces first: pieces finish sooner, and a late
+    // piece gets spread over every peer that asks for work
+    for (int i = 0; i < ctx->active_count && block < 0; i++) {
+        int p = ctx->active_pieces[i];
+        if (!peer_may_send(ctx, peer_index, p)) continue;
+        
+        unsigned char *status = ctx->block_status + (size_t)p * ctx->blocks_per_piece;
+        int blocks = blocks_in_piece(ctx, p);
+        for (int b = 0; b < blocks; b++) {
+            if (status[b] == 0) {
+                piece = p;
+                block = b;
+                break;
+            }
+        }
+    }
+    
+    // Otherwise start a new piece, rarest first
+    if (block < 0) {
+        piece = pick_piece(ctx, peer_index);
+        if (piece < 0) {
+            // Nothing new for this peer: near the end, help with someone else's blocks
+            if (get_endgame_block(ctx, peer_index, &piece, &block) != 0) {
+                pthread_mutex_unlock(&ctx->status_mutex);
+                return -1;
+            }
         }
     }
     
+    if (block < 0) {
+        
+        ctx->piece_buffers[piece] = (char*)malloc(get_piece_length(ctx, piece));
+        if (!ctx->piece_buffers[piece]) {
+            pthread_mutex_unlock(&ctx->status_mutex);
+            return -1;
+        }
+        
+        bitmap_set(ctx->claimed_bits, piece);  // Mark as downloading
+        pick_remove(ctx, piece);
+        ctx->active_pieces[ctx->active_count++] = piece;
+        ctx->pieces_started++;
+        if (ctx->suspect[piece]) ctx->solo_peer[piece] = peer_index;  // All of it from this peer
+        block = 0;
+    }
+    
+    ctx->block_status[(size_t)piece * ctx->blocks_per_piece + block] = 1;
+    ctx->block_owner[(size_t)piece * ctx->blocks_per_piece + block] = peer_index;
+    
+    *piece_index = piece;
+    *offset = block * BLOCK_SIZE;
+    int piece_length = get_piece_length(ctx, piece);
+    *length = (piece_length - *offset < BLOCK_SIZE) ? piece_length - *offset : BLOCK_SIZE;
+    
+    pthread_mutex_unlock(&ctx->status_mutex);
+    return 0;
+}
+
+// AIMD on throughput, called with status_mutex held after each received block
+// Every `window` blocks we compare this round's rate with the last one:
+// still as fast (or faster) -> one more outstanding request (additive increase)
+// clearly slower -> the peer or the path is overloaded, halve the window
+static void update_pipeline_window(PeerConnection *peer, int bytes) {
+    peer->round_bytes += bytes;
+    peer->round_blocks++;
+    if (peer->round_blocks < peer->pipeline_window) return;
+    
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double elapsed = (now.tv_sec - peer->round_start.tv_sec) +
+                     (now.tv_nsec - peer->round_start.tv_nsec) / 1e9;
+    double rate = (elapsed > 0) ? peer->round_bytes / elapsed : 0;
+    
+    if (peer->last_round_rate == 0 || rate >= peer->last_round_rate * 0.9) {
+        if (peer->pipeline_window < MAX_PIPELINE_DEPTH) peer->pipeline_window++;
+    } else if (rate < peer->last_round_rate * 0.75) {
+        peer->pipeline_window = (peer->pipeline_window > 1) ? peer->pipeline_window / 2 : 1;
+    }
+    
+    // Smoothed throughput for the scheduler
+    peer->throughput = (peer->throughput > 0) ? 0.7 * peer->throughput + 0.3 * rate : rate;
+    
+    peer->last_round_rate = rate;
+    peer->round_bytes = 0;
+    peer->round_blocks = 0;
+    peer->round_start = now;
+}
+
+int get_pipeline_window(DownloadContext *ctx, int peer_index) {
+    pthread_mutex_lock(&ctx->status_mutex);
+    
+    PeerConnection *peer = &ctx->peers[peer_index];
+    int window = peer->pipeline_window;
+    
+    // No point queueing much more than one round trip's worth of data:
+    // extra requests would only sit behind a slow peer instead of going to a fast one
+    if (peer->throughput > 0 && peer->min_rtt_ms > 0) {
+        int bdp_blocks = (int)(peer->throughput * peer->min_rtt_ms / 1000.0 / BLOCK_SIZE);
+        int cap = 2 * bdp_blocks + 4;
+        if (window > cap) window = cap;
+    }
+    
+    // Much slower than the best peer: one request at a time, the rest of the
+    // work goes to faster peers
+    double fastest = 0;
+    for (int i = 0; i < ctx->peer_count; i++) {
+        if (ctx->peers[i].throughput > fastest) fastest = ctx->peers[i].throughput;
+    }
+    if (peer->throughput > 0 && peer->throughput * SLOW_PEER_RATIO < fastest) {
+        window = 1;
+    }
+    
+    pthread_mutex_unlock(&ctx->status_mutex);
+    return window;
+}
+
+void record_peer_latency(DownloadContext *ctx, int peer_index, double ms) {
+    pthread_mutex_lock(&ctx->status_mutex);
+    
+    PeerConnection *peer = &ctx->peers[peer_index];
+    time_t now = time(NULL);
+    
+    // Keep the smallest recent sample: that is the path's round trip without queueing
+    if (peer->min_rtt_ms == 0 || ms < peer->min_rtt_ms || now - peer->min_rtt_time > RTT_WINDOW) {
+        peer->min_rtt_ms = ms;
+        peer->min_rtt_time = now;
+    }
+    
     pthread_mutex_unlock(&ctx->status_mutex);
-    return piece;
 }
 
-void mark_piece_completed(DownloadContext *ctx, int piece_index, int peer_index, int bytes) {
+void shrink_pipeline_window(DownloadContext *ctx, int peer_index) {
     pthread_mutex_lock(&ctx->status_mutex);
     
-    ctx->piece_status[piece_index] = 2;  // Mark as completed
-    ctx->piece_source[piece_index] = peer_index;  // Record which peer
+    PeerConnection *peer = &ctx->peers[peer_index];
+    peer->pipeline_window = (peer->pipeline_window > 1) ? peer->pipeline_window / 2 : 1;
+    
+    // Start a fresh measuring round at the new size
+    peer->round_bytes = 0;
+    peer->round_blocks = 0;
+    peer->last_round_rate = 0;
+    clock_gettime(CLOCK_MONOTONIC, &peer->round_start);
+    
+    pthread_mutex_unlock(&ctx->status_mutex);
+}
+
+char* mark_block_received(DownloadContext *ctx, int peer_index, int piece_index,
+                          int offset, char *data, int length) {
+    pthread_mutex_lock(&ctx->status_mutex);
+    
+    unsigned char *status = &ctx->block_status[(size_t)piece_index * ctx->blocks_per_piece + offset / BLOCK_SIZE];
+    char *finished = NULL;
+    
+    // Only count a block once (and only while its piece is still being put together).
+    // A late reply from a peer whose copy of the piece was bad is dropped
+    if (*status != 2 && ctx->piece_buffers[piece_index] && peer_may_send(ctx, peer_index, piece_index)) {
+        memcpy(ctx->piece_buffers[piece_index] + offset, data, length);
+        *status = 2;
+        ctx->block_owner[(size_t)piece_index * ctx->blocks_per_piece + offset / BLOCK_SIZE] = peer_index;  // Who really sent it
+        ctx->blocks_remaining--;
+        
+        // Peer statistics and pipelining are per block
+        ctx->peers[peer_index].bytes_downloaded += length;
+        ctx->peers[peer_index].last_download_time = time(NULL);
+        update_pipeline_window(&ctx->peers[peer_index], length);
+        
+        if (++ctx->blocks_done[piece_index] == blocks_in_piece(ctx, piece_index)) {
+            // Whole piece is here: hand it to the caller to save
+            finished = ctx->piece_buffers[piece_index];
+            ctx->piece_buffers[piece_index] = NULL;
+            remove_active_piece(ctx, piece_index);
+        }
+    }
+    
+    pthread_mutex_unlock(&ctx->status_mutex);
+    return finished;
+}
+
+void mark_block_failed(DownloadContext *ctx, int peer_index, int piece_index, int offset) {
+    pthread_mutex_lock(&ctx->status_mutex);
+    
+    unsigned char *status = &ctx->block_status[(size_t)piece_index * ctx->blocks_per_piece + offset / BLOCK_SIZE];
+    
+    // In endgame another peer may still be fetching the same block
+    int others = 0;
+    EndgameBlock *e = ctx->endgame ? find_endgame_block(ctx, piece_index, offset) : NULL;
+    if (e) {
+        e->requested_by[peer_index / 64] &= ~(1ULL << (peer_index % 64));
+        others = (peer_set_count(e->requested_by) > 0);
+    }
+    
+    if (*status == 1 && !others) {
+        *status = 0;  // Free again, the next get_next_block() picks it up
+    }
+    
+    // Nobody else may finish a suspect piece: its peer lets go of all of it
+    // (unless it is complete already and only waiting for its hash check)
+    if (ctx->suspect[piece_index] && ctx->solo_peer[piece_index] == peer_index &&
+        ctx->piece_buffers[piece_index]) {
+        release_piece(ctx, piece_index);
+    }
+    
+    pthread_mutex_unlock(&ctx->status_mutex);
+}
+
+void mark_piece_completed(DownloadContext *ctx, int piece_index, int peer_index) {
+    pthread_mutex_lock(&ctx->status_mutex);
+    
+    ctx->piece_source[piece_index] = peer_index;  // Record which peer finished it
+    ctx->have_log[ctx->have_count++] = piece_index;  // Peers downloading from us learn about it with HAVE
     
     // Update peer statistics
     ctx->peers[peer_index].pieces_downloaded++;
-    ctx->peers[peer_index].bytes_downloaded += bytes;
-    ctx->peers[peer_index].last_download_time = time(NULL);
+    
+    // Mark as completed: the piece is on disk, uploaders may serve it now
+    bitmap_set(ctx->done_bits, piece_index);
+    __atomic_add_fetch(&ctx->pieces_completed, 1, __ATOMIC_RELEASE);
     
     pthread_mutex_unlock(&ctx->status_mutex);
 }
 
-void mark_piece_failed(DownloadContext *ctx, int piece_index) {
+void mark_piece_resumed(DownloadContext *ctx, int piece_index) {
     pthread_mutex_lock(&ctx->status_mutex);
     
-    ctx->piece_status[piece_index] = 0;  // Mark as not downloaded (retry later)
+    if (bitmap_test(ctx->claimed_bits, piece_index)) {
+        pthread_mutex_unlock(&ctx->status_mutex);
+        return;
+    }
+    
+    // Never picked, never fetched: it's ours already
+    pick_remove(ctx, piece_index);
+    bitmap_set(ctx->claimed_bits, piece_index);
+    ctx->pieces_started++;
+    ctx->blocks_remaining -= blocks_in_piece(ctx, piece_index);
+    ctx->piece_source[piece_index] = -1;
+    ctx->have_log[ctx->have_count++] = piece_index;
+    
+    bitmap_set(ctx->done_bits, piece_index);
+    __atomic_add_fetch(&ctx->pieces_completed, 1, __ATOMIC_RELEASE);
     
     pthread_mutex_unlock(&ctx->status_mutex);
 }
 
-int is_download_complete(DownloadContext *ctx) {
+// Called with status_mutex held: put a piece that is downloading back among
+// the free pieces, every block of it is fetched again
+static void release_piece(DownloadContext *ctx, int piece_index) {
+    // Only a piece that is downloading right now can fail
+    if (!bitmap_test(ctx->claimed_bits, piece_index) || bitmap_test(ctx->done_bits, piece_index)) {
+        return;
+    }
+    
+    bitmap_clear(ctx->claimed_bits, piece_index);  // Mark as not downloaded (retry later)
+    pick_insert(ctx, piece_index);
+    
+    // Every block has to be fetched again (and the endgame list is out of date)
+    ctx->blocks_remaining += ctx->blocks_done[piece_index];
+    ctx->endgame = 0;
+    memset(ctx->block_status + (size_t)piece_index * ctx->blocks_per_piece, 0, ctx->blocks_per_piece);
+    ctx->blocks_done[piece_index] = 0;
+    free(ctx->piece_buffers[piece_index]);
+    ctx->piece_buffers[piece_index] = NULL;
+    remove_active_piece(ctx, piece_index);
+    ctx->solo_peer[piece_index] = -1;
+}
+
+void mark_piece_failed(DownloadContext *ctx, int piece_index) {
+    pthread_mutex_lock(&ctx->status_mutex);
+    release_piece(ctx, piece_index);
+    pthread_mutex_unlock(&ctx->status_mutex);
+}
+
+void mark_piece_corrupt(DownloadContext *ctx, int piece_index) {
     pthread_mutex_lock(&ctx->status_mutex);
     
-    int complete = 1;
-    for (int i = 0; i < ctx->num_pieces; i++) {
-        if (ctx->piece_status[i] != 2) {
-            complete = 0;
-            break;
-        }
+    // Who sent the blocks?
+    unsigned char *owner = ctx->block_owner + (size_t)piece_index * ctx->blocks_per_piece;
+    unsigned long long senders[PEER_WORDS];
+    memset(senders, 0, sizeof(senders));
+    int blocks = blocks_in_piece(ctx, piece_index);
+    for (int b = 0; b < blocks; b++) {
+        peer_set_add(senders, owner[b]);
+    }
+    
+    if (peer_set_count(senders) == 1) {
+        // All of it came from one peer: its fault, someone else gets the piece
+        ctx->peers[owner[0]].bad_pieces++;
+        ctx->rejected_by[piece_index] = owner[0];
+        ctx->suspect[piece_index] = 0;
+    } else {
+        ctx->suspect[piece_index] = 1;
     }
     
+    release_piece(ctx, piece_index);
+    pthread_mutex_unlock(&ctx->status_mutex);
+}
+
+void ban_peer(DownloadContext *ctx, int peer_index) {
+    pthread_mutex_lock(&ctx->status_mutex);
+    ctx->peers[peer_index].bad_pieces = MAX_BAD_PIECES;
+    pthread_mutex_unlock(&ctx->status_mutex);
+}
+
+int peer_is_banned(DownloadContext *ctx, int peer_index) {
+    pthread_mutex_lock(&ctx->status_mutex);
+    int banned = (ctx->peers[peer_index].bad_pieces >= MAX_BAD_PIECES);
+    pthread_mutex_unlock(&ctx->status_mutex);
+    return banned;
+}
+
+int is_block_received(DownloadContext *ctx, int piece_index, int offset) {
+    pthread_mutex_lock(&ctx->status_mutex);
+    int received = (ctx->block_status[(size_t)piece_index * ctx->blocks_per_piece + offset / BLOCK_SIZE] == 2);
+    pthread_mutex_unlock(&ctx->status_mutex);
+    return received;
+}
+
+int in_endgame(DownloadContext *ctx) {
+    pthread_mutex_lock(&ctx->status_mutex);
+    int endgame = ctx->endgame;
     pthread_mutex_unlock(&ctx->status_mutex);
-    return complete;
+    return endgame;
+}
+
+int has_completed_piece(DownloadContext *ctx, int piece_index) {
+    if (piece_index < 0 || piece_index >= ctx->num_pieces) return 0;
+    return bitmap_test(ctx->done_bits, piece_index);
+}
+
+int is_download_complete(DownloadContext *ctx) {
+    // One counter instead of scanning every piece
+    return __atomic_load_n(&ctx->pieces_completed, __ATOMIC_ACQUIRE) == ctx->num_pieces;
 }
 
 void display_peer_stats(DownloadContext *ctx) {
@@ -117,7 +813,12 @@ void display_peer_stats(DownloadContext *ctx) {
                peer->pieces_downloaded, ctx->num_pieces,
                (peer->pieces_downloaded * 100.0) / ctx->num_pieces);
         printf("├─ Data: %.2f MB (%.1f%% of total)\n", mb_downloaded, percentage);
-        printf("├─ Avg Speed: %.2f MB/s\n", speed_mbps);
+        printf("├─ Avg Speed: %.2f MB/s (recent %.2f MB/s, RTT %.1f ms)\n", speed_mbps,
+               peer->throughput / (1024.0 * 1024.0), peer->min_rtt_ms);
+        if (peer->zblock_bytes > 0) {
+            printf("├─ Compressed: %.2f MB of blocks came as %.2f MB\n",
+                   peer->zblock_bytes / (1024.0 * 1024.0), peer->zblock_wire_bytes / (1024.0 * 1024.0));
+        }
         
         // Visual bar for this peer's contribution
         int bar_width = 30;
@@ -134,8 +835,32 @@ void display_peer_stats(DownloadContext *ctx) {
 }
 
 void cleanup_download_context(DownloadContext *ctx) {
-    free(ctx->piece_status);
+    // Pieces that never finished
+    for (int i = 0; i < ctx->active_count; i++) {
+        free(ctx->piece_buffers[ctx->active_pieces[i]]);
+    }
+    
+    free(ctx->claimed_bits);
+    free(ctx->done_bits);
     free(ctx->piece_source);
+    free(ctx->piece_hashes);
+    free(ctx->rejected_by);
+    free(ctx->suspect);
+    free(ctx->solo_peer);
+    free(ctx->block_status);
+    free(ctx->block_owner);
+    free(ctx->blocks_done);
+    free(ctx->piece_buffers);
+    free(ctx->active_pieces);
+    free(ctx->availability);
+    free(ctx->pick_order);
+    free(ctx->pick_pos);
+    free(ctx->have_log);
+    for (int i = 0; i < ctx->peer_count; i++) {
+        free(ctx->peers[i].have_bits);
+    }
+    if (ctx->output_fd >= 0) close(ctx->output_fd);
+    journal_close(&ctx->journal);
     pthread_mutex_destroy(&ctx->status_mutex);
     free(ctx->progress);
 }
\ No newline at end of file
@@ -4,9 +4,33 @@
 #include <pthread.h>
 #include <time.h>
 #include "progress_bar.h"
+#include "piece_journal.h"
+#include "../common/protocol.h"
 
-#define MAX_PEERS 10
-#define MAX_CONCURRENT_DOWNLOADS 3
+#define MAX_PEERS 200           // Peers (connections) per download, all driven by one thread
+#define PEER_WORDS ((MAX_PEERS + 63) / 64)  // 64-bit words in a one-bit-per-peer set
+
+// Request pipelining: how many blocks a connection may have requested but not
+// received yet. The window starts small and adapts to measured throughput (AIMD)
+#define PIPELINE_INITIAL_DEPTH 8
+#define MAX_PIPELINE_DEPTH 256
+#define MAX_PEER_ERRORS 5     // Failed requests in a row before we give up on a peer
+#define MAX_BAD_PIECES 3      // Corrupt pieces a peer may send (all blocks its own) before we drop it
+
+// Throughput-aware scheduling
+#define PEER_REQUEST_TIMEOUT 20   // Seconds without a reply before a peer counts as dead
+#define RTT_WINDOW 10             // Seconds a min RTT sample stays valid
+#define SLOW_PEER_RATIO 8         // Peers this many times slower than the best get 1 request at a time
+#define PEER_REFRESH_INTERVAL 10  // Seconds between asking the tracker for more peers
+
+// Endgame: once every piece is started and only this many blocks are missing,
+// idle peers get duplicate requests for them; the first copy wins, the rest are cancelled
+#define ENDGAME_BLOCKS 128
+
+// Piece selection
+#define RANDOM_FIRST_PIECES 4   // First pieces are picked at random, then rarest first
+#define HAVE_POLL_INTERVAL 1    // Seconds between HAVE updates from a peer that is still downloading
+#define PARTIAL_PEER_PATIENCE 30 // Seconds we wait for a partial peer to get something new
 
 typedef struct {
     char ip[16];
@@ -18,45 +42,199 @@ typedef struct {
     long bytes_downloaded;
     time_t start_time;
     time_t last_download_time;
+    
+    // Pipelining window (AIMD on throughput, see update_pipeline_window)
+    int pipeline_window;          // Outstanding requests allowed per connection
+    long round_bytes;             // Bytes received in the current measuring round
+    int round_blocks;             // Blocks received in the current round
+    struct timespec round_start;
+    double last_round_rate;       // Bytes/sec of the previous round (0 = none yet)
+    
+    // Measured speed, used to share work out (see get_pipeline_window)
+    double throughput;            // Bytes/sec, moving average over pipelining rounds
+    double min_rtt_ms;            // Fastest request -> reply time seen recently (0 = none yet)
+    time_t min_rtt_time;          // When min_rtt_ms was measured (old samples expire)
+    
+    // Which pieces this peer has (from BITFIELD, kept up to date with HAVE)
+    unsigned char *have_bits;     // NULL until the bitfield arrived
+    int pieces_held;
+    int is_seed;                  // Has every piece, no need to ask for HAVE updates
+    int have_seq;                 // Position in the peer's HAVE log we have seen up to
+    time_t last_have_poll;
+    
+    // Blocks that came as ZBLOCK (CAP_COMPRESS): their size, and what they took on the wire
+    long zblock_bytes;
+    long zblock_wire_bytes;
+    
+    int bad_pieces;               // Pieces it sent alone that failed their hash check
+                                  // (MAX_BAD_PIECES at once after a block with a bad proof)
 } PeerConnection;
 
+// A missing block during endgame and the peers it has been requested from
+// (one bit per peer index)
+typedef struct {
+    int piece;
+    int offset;
+    int length;
+    unsigned long long requested_by[PEER_WORDS];
+} EndgameBlock;
+
 typedef struct {
     char filename[256];
     int num_pieces;
     long file_size;
+    int piece_size;               // Bytes per piece (the last one may be shorter)
     
     PeerConnection peers[MAX_PEERS];
     int peer_count;
     
-    int *piece_status;  // 0=not downloaded, 1=downloading, 2=completed
+    // Piece state as packed bitmaps, 64 pieces per word, changed with atomic
+    // instructions: completion checks and the upload side never take status_mutex
+    unsigned long long *claimed_bits;  // Started or finished
+    unsigned long long *done_bits;     // Finished and saved
+    int pieces_completed;              // Bits set in done_bits (atomic)
     int *piece_source;  // Which peer downloaded this piece (peer index)
+    
+    // Manifest: Merkle hash of every piece, HASH_SIZE bytes each (NULL = the peers
+    // had none, pieces can't be checked)
+    unsigned char *piece_hashes;
+    int *rejected_by;         // Peer that sent all of a piece that failed its check (-1 = none)
+    unsigned char *suspect;   // Failed with blocks from several peers: one peer fetches it next time
+    int *solo_peer;           // The peer fetching a suspect piece alone (-1 = not started)
+    
+    // Pieces travel in BLOCK_SIZE blocks, so one piece can come from several peers
+    int blocks_per_piece;
+    unsigned char *block_status;  // [piece * blocks_per_piece + block]: 0=free, 1=requested, 2=received
+    unsigned char *block_owner;   // Peer a block was last requested from
+    int blocks_remaining;         // Blocks not received yet
+    int *blocks_done;             // Received blocks per piece
+    char **piece_buffers;         // Piece being put together (only while it downloads)
+    int *active_pieces;           // Started, not finished pieces - their free blocks go first
+    int active_count;
+    
+    // Rarest-first picking: free pieces grouped by how many peers have them
+    // pick_order[bucket_start[a] .. bucket_start[a+1]) are the free pieces with availability a
+    int *availability;            // Peers that have each piece
+    int *pick_order;              // Free pieces, rarest first
+    int *pick_pos;                // Index of each piece in pick_order (-1 = not free)
+    int bucket_start[MAX_PEERS + 2];
+    int pieces_started;
+    
+    // Pieces we finished, in order, so peers downloading from us can ask for
+    // HAVE updates since a position
+    int *have_log;
+    int have_count;
+    
+    // Endgame (see ENDGAME_BLOCKS)
+    int endgame;
+    EndgameBlock endgame_blocks[ENDGAME_BLOCKS];
+    int endgame_count;
     pthread_mutex_t status_mutex;
     
     ProgressTracker *progress;
     
-    char downloads_dir[512];
+    char downloads_dir[512];      // Piece files, when there is no output file
+    int output_fd;                // Destination file, pieces are written in place (-1 = none)
+    PieceJournal journal;         // Pieces safely in output_fd, kept on disk for resuming
     int failed;
 } DownloadContext;
 
 // Initialize download context
 void init_download_context(DownloadContext *ctx, char *filename, int num_pieces, 
-                           long file_size, char *downloads_dir);
+                           long file_size, int piece_size, char *downloads_dir);
+
+// Add peer to download context (thread-safe, also while downloading)
+// Returns the new peer's index, -1 if it is already known or there is no room
+int add_peer_to_context(DownloadContext *ctx, char *ip, int port);
+
+// Size of one piece in bytes (the last piece is usually shorter)
+int get_piece_length(DownloadContext *ctx, int piece_index);
 
-// Add peer to download context
-void add_peer_to_context(DownloadContext *ctx, char *ip, int port);
+// Get next block to download from a peer (thread-safe)
+// Free blocks of pieces that are already started come first; otherwise a new
+// piece is picked rarest first among the pieces this peer has. In endgame,
+// a block already requested from other peers (fewest copies first).
+// Returns 0 and fills piece/offset/length, -1 if the peer has nothing we still need
+int get_next_block(DownloadContext *ctx, int peer_index, int *piece_index, int *offset, int *length);
 
-// Get next piece to download (thread-safe)
-int get_next_piece(DownloadContext *ctx);
+// Record a peer's BITFIELD (thread-safe). bits = NULL means the peer has every piece
+// seq is the peer's HAVE log position the bitfield corresponds to
+void set_peer_bitfield(DownloadContext *ctx, int peer_index, unsigned char *bits, int seq);
 
-// Mark piece as completed (thread-safe) - UPDATED SIGNATURE
-void mark_piece_completed(DownloadContext *ctx, int piece_index, int peer_index, int bytes);
+// Record HAVE updates from a peer (thread-safe)
+void add_peer_haves(DownloadContext *ctx, int peer_index, int *pieces, int count, int new_seq);
 
-// Mark piece as failed (thread-safe)
+// Is it time to ask this peer for HAVE updates? (thread-safe)
+// Returns 1 and the position to ask from, 0 if the peer is a seed or was asked recently
+int peer_have_poll_due(DownloadContext *ctx, int peer_index, int *seq);
+
+// Does the peer have every piece? (thread-safe)
+int peer_is_seed(DownloadContext *ctx, int peer_index);
+
+// Our own BITFIELD for this download (thread-safe)
+// bits must hold (num_pieces + 7) / 8 bytes. Returns our HAVE log position
+int build_bitfield(DownloadContext *ctx, unsigned char *bits);
+
+// Pieces we finished since HAVE log position seq, at most max (thread-safe)
+// Returns how many were written to pieces; *new_seq is where to ask from next time
+int get_haves_since(DownloadContext *ctx, int seq, int *pieces, int max, int *new_seq);
+
+// Store a received block (thread-safe)
+// Returns the whole piece when this was its last block (caller saves it, calls
+// mark_piece_completed and frees it), NULL otherwise
+char* mark_block_received(DownloadContext *ctx, int peer_index, int piece_index,
+                          int offset, char *data, int length);
+
+// A peer could not deliver a block: put it back so it can be requested again
+// (in endgame it stays requested while another peer is still fetching it) (thread-safe)
+void mark_block_failed(DownloadContext *ctx, int peer_index, int piece_index, int offset);
+
+// Has this block arrived already? (thread-safe) Used in endgame to cancel duplicates
+int is_block_received(DownloadContext *ctx, int piece_index, int offset);
+
+// Is the download in endgame mode? (thread-safe)
+int in_endgame(DownloadContext *ctx);
+
+// Mark piece as completed (thread-safe)
+void mark_piece_completed(DownloadContext *ctx, int piece_index, int peer_index);
+
+// A piece an interrupted download already has on disk: done without fetching it
+// Call before the download starts (thread-safe)
+void mark_piece_resumed(DownloadContext *ctx, int piece_index);
+
+// Mark piece as failed: all its blocks are fetched again (thread-safe)
 void mark_piece_failed(DownloadContext *ctx, int piece_index);
 
-// Check if download is complete
+// A finished piece did not match its hash. If one peer sent all of it, that
+// peer is blamed and the piece is fetched from someone else. With blocks from
+// several peers we can't tell who lied: the piece is fetched again from a
+// single peer, so a second failure has a culprit. Then it fails like above (thread-safe)
+void mark_piece_corrupt(DownloadContext *ctx, int piece_index);
+
+// A block from this peer failed its Merkle proof: it is banned right away (thread-safe)
+void ban_peer(DownloadContext *ctx, int peer_index);
+
+// Has the peer been part of too many corrupt pieces (MAX_BAD_PIECES), or sent
+// a block that failed its proof? (thread-safe)
+int peer_is_banned(DownloadContext *ctx, int peer_index);
+
+// Have we finished this piece? (thread-safe, lock-free: one bit test)
+int has_completed_piece(DownloadContext *ctx, int piece_index);
+
+// Check if download is complete (thread-safe, lock-free: compares a counter)
 int is_download_complete(DownloadContext *ctx);
 
+// How many requests a peer may have outstanding right now (thread-safe)
+// AIMD window, capped by the peer's bandwidth-delay product;
+// a peer much slower than the best one gets a single request at a time
+int get_pipeline_window(DownloadContext *ctx, int peer_index);
+
+// Record how long a request took to answer (thread-safe)
+void record_peer_latency(DownloadContext *ctx, int peer_index, double ms);
+
+// Halve a peer's window after a failed request or broken connection (thread-safe)
+void shrink_pipeline_window(DownloadContext *ctx, int peer_index);
+
 // Display per-peer statistics
 void display_peer_stats(DownloadContext *ctx);
 
@@ -0,0 +1,159 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "peer_session.h"
+
+PeerSession* session_attach(int fd) {
+    PeerSession *s = (PeerSession*)malloc(sizeof(PeerSession));
+    if (!s) return NULL;
+
+    s->fd = fd;
+    s->start = 0;
+    s->len = 0;
+    s->version = 1;
+    s->caps = 0;
+    s->next_id = 1;
+
+    // Requests are small: send them right away instead of waiting to fill a packet
+    int opt = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+    return s;
+}
+
+PeerSession* session_connect(char *ip, int port) {
+    struct sockaddr_in peer_addr;
+
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0) {
+        return NULL;
+    }
+
+    peer_addr.sin_family = AF_INET;
+    peer_addr.sin_port = htons(port);
+    peer_addr.sin_addr.s_addr = inet_addr(ip);
+
+    if (connect(sock, (struct sockaddr *)&peer_addr, sizeof(peer_addr)) < 0) {
+        close(sock);
+        return NULL;
+    }
+
+    PeerSession *s = session_attach(sock);
+    if (!s) close(sock);
+    return s;
+}
+
+void session_close(PeerSession *s) {
+    if (!s) return;
+    close(s->fd);
+    free(s);
+}
+
+// Read more bytes from the socket into the buffer
+static int fill_buffer(PeerSession *s) {
+    if (s->start > 0) {
+        memmove(s->buf, s->buf + s->start, s->len);
+        s->start = 0;
+    }
+    if (s->len == SESSION_BUFFER_SIZE) return -1;  // Buffer full, nothing can fit
+
+    int bytes = read(s->fd, s->buf + s->len, SESSION_BUFFER_SIZE - s->len);
+    if (bytes <= 0) return -1;
+    s->len += bytes;
+    return 0;
+}
+
+int session_read_line(PeerSession *s, char *line, int size) {
+    while (1) {
+        char *newline = memchr(s->buf + s->start, '\n', s->len);
+        if (newline) {
+            int line_len = newline - (s->buf + s->start);
+            if (line_len >= size) return -1;
+
+            memcpy(line, s->buf + s->start, line_len);
+            line[line_len] = '\0';
+            s->start += line_len + 1;
+            s->len -= line_len + 1;
+            return line_len;
+        }
+
+        if (s->len >= size) return -1;  // No newline within size bytes
+        if (fill_buffer(s) != 0) return -1;
+    }
+}
+
+int session_read_exact(PeerSession *s, void *data, int len) {
+    char *out = (char*)data;
+
+    // Bytes already buffered first
+    int take = (s->len < len) ? s->len : len;
+    memcpy(out, s->buf + s->start, take);
+    s->start += take;
+    s->len -= take;
+    out += take;
+    len -= take;
+
+    // Large bodies (piece data) go straight into the caller's buffer
+    while (len > 0) {
+        int bytes = read(s->fd, out, len);
+        if (bytes <= 0) return -1;
+        out += bytes;
+        len -= bytes;
+    }
+    return 0;
+}
+
+int session_peek_byte(PeerSession *s) {
+    if (s->len == 0 && fill_buffer(s) != 0) return -1;
+    return (unsigned char)s->buf[s->start];
+}
+
+void session_read_available(PeerSession *s) {
+    if (s->start > 0) {
+        memmove(s->buf, s->buf + s->start, s->len);
+        s->start = 0;
+    }
+    if (s->len < SESSION_BUFFER_SIZE) {
+        int bytes = recv(s->fd, s->buf + s->len, SESSION_BUFFER_SIZE - s->len, MSG_DONTWAIT);
+        if (bytes > 0) s->len += bytes;
+    }
+}
+
+int session_take_line(PeerSession *s, const char *line) {
+    // Pull in what is already waiting, but never block
+    session_read_available(s);
+    
+    int line_len = strlen(line);
+    char *p = s->buf;
+    char *end = s->buf + s->len;
+    while (p < end) {
+        char *newline = memchr(p, '\n', end - p);
+        if (!newline) break;  // Half a line: can't match yet
+        
+        if (newline - p == line_len && memcmp(p, line, line_len) == 0) {
+            // Close the gap so the lines around it are read as usual
+            memmove(p, newline + 1, end - (newline + 1));
+            s->len -= line_len + 1;
+            return 1;
+        }
+        p = newline + 1;
+    }
+    return 0;
+}
+
+int session_send(PeerSession *s, const void *data, int len) {
+    const char *p = (const char*)data;
+
+    while (len > 0) {
+        // MSG_NOSIGNAL: a peer that hung up gives us an error, not SIGPIPE
+        int sent = send(s->fd, p, len, MSG_NOSIGNAL);
+        if (sent <= 0) return -1;
+        p += sent;
+        len -= sent;
+    }
+    return 0;
+}
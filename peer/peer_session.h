@@ -0,0 +1,55 @@
+#ifndef PEER_SESSION_H
+#define PEER_SESSION_H
+
+// One long-lived TCP connection between two peers
+// Many requests go over the same connection, so we only pay for the TCP
+// handshake and slow start once per peer instead of once per piece.
+// Incoming bytes are read in big chunks and handed out as lines or exact
+// byte counts, so a reply header and the data behind it can arrive in the
+// same read() without getting lost.
+
+#define SESSION_BUFFER_SIZE 65536
+
+typedef struct {
+    int fd;
+    char buf[SESSION_BUFFER_SIZE];
+    int start;   // First unread byte in buf
+    int len;     // Number of unread bytes
+    
+    // Wire protocol spoken on this connection (see wire.h)
+    int version;             // 1 = text commands, 2 = binary frames
+    unsigned int caps;       // CAP_* both sides support (v2 only)
+    unsigned int next_id;    // Request id for the next frame we send
+} PeerSession;
+
+// Connect to a peer. Returns NULL on failure
+PeerSession* session_connect(char *ip, int port);
+
+// Wrap a socket we accepted
+PeerSession* session_attach(int fd);
+
+// Close the socket and free the session
+void session_close(PeerSession *s);
+
+// Read one '\n' terminated line (newline removed)
+// Returns line length, -1 on error, EOF or a line longer than size
+int session_read_line(PeerSession *s, char *line, int size);
+
+// Read exactly len bytes. Returns 0, or -1 on error/EOF
+int session_read_exact(PeerSession *s, void *data, int len);
+
+// Look at the next byte without consuming it (waits for one). -1 on error/EOF
+int session_peek_byte(PeerSession *s);
+
+// Move whatever has already arrived on the socket into the buffer, without waiting
+void session_read_available(PeerSession *s);
+
+// Look for a line the peer already sent but we haven't read yet (newline
+// not included) and remove it. Whatever has arrived on the socket is pulled
+// in first, without waiting. Returns 1 if found, 0 if not
+int session_take_line(PeerSession *s, const char *line);
+
+// Send all len bytes. Returns 0, or -1 on error
+int session_send(PeerSession *s, const void *data, int len);
+
+#endif
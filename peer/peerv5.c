@@ -2,9 +2,12 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <stdint.h>
 #include <pthread.h>
 #include <dirent.h>
+#include <fcntl.h>
 #include <sys/socket.h>
+#include <sys/time.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include "../common/protocol.h"
@@ -12,6 +15,14 @@
 #include "network_utils.h"
 #include "progress_bar.h"
 #include "multi_source.h"
+#include "tracker_client.h"
+#include "peer_session.h"
+#include "wire.h"
+#include "download_engine.h"
+#include "piece_hash.h"
+#include "piece_store.h"
+#include "chunker.h"
+#include "compress.h"
 
 
 // Global variables
@@ -19,6 +30,42 @@ int my_port; // peers port
 char my_ip[16]; // peers ip address
 char tracker_ip[16]; // trackers ip address
 char base_dir[256] = "p2p_data"; 
+int cdc_mode = 0; // --cdc: keep chunk lists, build new versions of files from old ones
+
+// Files this peer has registered with the tracker, and their content roots
+// Kept so they can be registered again if the tracker forgets us
+char (*registered_names)[MAX_FILENAME] = NULL;
+char (*registered_roots)[HASH_HEX_SIZE] = NULL;
+int registered_count = 0;
+int registered_cap = 0;
+pthread_mutex_t registered_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Upload load, reported to the tracker in every ANNOUNCE
+int active_uploads = 0;
+long bytes_uploaded = 0;
+
+// Download in progress, if any: we already serve the pieces it has finished
+DownloadContext *current_download = NULL;
+int current_download_registered = 0;  // Registered with the tracker as a partial copy
+pthread_mutex_t current_download_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Leaves of the pieces an upload connection last sent proofs for: downloaders
+// ask for several blocks of a piece, mixed with blocks of other pieces, and
+// every block of a piece needs the same leaves
+#define PROOF_CACHE_PIECES 8
+
+typedef struct {
+    char filename[MAX_FILENAME];
+    int piece_index;    // -1 = empty
+    int piece_size;
+    unsigned long last_used;
+    unsigned char leaves[MAX_MERKLE_LEAVES * HASH_SIZE];
+} CachedLeaves;
+
+typedef struct {
+    CachedLeaves pieces[PROOF_CACHE_PIECES];
+    unsigned long clock;    // Counts lookups, for least recently used
+} ProofCache;
 
 
 // Clear screen
@@ -27,272 +74,685 @@ void clear_screen() {
 }
 
 
-// Connect to tracker
-int connect_to_tracker(char *message, char *response) {
-    int sock;
-    struct sockaddr_in tracker_addr;
+// Remember a file we registered and its root ("" if none) (ignores duplicates)
+void remember_registration(char *filename, char *root) {
+    pthread_mutex_lock(&registered_mutex);
+    
+    for (int i = 0; i < registered_count; i++) {
+        if (strcmp(registered_names[i], filename) == 0) {
+            strcpy(registered_roots[i], root);
+            pthread_mutex_unlock(&registered_mutex);
+            return;
+        }
+    }
     
-    sock = socket(AF_INET, SOCK_STREAM, 0);
-    if (sock < 0) {
-        printf("✗ Socket creation failed\n");
-        return -1;
+    if (registered_count == registered_cap) {
+        int new_cap = registered_cap ? registered_cap * 2 : 16;
+        char (*grown)[MAX_FILENAME] = realloc(registered_names, new_cap * sizeof(*registered_names));
+        if (grown) registered_names = grown;
+        char (*grown_roots)[HASH_HEX_SIZE] = realloc(registered_roots, new_cap * sizeof(*registered_roots));
+        if (grown_roots) registered_roots = grown_roots;
+        if (!grown || !grown_roots) {
+            pthread_mutex_unlock(&registered_mutex);
+            return;
+        }
+        registered_cap = new_cap;
     }
     
-    tracker_addr.sin_family = AF_INET;
-    tracker_addr.sin_port = htons(TRACKER_PORT);
-    tracker_addr.sin_addr.s_addr = inet_addr(tracker_ip);
+    strcpy(registered_names[registered_count], filename);
+    strcpy(registered_roots[registered_count], root);
+    registered_count++;
+    pthread_mutex_unlock(&registered_mutex);
+}
+
+// The download registered as a partial copy, and how much of it we have (percent)
+// Returns 0, or -1 if no download is registered
+int registered_download(char *filename, int *completion) {
+    int result = -1;
+    pthread_mutex_lock(&current_download_mutex);
+    if (current_download && current_download_registered) {
+        strcpy(filename, current_download->filename);
+        int done = __atomic_load_n(&current_download->pieces_completed, __ATOMIC_ACQUIRE);
+        *completion = (current_download->num_pieces > 0) ? done * 100 / current_download->num_pieces : 0;
+        result = 0;
+    }
+    pthread_mutex_unlock(&current_download_mutex);
+    return result;
+}
+
+// Heartbeat thread: tell the tracker we are still alive
+// If the tracker has forgotten us (expired or restarted), register everything again,
+// including a download in progress (with how much of it we have so far)
+void* announce_thread(void *arg) {
+    (void)arg;
+    char message[256];
+    char response[1024];
+    long last_bytes = 0;
     
-    if (connect(sock, (struct sockaddr *)&tracker_addr, sizeof(tracker_addr)) < 0) {
-        printf("✗ Cannot connect to tracker at %s:%d\n", tracker_ip, TRACKER_PORT);
-        close(sock);
-        return -1;
+    while (1) {
+        sleep(ANNOUNCE_INTERVAL);
+        
+        // Upload rate over the last interval
+        long bytes = __atomic_load_n(&bytes_uploaded, __ATOMIC_RELAXED);
+        long upload_kbps = (bytes - last_bytes) / 1024 / ANNOUNCE_INTERVAL;
+        last_bytes = bytes;
+        
+        pthread_mutex_lock(&registered_mutex);
+        int count = registered_count;
+        pthread_mutex_unlock(&registered_mutex);
+        
+        // A downloader that shares nothing else still serves its finished pieces
+        char download_name[MAX_FILENAME];
+        int completion = 0;
+        int downloading = (registered_download(download_name, &completion) == 0);
+        
+        if (count == 0 && !downloading) continue;  // Nothing registered yet
+        
+        sprintf(message, "ANNOUNCE %d %d %ld\n", my_port,
+                __atomic_load_n(&active_uploads, __ATOMIC_RELAXED), upload_kbps);
+        if (tracker_request(message, response, sizeof(response)) != 0) continue;
+        
+        if (strncmp(response, "UNKNOWN", 7) == 0) {
+            pthread_mutex_lock(&registered_mutex);
+            if (registered_count > 0) {
+                tracker_register_batch(registered_names, registered_roots, registered_count, my_port);
+            }
+            pthread_mutex_unlock(&registered_mutex);
+            
+            // Not complete: the batch would register it at 100%
+            if (downloading) {
+                sprintf(message, "REGISTER %s %d %d\n", download_name, my_port, completion);
+                tracker_request(message, response, sizeof(response));
+            }
+        }
     }
     
-    send(sock, message, strlen(message), 0);
+    return NULL;
+}
+
+// Size of a file in shared/, -1 if we don't share it
+long shared_file_size(char *filename) {
+    char filepath[512];
+    sprintf(filepath, "%s/shared/%s", base_dir, filename);
+    return get_file_size(filepath);
+}
+
+// Where the piece hashes of a shared file are kept
+void get_manifest_path(char *path, char *filename) {
+    sprintf(path, "%s/pieces/%s.manifest", base_dir, filename);
+}
+
+// Where the leaf hashes of a shared file's pieces are kept (proofs for uploads)
+void get_leaves_path(char *path, char *filename) {
+    sprintf(path, "%s/pieces/%s.leaves", base_dir, filename);
+}
+
+// Where the content-defined chunks of a shared file are listed (--cdc)
+void get_chunks_path(char *path, char *filename) {
+    sprintf(path, "%s/pieces/%s.chunks", base_dir, filename);
+}
+
+// Where every piece we share is kept once, by its hash
+void get_store_dir(char *path) {
+    sprintf(path, "%s/store", base_dir);
+}
+
+// Hash a shared file unless its manifest is already there and up to date
+// (and list its chunks, in --cdc mode)
+// Up to date means made from this very file: same size, inode and mtime. A
+// file replaced by other content of the same size is cut and hashed again,
+// so pieces/ never serves the old data under the new hashes
+// root (may be NULL) gets the file's content root in hex, for the tracker
+// Returns 0 if the file has a manifest now, -1 otherwise
+int ensure_manifest(char *filename, int verbose, char *root) {
+    char filepath[512];
+    char manifest_path[512];
+    char leaves_path[512];
+    sprintf(filepath, "%s/shared/%s", base_dir, filename);
+    get_manifest_path(manifest_path, filename);
+    get_leaves_path(leaves_path, filename);
+    
+    long file_size = get_file_size(filepath);
+    if (file_size < 0) return -1;
+    int piece_size = choose_piece_size(file_size);
+    
+    // Files shared before leaves files existed are hashed again to get one
+    unsigned char *hashes = load_manifest(manifest_path, filepath, piece_size);
+    if (hashes && !leaves_file_matches(leaves_path, filepath, piece_size)) {
+        free(hashes);
+        hashes = NULL;
+    }
+    if (!hashes) {
+        // The pieces may hold another version of the file, or be cut to
+        // another size (by an older peer): cut them again first
+        char pieces_dir[512];
+        sprintf(pieces_dir, "%s/pieces", base_dir);
+        if (verbose) printf("Cutting %s into pieces of %d KB...\n", filename, piece_size / 1024);
+        if (split_file(filepath, pieces_dir) < 0) return -1;
+        
+        if (verbose) printf("Hashing %s (%d threads)...\n", filename, hash_thread_count());
+        if (create_manifest(filepath, manifest_path, leaves_path) < 0 ||
+            (hashes = load_manifest(manifest_path, filepath, piece_size)) == NULL) {
+            if (verbose) printf("✗ Cannot write piece hashes for %s\n", filename);
+            return -1;
+        }
+    }
     
-    memset(response, 0, 1024);
-    int bytes = read(sock, response, 1024);
-    if (bytes > 0) {
-        response[bytes] = '\0';
+    if (root) {
+        unsigned char hash[HASH_SIZE];
+        merkle_root(hashes, calculate_num_pieces(file_size, piece_size), hash);
+        hash_to_hex(hash, root);
+    }
+    free(hashes);
+    
+    // In --cdc mode every shared file also gets its chunk list, for
+    // downloaders that have an older version of it
+    if (cdc_mode) {
+        char chunks_path[512];
+        int count;
+        get_chunks_path(chunks_path, filename);
+        unsigned char *entries = load_chunk_manifest(chunks_path, filepath, &count);
+        if (entries) {
+            free(entries);
+        } else if (create_chunk_manifest(filepath, chunks_path) < 0 && verbose) {
+            printf("✗ Cannot write the chunk list for %s\n", filename);
+        }
+    }
+    return 0;
+}
+
+// Link the pieces/ files of a shared file into the piece store, so pieces it
+// has in common with other files are kept on disk once
+// check = 1: hash each piece file first (it may be older than the manifest);
+// pieces already linked are skipped. Returns how many the store already had
+int store_shared_pieces(char *filename, unsigned char *hashes, int num_pieces, int check) {
+    char store_dir[512];
+    get_store_dir(store_dir);
+    int piece_size = choose_piece_size(shared_file_size(filename));
+    
+    char *buffer = check ? (char*)malloc(piece_size) : NULL;
+    if (check && !buffer) return 0;
+    
+    int shared = 0;
+    for (int i = 0; i < num_pieces; i++) {
+        unsigned char *hash = hashes + (size_t)i * HASH_SIZE;
+        char piece_path[600];
+        sprintf(piece_path, "%s/pieces/%s.piece%d", base_dir, filename, i);
+        
+        if (check) {
+            int length = 0;
+            FILE *fp = store_is_linked(piece_path) ? NULL : fopen(piece_path, "rb");
+            if (!fp) continue;
+            length = fread(buffer, 1, piece_size, fp);
+            fclose(fp);
+            if (!piece_hash_matches(hash, buffer, length, piece_size)) continue;
+        }
+        if (store_intern(store_dir, hash, piece_path) == 1) shared++;
+    }
+    
+    free(buffer);
+    return shared;
+}
+
+// FILE_INFO as a v2 frame
+int get_file_info_frame(PeerSession *session, char *filename, int *num_pieces, long *file_size, int *piece_size,
+                        char *root) {
+    unsigned int id = session->next_id++;
+    if (wire_send(session, FRAME_FILE_INFO, id, NULL, 0, filename, strlen(filename)) != 0) {
+        return -1;
     }
     
-    close(sock);
+    // With CAP_MERKLE the content root comes after the sizes, then with
+    // CAP_PIECE_SIZE the piece size
+    FrameHeader h;
+    unsigned char info[12 + HASH_SIZE + 4];
+    unsigned int root_at = 12;
+    unsigned int size_at = root_at + ((session->caps & CAP_MERKLE) ? HASH_SIZE : 0);
+    unsigned int expected = size_at + ((session->caps & CAP_PIECE_SIZE) ? 4 : 0);
+    if (wire_read_header(session, &h) != 0 || h.id != id ||
+        h.type != FRAME_INFO || h.length != expected ||
+        session_read_exact(session, info, expected) != 0) {
+        return -1;
+    }
+    
+    *num_pieces = get_u32(info);
+    *file_size = ((long)get_u32(info + 4) << 32) | get_u32(info + 8);
+    *piece_size = (expected > size_at) ? (int)get_u32(info + size_at) : LEGACY_PIECE_SIZE;
+    
+    // All zeros: the peer has no piece hashes for this file
+    static const unsigned char none[HASH_SIZE];
+    root[0] = '\0';
+    if (size_at > root_at && memcmp(info + root_at, none, HASH_SIZE) != 0) hash_to_hex(info + root_at, root);
     return 0;
 }
 
 // Get file info from peer
-int get_file_info_from_peer(char *peer_ip, int peer_port, char *filename, int *num_pieces, long *file_size) {
-    int sock;
-    struct sockaddr_in peer_addr;
+// root gets the content root the peer has in hex ("" if it didn't say);
+// older peers don't say what piece size they use: theirs is LEGACY_PIECE_SIZE
+int get_file_info_from_peer(char *peer_ip, int peer_port, char *filename, int *num_pieces, long *file_size,
+                            int *piece_size, char *root) {
     char request[512];
     char response[1024];
     
-    sock = socket(AF_INET, SOCK_STREAM, 0);
-    if (sock < 0) {
+    PeerSession *session = wire_connect(peer_ip, peer_port);
+    if (!session) {
         return -1;
     }
     
-    peer_addr.sin_family = AF_INET;
-    peer_addr.sin_port = htons(peer_port);
-    peer_addr.sin_addr.s_addr = inet_addr(peer_ip);
-    
-    if (connect(sock, (struct sockaddr *)&peer_addr, sizeof(peer_addr)) < 0) {
-        close(sock);
-        return -1;
+    if (session->version >= 2) {
+        int result = get_file_info_frame(session, filename, num_pieces, file_size, piece_size, root);
+        session_close(session);
+        return result;
     }
     
-    sprintf(request, "FILE_INFO %s\n", filename);
-    send(sock, request, strlen(request), 0);
+    sprintf(request, "FILE_INFO %s PIECE_SIZE\n", filename);
     
-    int bytes = read(sock, response, sizeof(response));
-    if (bytes > 0) {
-        response[bytes] = '\0';
-        sscanf(response, "INFO %d %ld", num_pieces, file_size);
+    int result = -1;
+    root[0] = '\0';
+    *piece_size = LEGACY_PIECE_SIZE;
+    if (session_send(session, request, strlen(request)) == 0 &&
+        session_read_line(session, response, sizeof(response)) >= 0 &&
+        sscanf(response, "INFO %d %ld %64s %d", num_pieces, file_size, root, piece_size) >= 2) {
+        if (strcmp(root, "-") == 0) root[0] = '\0';
+        result = 0;
     }
     
-    close(sock);
-    return 0;
+    session_close(session);
+    return result;
 }
 
-// Request piece from peer
-int request_piece_from_peer(char *peer_ip, int peer_port, char *filename, int piece_index, char *buffer, int *bytes_received) {
-    int sock;
-    struct sockaddr_in peer_addr;
-    char request[512];
-    char response_line[256];
+// Piece hashes from a peer (MANIFEST)
+// Returns num_pieces * HASH_SIZE bytes the caller frees, NULL if the peer has
+// none or doesn't know MANIFEST
+unsigned char* get_manifest_from_peer(char *peer_ip, int peer_port, char *filename, int num_pieces) {
+    PeerSession *session = wire_connect(peer_ip, peer_port);
+    if (!session) {
+        return NULL;
+    }
     
-    sock = socket(AF_INET, SOCK_STREAM, 0);
-    if (sock < 0) {
-        return -1;
+    int size = num_pieces * HASH_SIZE;
+    unsigned char *hashes = (unsigned char*)malloc(size + 1);
+    int ok = 0;
+    
+    if (hashes && session->version >= 2 && (session->caps & CAP_MANIFEST)) {
+        unsigned int id = session->next_id++;
+        FrameHeader h;
+        unsigned char count[4];
+        ok = (wire_send(session, FRAME_MANIFEST, id, NULL, 0, filename, strlen(filename)) == 0 &&
+              wire_read_header(session, &h) == 0 && h.id == id &&
+              h.type == FRAME_MANIFEST && h.length == 4 + (unsigned int)size &&
+              session_read_exact(session, count, 4) == 0 && (int)get_u32(count) == num_pieces &&
+              session_read_exact(session, hashes, size) == 0);
+    } else if (hashes && session->version < 2) {
+        char request[256];
+        char response[256];
+        int count;
+        sprintf(request, "MANIFEST %s\n", filename);
+        ok = (session_send(session, request, strlen(request)) == 0 &&
+              session_read_line(session, response, sizeof(response)) >= 0 &&
+              sscanf(response, "MANIFEST %d", &count) == 1 && count == num_pieces &&
+              session_read_exact(session, hashes, size) == 0);
     }
     
-    peer_addr.sin_family = AF_INET;
-    peer_addr.sin_port = htons(peer_port);
-    peer_addr.sin_addr.s_addr = inet_addr(peer_ip);
+    session_close(session);
+    if (!ok) {
+        free(hashes);
+        return NULL;
+    }
+    return hashes;
+}
+
+// Chunk list of a file from a peer (CHUNKS), parsed into offsets
+// Returns the chunks (caller frees) and their count, NULL if the peer has none
+Chunk* get_chunks_from_peer(char *peer_ip, int peer_port, char *filename, long file_size, int *count) {
+    PeerSession *session = wire_connect(peer_ip, peer_port);
+    if (!session) {
+        return NULL;
+    }
     
-    if (connect(sock, (struct sockaddr *)&peer_addr, sizeof(peer_addr)) < 0) {
-        close(sock);
-        return -1;
+    unsigned char *entries = NULL;
+    int ok = 0;
+    *count = 0;
+    
+    if (session->version >= 2 && (session->caps & CAP_CHUNKS)) {
+        unsigned int id = session->next_id++;
+        FrameHeader h;
+        unsigned char raw[4];
+        ok = (wire_send(session, FRAME_CHUNKS, id, NULL, 0, filename, strlen(filename)) == 0 &&
+              wire_read_header(session, &h) == 0 && h.id == id && h.type == FRAME_CHUNKS &&
+              h.length >= 4 && session_read_exact(session, raw, 4) == 0);
+        *count = ok ? (int)get_u32(raw) : 0;
+        ok = ok && (h.length - 4) == (unsigned int)*count * CHUNK_ENTRY_SIZE;
+    } else if (session->version < 2) {
+        char request[256];
+        char response[256];
+        sprintf(request, "CHUNKS %s\n", filename);
+        ok = (session_send(session, request, strlen(request)) == 0 &&
+              session_read_line(session, response, sizeof(response)) >= 0 &&
+              sscanf(response, "CHUNKS %d", count) == 1 &&
+              *count >= 0 && *count <= FRAME_MAX_PAYLOAD / CHUNK_ENTRY_SIZE);
     }
     
-    sprintf(request, "REQUEST_PIECE %s %d\n", filename, piece_index);
-    send(sock, request, strlen(request), 0);
+    if (ok) {
+        entries = (unsigned char*)malloc((size_t)*count * CHUNK_ENTRY_SIZE + 1);
+        ok = entries && session_read_exact(session, entries, (size_t)*count * CHUNK_ENTRY_SIZE) == 0;
+    }
+    session_close(session);
     
-    // Read header line by line
-    int pos = 0;
-    char ch;
-    while (pos < 255) {
-        int n = read(sock, &ch, 1);
-        if (n <= 0) break;
-        response_line[pos++] = ch;
-        if (ch == '\n') break;
+    Chunk *chunks = ok ? parse_chunk_entries(entries, *count, file_size) : NULL;
+    free(entries);
+    return chunks;
+}
+
+// Is this peer address us? (the tracker may list us while we download)
+int is_self(char *ip, int port) {
+    return port == my_port && (strcmp(ip, my_ip) == 0 || strcmp(ip, "127.0.0.1") == 0);
+}
+
+// Ask the tracker for more peers while a download runs (download engine callback)
+void refresh_peers(DownloadContext *ctx) {
+    char peer_ips[MAX_PEERS][16];
+    int peer_ports[MAX_PEERS];
+    int total_peers = 0;
+    unsigned long long cursor = 0;
+    
+    int found = tracker_query_peers(ctx->filename, MAX_PEERS, &cursor, 1, peer_ips, peer_ports, &total_peers);
+    for (int i = 0; i < found; i++) {
+        if (is_self(peer_ips[i], peer_ports[i])) continue;
+        add_peer_to_context(ctx, peer_ips[i], peer_ports[i]);
+    }
+}
+
+// Count the pieces an interrupted download already wrote as done
+// With a manifest they are checked first (on every core): a piece the
+// journal lists but that doesn't match its hash is downloaded again
+// Returns how many pieces were resumed
+int resume_pieces(DownloadContext *ctx) {
+    char *wanted = (char*)calloc(ctx->num_pieces, 1);
+    if (!wanted) return 0;
+    for (int i = 0; i < ctx->num_pieces; i++) {
+        wanted[i] = journal_has(&ctx->journal, i);
     }
-    response_line[pos] = '\0';
     
-    int received_index, data_size;
-    if (sscanf(response_line, "SEND_PIECE %d %d", &received_index, &data_size) != 2) {
-        close(sock);
-        return -1;
+    unsigned char *hashes = NULL;
+    if (ctx->piece_hashes) {
+        printf("Checking saved pieces...\n");
+        hashes = (unsigned char*)malloc((size_t)ctx->num_pieces * HASH_SIZE + 1);
+        if (!hashes || hash_file_pieces(ctx->output_fd, ctx->file_size, ctx->piece_size, hashes, wanted) != 0) {
+            printf("✗ Cannot read %s.part, starting over\n", ctx->filename);
+            free(hashes);
+            free(wanted);
+            return 0;
+        }
     }
     
-    if (received_index != piece_index) {
-        close(sock);
-        return -1;
+    int resumed = 0, damaged = 0;
+    long resumed_bytes = 0;
+    for (int i = 0; i < ctx->num_pieces; i++) {
+        if (!wanted[i]) continue;
+        if (hashes && memcmp(hashes + (size_t)i * HASH_SIZE,
+                             ctx->piece_hashes + (size_t)i * HASH_SIZE, HASH_SIZE) != 0) {
+            damaged++;
+            continue;
+        }
+        mark_piece_resumed(ctx, i);
+        resumed_bytes += get_piece_length(ctx, i);
+        resumed++;
     }
+    add_resumed_progress(ctx->progress, resumed, resumed_bytes);
     
-    // Read piece data
-    int total_received = 0;
-    while (total_received < data_size) {
-        int bytes = read(sock, buffer + total_received, data_size - total_received);
-        if (bytes <= 0) break;
-        total_received += bytes;
+    if (damaged > 0) {
+        printf("✗ %d saved piece(s) don't match their hash, downloading them again\n", damaged);
+    }
+    free(hashes);
+    free(wanted);
+    return resumed;
+}
+
+// Check the pieces just copied into the .part file from something we had
+// (wanted[i] != 0) against the manifest, on every core, and count the good
+// ones as done. Returns how many were good
+int accept_copied_pieces(DownloadContext *ctx, char *wanted, char *source) {
+    unsigned char *hashes = (unsigned char*)malloc((size_t)ctx->num_pieces * HASH_SIZE + 1);
+    if (!hashes || hash_file_pieces(ctx->output_fd, ctx->file_size, ctx->piece_size, hashes, wanted) != 0) {
+        free(hashes);
+        return 0;  // Nothing marked: they are simply downloaded
     }
     
-    *bytes_received = total_received;
-    close(sock);
+    int found = 0, damaged = 0;
+    long found_bytes = 0;
+    for (int i = 0; i < ctx->num_pieces; i++) {
+        if (!wanted[i]) continue;
+        if (memcmp(hashes + (size_t)i * HASH_SIZE, ctx->piece_hashes + (size_t)i * HASH_SIZE, HASH_SIZE) != 0) {
+            damaged++;
+            continue;
+        }
+        journal_mark(&ctx->journal, i);
+        mark_piece_resumed(ctx, i);
+        found_bytes += get_piece_length(ctx, i);
+        found++;
+    }
+    add_resumed_progress(ctx->progress, found, found_bytes);
     
-    return (total_received == data_size) ? 0 : -1;
+    if (damaged > 0) {
+        printf("✗ %d piece(s) copied from %s don't match their hash, downloading them\n", damaged, source);
+    }
+    free(hashes);
+    return found;
 }
 
-// Download worker thread
-typedef struct {
-    DownloadContext *ctx;
-    PeerConnection *peer;
-    int thread_id;
-} DownloadWorkerArgs;
-
-void* download_worker(void *arg) {
-    DownloadWorkerArgs *args = (DownloadWorkerArgs*)arg;
-    DownloadContext *ctx = args->ctx;
-    PeerConnection *peer = args->peer;
-    int thread_id = args->thread_id;
-    
-    // Find peer index
-    int peer_index = -1;
-    for (int i = 0; i < ctx->peer_count; i++) {
-        if (strcmp(ctx->peers[i].ip, peer->ip) == 0 && 
-            ctx->peers[i].port == peer->port) {
-            peer_index = i;
-            break;
+// Pieces the piece store already has (from a file we share, or an older
+// version of this one) are copied into the .part file instead of downloaded
+// Returns how many pieces were taken from the store
+int copy_stored_pieces(DownloadContext *ctx) {
+    char store_dir[512];
+    get_store_dir(store_dir);
+    
+    char *wanted = (char*)calloc(ctx->num_pieces, 1);
+    if (!wanted) return 0;
+    
+    int copied = 0;
+    for (int i = 0; i < ctx->num_pieces; i++) {
+        if (has_completed_piece(ctx, i)) continue;
+        if (store_copy_piece(store_dir, ctx->piece_hashes + (size_t)i * HASH_SIZE,
+                             ctx->output_fd, (long)i * ctx->piece_size, get_piece_length(ctx, i)) == 0) {
+            wanted[i] = 1;
+            copied++;
         }
     }
     
-    char *piece_buffer = (char*)malloc(PIECE_SIZE);
-    if (!piece_buffer) {
-        free(arg);
-        return NULL;
+    int found = (copied > 0) ? accept_copied_pieces(ctx, wanted, "the piece store") : 0;
+    free(wanted);
+    return found;
+}
+
+// Order chunks by hash (then length), for bsearch()
+int compare_chunks(const void *a, const void *b) {
+    const Chunk *x = (const Chunk*)a;
+    const Chunk *y = (const Chunk*)b;
+    int order = memcmp(x->hash, y->hash, HASH_SIZE);
+    if (order != 0) return order;
+    return (x->length > y->length) - (x->length < y->length);
+}
+
+// Build what we can of the new version of a file from an older one (--cdc)
+// Both are cut into content-defined chunks; every chunk of the new version
+// that the old one has too is copied into place. Transfers still go by
+// piece, so only pieces made entirely of such chunks are kept (after their
+// hash check) - the rest is downloaded. Returns how many pieces were built
+int copy_old_chunks(DownloadContext *ctx, char *old_path, Chunk *chunks, int count) {
+    Chunk *old_chunks = NULL;
+    int old_count = chunk_file(old_path, &old_chunks);
+    if (old_count <= 0) {
+        free(old_chunks);
+        return 0;
+    }
+    qsort(old_chunks, old_count, sizeof(Chunk), compare_chunks);
+    long piece_size = ctx->piece_size;
+    
+    // Which new chunks we have, and how much of each piece they cover
+    Chunk **match = (Chunk**)calloc(count + 1, sizeof(Chunk*));
+    long *covered = (long*)calloc(ctx->num_pieces + 1, sizeof(long));
+    char *wanted = (char*)calloc(ctx->num_pieces + 1, 1);
+    int in_fd = open(old_path, O_RDONLY);
+    if (!match || !covered || !wanted || in_fd < 0) {
+        if (in_fd >= 0) close(in_fd);
+        free(match);
+        free(covered);
+        free(wanted);
+        free(old_chunks);
+        return 0;
     }
     
-    while (!is_download_complete(ctx) && !ctx->failed) {
-        // Get next piece to download
-        int piece_index = get_next_piece(ctx);
+    for (int c = 0; c < count; c++) {
+        match[c] = (Chunk*)bsearch(&chunks[c], old_chunks, old_count, sizeof(Chunk), compare_chunks);
+        if (!match[c]) continue;
         
-        if (piece_index == -1) {
-            // No more pieces to download
-            break;
+        long start = chunks[c].offset;
+        long end = start + chunks[c].length;
+        for (long p = start / piece_size; p * piece_size < end; p++) {
+            long from = (start > p * piece_size) ? start : p * piece_size;
+            long to = (end < (p + 1) * piece_size) ? end : (p + 1) * piece_size;
+            covered[p] += to - from;
         }
-        
-        // Download piece from peer
-        int bytes_received;
-        if (request_piece_from_peer(peer->ip, peer->port, ctx->filename, 
-                                     piece_index, piece_buffer, &bytes_received) == 0) {
-            // Success - save piece
-            save_piece(ctx->filename, ctx->downloads_dir, piece_index, 
-                      piece_buffer, bytes_received);
-            
-            mark_piece_completed(ctx, piece_index, peer_index, bytes_received);
-            
-            // Update progress
-            pthread_mutex_lock(&ctx->status_mutex);
-            update_progress(ctx->progress, bytes_received);
-            display_progress(ctx->progress);
-            
-            // Show which peer just contributed (color coded!)
-            printf(" [P%d]", peer_index + 1);
-            fflush(stdout);
-            
-            pthread_mutex_unlock(&ctx->status_mutex);
-            
-        } else {
-            // Failed - mark for retry
-            mark_piece_failed(ctx, piece_index);
+    }
+    
+    int candidates = 0;
+    for (int p = 0; p < ctx->num_pieces; p++) {
+        if (!has_completed_piece(ctx, p) && covered[p] == get_piece_length(ctx, p)) {
+            wanted[p] = 1;
+            candidates++;
         }
     }
     
-    free(piece_buffer);
-    free(arg);
-    return NULL;
+    // Copy only into those pieces: the others are downloaded whole anyway,
+    // and pieces that are already done must not be touched. A copy that
+    // fails shows up in the hash check
+    for (int c = 0; c < count && candidates > 0; c++) {
+        if (!match[c]) continue;
+        
+        long start = chunks[c].offset;
+        long end = start + chunks[c].length;
+        for (long p = start / piece_size; p * piece_size < end; p++) {
+            if (!wanted[p]) continue;
+            long from = (start > p * piece_size) ? start : p * piece_size;
+            long to = (end < (p + 1) * piece_size) ? end : (p + 1) * piece_size;
+            copy_file_part(in_fd, match[c]->offset + (from - start), ctx->output_fd, from, to - from);
+        }
+    }
+    close(in_fd);
+    
+    int found = (candidates > 0) ? accept_copied_pieces(ctx, wanted, old_path) : 0;
+    free(match);
+    free(covered);
+    free(wanted);
+    free(old_chunks);
+    return found;
 }
 
 // Download file with multi-source support and per-peer stats
 void download_file() {
     char filename[MAX_FILENAME];
-    char message[1024];
-    char response[1024];
     
     printf("\n--- Download File (Multi-Source) ---\n");
     printf("Enter filename to download: ");
     scanf("%s", filename);
     getchar();
     
-    // Query tracker for peers
-    sprintf(message, "QUERY %s\n", filename);
+    // Ask tracker for the best peers for us (idle, complete, nearby first)
+    char peer_ips[MAX_PEERS][16];
+    int peer_ports[MAX_PEERS];
+    int total_peers = 0;
+    unsigned long long cursor = 0;
     
     printf("Searching for peers...\n");
-    if (connect_to_tracker(message, response) != 0) {
+    int peer_count = tracker_query_peers(filename, MAX_PEERS, &cursor, 1, peer_ips, peer_ports, &total_peers);
+    if (peer_count < 0) {
         printf("✗ Cannot contact tracker\n");
         printf("\nPress Enter to continue...");
         getchar();
         return;
     }
     
-    if (strncmp(response, "ERROR", 5) == 0) {
+    if (peer_count == 0) {
         printf("✗ File not found\n");
         printf("\nPress Enter to continue...");
         getchar();
         return;
     }
     
-    // Parse peer list
-    int peer_count;
-    char peer_list[2048];
-    strcpy(peer_list, response);
-    
-    char *line = strtok(peer_list, "\n");
-    sscanf(line, "PEERS %d", &peer_count);
-    
-    printf("✓ Found %d peer(s)\n", peer_count);
-    
-    if (peer_count == 0) {
-        printf("✗ No peers available\n");
-        printf("\nPress Enter to continue...");
-        getchar();
-        return;
-    }
+    printf("✓ Found %d peer(s)\n", total_peers);
     
-    // Get file info from first peer
-    line = strtok(NULL, "\n");
-    char first_peer_ip[16];
-    int first_peer_port;
-    sscanf(line, "%[^:]:%d", first_peer_ip, &first_peer_port);
+    // The content root from the tracker says what the file is: every piece
+    // hash we accept must add up to it
+    char root[HASH_HEX_SIZE] = "";
+    int root_from_tracker = (tracker_get_root(filename, root) == 0);
+    if (!root_from_tracker) root[0] = '\0';
     
+    // Get file info from the first peer that can answer
+    // (a peer that is still downloading may not know it yet)
     int num_pieces;
     long file_size;
+    int piece_size;
+    int info_found = 0;
+    
+    for (int i = 0; i < peer_count && !info_found; i++) {
+        char peer_root[HASH_HEX_SIZE];
+        printf("Getting file information from %s:%d...\n", peer_ips[i], peer_ports[i]);
+        if (get_file_info_from_peer(peer_ips[i], peer_ports[i], filename, &num_pieces, &file_size,
+                                    &piece_size, peer_root) != 0) {
+            continue;
+        }
+        if (file_size < 0 || !valid_piece_size(piece_size) ||
+            num_pieces != calculate_num_pieces(file_size, piece_size)) {
+            printf("✗ %s:%d sent file info that doesn't add up, skipping it\n", peer_ips[i], peer_ports[i]);
+            continue;
+        }
+        if (root[0] && peer_root[0] && strcmp(root, peer_root) != 0) {
+            printf("✗ %s:%d has different content, skipping it\n", peer_ips[i], peer_ports[i]);
+            continue;
+        }
+        if (!root[0]) strcpy(root, peer_root);  // The tracker knows none: the peer's is all we have
+        info_found = 1;
+    }
     
-    printf("Getting file information from %s:%d...\n", first_peer_ip, first_peer_port);
-    if (get_file_info_from_peer(first_peer_ip, first_peer_port, filename, &num_pieces, &file_size) != 0) {
+    if (!info_found) {
         printf("✗ Cannot get file info\n");
         printf("\nPress Enter to continue...");
         getchar();
         return;
     }
     
+    // Piece hashes, so every block is checked as it arrives. Only hashes that
+    // add up to the content root count: a peer can't make up its own (and
+    // without a root, all we could get is an older peer's flat hashes)
+    unsigned char root_hash[HASH_SIZE];
+    int have_root = (hex_to_hash(root, root_hash) == 0);
+    unsigned char *piece_hashes = NULL;
+    for (int i = 0; have_root && i < peer_count && i < MANIFEST_PEER_TRIES && !piece_hashes; i++) {
+        piece_hashes = get_manifest_from_peer(peer_ips[i], peer_ports[i], filename, num_pieces);
+        
+        unsigned char check[HASH_SIZE];
+        if (piece_hashes) {
+            merkle_root(piece_hashes, num_pieces, check);
+            if (memcmp(check, root_hash, HASH_SIZE) != 0) {
+                printf("✗ Piece hashes from %s:%d don't match the content root\n", peer_ips[i], peer_ports[i]);
+                free(piece_hashes);
+                piece_hashes = NULL;
+            }
+        }
+    }
+    
     printf("\n");
     printf("========================================\n");
     printf("File: %s\n", filename);
     printf("Size: %.2f MB (%ld bytes)\n", file_size / (1024.0 * 1024.0), file_size);
-    printf("Pieces: %d\n", num_pieces);
+    printf("Pieces: %d of %d KB\n", num_pieces, piece_size / 1024);
     printf("Peers: %d\n", peer_count);
+    if (have_root) {
+        printf("Content root: %.16s... (%s)\n", root, root_from_tracker ? "from the tracker" : "from a peer, the tracker has none");
+    }
+    printf("Piece hashes: %s\n", piece_hashes ? "yes, every block is checked as it arrives" : "none, pieces can't be checked");
     printf("========================================\n\n");
     
     // Initialize download context
@@ -300,75 +760,160 @@ void download_file() {
     sprintf(temp_dir, "%s/temp_download", base_dir);
     
     DownloadContext ctx;
-    init_download_context(&ctx, filename, num_pieces, file_size, temp_dir);
+    init_download_context(&ctx, filename, num_pieces, file_size, piece_size, temp_dir);
+    ctx.piece_hashes = piece_hashes;  // The context frees them
+    
+    // Pieces go straight to their place in the destination file (named .part
+    // until it is complete), so there is nothing to assemble at the end
+    char output_path[512];
+    char part_path[520];
+    sprintf(output_path, "%s/downloads/%s", base_dir, filename);
+    sprintf(part_path, "%s.part", output_path);
+    
+    // A journal next to it records which pieces are written, so an interrupted
+    // download of the same file carries on where it stopped
+    char state_path[520];
+    sprintf(state_path, "%s.state", output_path);
+    
+    int resumed = -1;
+    ctx.output_fd = open_output_file(part_path, file_size);
+    if (ctx.output_fd >= 0) {
+        resumed = journal_open(&ctx.journal, state_path, num_pieces, file_size, piece_size);
+        if (resumed < 0) {
+            // Left over from some other download: start over
+            close(ctx.output_fd);
+            ctx.output_fd = -1;
+        }
+    }
     
-    // Add all peers to context
-    strcpy(peer_list, response);  // Reset peer_list
-    line = strtok(peer_list, "\n");  // Skip "PEERS X"
-    line = strtok(NULL, "\n");  // First peer
+    if (ctx.output_fd < 0) {
+        ctx.output_fd = create_output_file(part_path, file_size);
+        if (ctx.output_fd < 0) {
+            printf("✗ Cannot create %s, saving pieces separately\n", part_path);
+        } else if (journal_create(&ctx.journal, state_path, num_pieces, file_size, piece_size) != 0) {
+            printf("✗ Cannot create %s, this download can't be resumed\n", state_path);
+        }
+    } else if (resumed > 0) {
+        resumed = resume_pieces(&ctx);
+        printf("✓ Resuming: %d/%d pieces already downloaded\n", resumed, num_pieces);
+    }
     
-    while (line != NULL && ctx.peer_count < MAX_PEERS) {
-        char ip[16];
-        int port;
-        if (sscanf(line, "%[^:]:%d", ip, &port) == 2) {
-            add_peer_to_context(&ctx, ip, port);
-            printf("Added peer %d: %s:%d\n", ctx.peer_count, ip, port);
+    // Pieces we already keep for other files don't need the network
+    if (ctx.output_fd >= 0 && ctx.piece_hashes) {
+        int stored_pieces = copy_stored_pieces(&ctx);
+        if (stored_pieces > 0) {
+            printf("✓ %d/%d pieces found in the local piece store, not downloading them\n", stored_pieces, num_pieces);
+        }
+    }
+    
+    // --cdc: an older version we have (our last download of the file, or the
+    // copy we share) may hold most of the new one, shifted around
+    if (cdc_mode && ctx.output_fd >= 0 && ctx.piece_hashes && !is_download_complete(&ctx)) {
+        char old_path[512];
+        sprintf(old_path, "%s/downloads/%s", base_dir, filename);
+        if (get_file_size(old_path) < 0) {
+            sprintf(old_path, "%s/shared/%s", base_dir, filename);
+        }
+        
+        Chunk *chunks = NULL;
+        int chunk_count = 0;
+        for (int i = 0; get_file_size(old_path) >= 0 && i < peer_count && i < MANIFEST_PEER_TRIES && !chunks; i++) {
+            if (is_self(peer_ips[i], peer_ports[i])) continue;
+            chunks = get_chunks_from_peer(peer_ips[i], peer_ports[i], filename, file_size, &chunk_count);
+        }
+        
+        if (chunks) {
+            printf("Looking for unchanged chunks in %s...\n", old_path);
+            int built = copy_old_chunks(&ctx, old_path, chunks, chunk_count);
+            printf("✓ %d/%d pieces built from the old version, not downloading them\n", built, num_pieces);
+            free(chunks);
+        }
+    }
+    
+    // Add all peers to context
+    for (int i = 0; i < peer_count; i++) {
+        if (is_self(peer_ips[i], peer_ports[i])) continue;
+        if (add_peer_to_context(&ctx, peer_ips[i], peer_ports[i]) >= 0) {
+            printf("Added peer %d: %s:%d\n", ctx.peer_count, peer_ips[i], peer_ports[i]);
         }
-        line = strtok(NULL, "\n");
     }
     
+    // Serve the pieces we finish to other downloaders while we download,
+    // and tell the tracker we are in the swarm (0% complete, ranked last)
+    pthread_mutex_lock(&current_download_mutex);
+    current_download = &ctx;
+    pthread_mutex_unlock(&current_download_mutex);
+    
+    char message[512];
+    char response[256];
+    int partial_registered = (shared_file_size(filename) < 0);
+    if (partial_registered) {
+        sprintf(message, "REGISTER %s %d 0\n", filename, my_port);
+        tracker_request(message, response, sizeof(response));
+    }
+    
+    // From now on announce_thread keeps the registration alive, and makes it
+    // again if the tracker forgets it (or didn't get it just now)
+    pthread_mutex_lock(&current_download_mutex);
+    current_download_registered = partial_registered;
+    pthread_mutex_unlock(&current_download_mutex);
+    
     printf("\nStarting multi-source download from %d peer(s)...\n", ctx.peer_count);
     printf("Watch for [P1], [P2], [P3]... indicators showing which peer is contributing!\n\n");
     sleep(1);
     
-    // Create worker threads
-    pthread_t workers[MAX_CONCURRENT_DOWNLOADS];
-    int num_workers = MAX_CONCURRENT_DOWNLOADS;
+    // One thread drives every peer connection, and brings in more peers as they join
+    run_download_engine(&ctx, refresh_peers);
     
-    printf("Spawning %d download threads...\n\n", num_workers);
+    printf("\n\n");
     
-    for (int i = 0; i < num_workers; i++) {
-        DownloadWorkerArgs *args = (DownloadWorkerArgs*)malloc(sizeof(DownloadWorkerArgs));
-        args->ctx = &ctx;
-        args->peer = &ctx.peers[i % ctx.peer_count];
-        args->thread_id = i;
-        
-        pthread_create(&workers[i], NULL, download_worker, args);
-    }
+    // Stop serving from this download before its pieces go away
+    pthread_mutex_lock(&current_download_mutex);
+    current_download = NULL;
+    current_download_registered = 0;
+    pthread_mutex_unlock(&current_download_mutex);
     
-    // Wait for all workers to finish
-    for (int i = 0; i < num_workers; i++) {
-        pthread_join(workers[i], NULL);
+    if (partial_registered) {
+        sprintf(message, "UNREGISTER %s %d\n", filename, my_port);
+        tracker_request(message, response, sizeof(response));
     }
     
-    printf("\n\n");
-    
     // Display per-peer statistics
     display_peer_stats(&ctx);
     
-    // Assemble file
+    int stored = 0;
     if (is_download_complete(&ctx)) {
-        printf("\nAssembling file...\n");
-        char output_path[512];
-        sprintf(output_path, "%s/downloads/%s", base_dir, filename);
-        
-        if (assemble_file(filename, temp_dir, num_pieces, output_path) == 0) {
-            printf("\n========================================\n");
-            printf("✓ Download Complete!\n");
-            printf("========================================\n");
-            printf("File: %s\n", output_path);
-            printf("Size: %.2f MB\n", file_size / (1024.0 * 1024.0));
-            printf("Average Speed: %.2f MB/s\n", get_speed_mbps(ctx.progress));
-            printf("Time Taken: %ld seconds\n", time(NULL) - ctx.progress->start_time);
-            printf("========================================\n");
+        if (ctx.output_fd >= 0) {
+            // Every piece is already in place: just give the file its name
+            stored = (rename(part_path, output_path) == 0);
+            if (stored) unlink(state_path);
+        } else {
+            printf("\nAssembling file...\n");
+            stored = (assemble_file(filename, temp_dir, num_pieces, piece_size, output_path) == 0);
             
             // Cleanup temp pieces
             char cleanup_cmd[1024];
             sprintf(cleanup_cmd, "rm -f %s/%s.piece*", temp_dir, filename);
             system(cleanup_cmd);
         }
+    }
+    
+    if (stored) {
+        printf("\n========================================\n");
+        printf("✓ Download Complete!\n");
+        printf("========================================\n");
+        printf("File: %s\n", output_path);
+        printf("Size: %.2f MB\n", file_size / (1024.0 * 1024.0));
+        printf("Average Speed: %.2f MB/s\n", get_speed_mbps(ctx.progress));
+        printf("Time Taken: %ld seconds\n", time(NULL) - ctx.progress->start_time);
+        printf("========================================\n");
     } else {
         printf("\n✗ Download incomplete or failed\n");
+        if (ctx.journal.fd >= 0) {
+            printf("Progress is saved: download %s again to resume\n", filename);
+        } else if (ctx.output_fd >= 0) {
+            unlink(part_path);
+        }
     }
     
     cleanup_download_context(&ctx);
@@ -377,64 +922,673 @@ void download_file() {
     getchar();
 }
 
-// Handle peer upload
-void* handle_peer_upload(void *arg) {
-    int client_fd = *(int*)arg;
-    free(arg);
+// Size of a file we can answer FILE_INFO for: shared, or being downloaded right now
+// piece_size gets the size of its pieces. -1 if we have neither
+long lookup_file_size(char *filename, int *piece_size) {
+    long file_size = shared_file_size(filename);
     
-    char buffer[1024];
-    int bytes_read = read(client_fd, buffer, sizeof(buffer));
+    if (file_size >= 0) {
+        *piece_size = choose_piece_size(file_size);
+    } else {
+        pthread_mutex_lock(&current_download_mutex);
+        if (current_download && strcmp(current_download->filename, filename) == 0) {
+            file_size = current_download->file_size;
+            *piece_size = current_download->piece_size;
+        }
+        pthread_mutex_unlock(&current_download_mutex);
+    }
+    return file_size;
+}
+
+// Read a block of a piece our download in progress already finished
+int read_downloaded_block(char *filename, int piece_index, int offset, int length, char *buffer, int *bytes_read) {
+    int result = -1;
+    
+    pthread_mutex_lock(&current_download_mutex);
+    if (current_download && strcmp(current_download->filename, filename) == 0 &&
+        has_completed_piece(current_download, piece_index)) {
+        if (current_download->output_fd >= 0) {
+            result = read_block_at(current_download->output_fd, current_download->piece_size, piece_index,
+                                   offset, length, buffer, bytes_read);
+        } else {
+            result = read_block(filename, current_download->downloads_dir, piece_index,
+                                offset, length, buffer, bytes_read);
+        }
+    }
+    pthread_mutex_unlock(&current_download_mutex);
     
-    if (bytes_read > 0) {
-        buffer[bytes_read] = '\0';
+    return result;
+}
+
+// A block we have, from a shared file or from our download in progress
+// Returns how many bytes were read (up to `length`), or -1 if we don't have it
+int find_block(char *filename, int piece_index, int offset, int length, char *buffer) {
+    int block_size = 0;
+    char pieces_dir[512];
+    sprintf(pieces_dir, "%s/pieces", base_dir);
+    
+    if (read_block(filename, pieces_dir, piece_index, offset, length, buffer, &block_size) != 0 &&
+        read_downloaded_block(filename, piece_index, offset, length, buffer, &block_size) != 0) {
+        return -1;
+    }
+    return block_size;
+}
+
+// A block to upload, from a shared file or from our download in progress
+// Returns 0 if all `length` bytes were read, -1 otherwise
+int load_block(char *filename, int piece_index, int offset, int length, char *buffer) {
+    if (find_block(filename, piece_index, offset, length, buffer) != length) {
+        printf("[Upload] ✗ Block not found: %s piece %d offset %d\n", filename, piece_index, offset);
+        return -1;
+    }
+    __atomic_add_fetch(&bytes_uploaded, length, __ATOMIC_RELAXED);
+    return 0;
+}
+
+// The leaves of one of our pieces, read from the leaves file of a shared file
+// or, for our download in progress, hashed block by block from the piece
+// Returns 0, or -1 if we don't have the piece
+int load_leaves(char *filename, int piece_index, int piece_size, long file_size, unsigned char *leaves) {
+    char filepath[512];
+    char leaves_path[512];
+    sprintf(filepath, "%s/shared/%s", base_dir, filename);
+    get_leaves_path(leaves_path, filename);
+    if (load_piece_leaves(leaves_path, filepath, piece_size, piece_index, leaves) == 0) {
+        return 0;
+    }
+    
+    long start = (long)piece_index * piece_size;
+    if (piece_index < 0 || start >= file_size) return -1;
+    int length = (file_size - start < piece_size) ? (int)(file_size - start) : piece_size;
+    
+    char block[BLOCK_SIZE];
+    memset(leaves, 0, (size_t)merkle_leaf_count(piece_size) * HASH_SIZE);
+    for (int offset = 0; offset < length; offset += BLOCK_SIZE) {
+        int size = (length - offset < BLOCK_SIZE) ? length - offset : BLOCK_SIZE;
+        if (find_block(filename, piece_index, offset, size, block) != size) return -1;
+        hash_leaf(block, size, leaves + (size_t)(offset / BLOCK_SIZE) * HASH_SIZE);
+    }
+    return 0;
+}
+
+// Merkle proof of a block we upload (up to MAX_PROOF_SIZE bytes into proof)
+// The leaves come from the cache, or from load_leaves() into its least
+// recently used slot
+// Returns how many hashes the proof has, or -1 if we don't have the piece
+int get_block_proof(ProofCache *cache, char *filename, int piece_index, int offset, unsigned char *proof) {
+    if (offset % BLOCK_SIZE != 0) return -1;
+    
+    CachedLeaves *entry = NULL;
+    CachedLeaves *oldest = &cache->pieces[0];
+    for (int i = 0; i < PROOF_CACHE_PIECES && !entry; i++) {
+        CachedLeaves *slot = &cache->pieces[i];
+        if (slot->piece_index == piece_index && strcmp(slot->filename, filename) == 0) {
+            entry = slot;
+        } else if (slot->last_used < oldest->last_used) {
+            oldest = slot;
+        }
+    }
+    
+    if (!entry) {
+        int piece_size;
+        long file_size = lookup_file_size(filename, &piece_size);
+        if (file_size < 0) return -1;
         
+        entry = oldest;
+        entry->piece_index = -1;
+        if (load_leaves(filename, piece_index, piece_size, file_size, entry->leaves) != 0) return -1;
+        strcpy(entry->filename, filename);
+        entry->piece_index = piece_index;
+        entry->piece_size = piece_size;
+    }
+    entry->last_used = ++cache->clock;
+    if (offset >= entry->piece_size) return -1;
+    
+    merkle_proof(entry->leaves, entry->piece_size, offset / BLOCK_SIZE, proof);
+    return merkle_proof_hashes(entry->piece_size);
+}
+
+// Which pieces we have: every piece of a shared file, or the pieces of our
+// download in progress that are finished. NULL if we have neither
+// Returns (num_pieces + 7) / 8 bytes the caller frees
+unsigned char* collect_bitfield(char *filename, int *num_pieces, int *seq) {
+    unsigned char *bits = NULL;
+    
+    long file_size = shared_file_size(filename);
+    if (file_size >= 0) {
+        *num_pieces = calculate_num_pieces(file_size, choose_piece_size(file_size));
+        bits = (unsigned char*)calloc((*num_pieces + 7) / 8 + 1, 1);
+        if (bits) {
+            for (int i = 0; i < *num_pieces; i++) bits[i >> 3] |= 0x80 >> (i & 7);
+        }
+        *seq = *num_pieces;
+    } else {
+        pthread_mutex_lock(&current_download_mutex);
+        if (current_download && strcmp(current_download->filename, filename) == 0) {
+            *num_pieces = current_download->num_pieces;
+            bits = (unsigned char*)malloc((*num_pieces + 7) / 8 + 1);
+            if (bits) *seq = build_bitfield(current_download, bits);
+        }
+        pthread_mutex_unlock(&current_download_mutex);
+    }
+    return bits;
+}
+
+// Pieces of our download finished since position seq, as big-endian u32s in raw
+// (a shared file is complete: nothing new will ever come)
+// Returns the count, or -1 if we have neither
+int collect_haves(char *filename, int seq, uint32_t *raw, int *new_seq) {
+    long file_size = shared_file_size(filename);
+    if (file_size >= 0) {
+        *new_seq = calculate_num_pieces(file_size, choose_piece_size(file_size));
+        return 0;
+    }
+    
+    int pieces[MAX_HAVES_PER_REPLY];
+    int count = -1;
+    
+    pthread_mutex_lock(&current_download_mutex);
+    if (current_download && strcmp(current_download->filename, filename) == 0) {
+        count = get_haves_since(current_download, seq, pieces, MAX_HAVES_PER_REPLY, new_seq);
+    }
+    pthread_mutex_unlock(&current_download_mutex);
+    
+    for (int i = 0; i < count; i++) {
+        raw[i] = htonl(pieces[i]);
+    }
+    return count;
+}
+
+// Piece hashes of a shared file, or of our download in progress
+// Returns *num_pieces * HASH_SIZE bytes the caller frees, NULL if we have none
+unsigned char* collect_manifest(char *filename, int *num_pieces) {
+    unsigned char *hashes = NULL;
+    
+    long file_size = shared_file_size(filename);
+    if (file_size >= 0) {
+        char filepath[512];
+        char manifest_path[512];
+        sprintf(filepath, "%s/shared/%s", base_dir, filename);
+        get_manifest_path(manifest_path, filename);
+        *num_pieces = calculate_num_pieces(file_size, choose_piece_size(file_size));
+        hashes = load_manifest(manifest_path, filepath, choose_piece_size(file_size));
+    } else {
+        pthread_mutex_lock(&current_download_mutex);
+        if (current_download && strcmp(current_download->filename, filename) == 0 &&
+            current_download->piece_hashes) {
+            *num_pieces = current_download->num_pieces;
+            size_t size = (size_t)*num_pieces * HASH_SIZE;
+            hashes = (unsigned char*)malloc(size + 1);
+            if (hashes) memcpy(hashes, current_download->piece_hashes, size);
+        }
+        pthread_mutex_unlock(&current_download_mutex);
+    }
+    return hashes;
+}
+
+// Chunk list of a shared file (kept in --cdc mode), in wire format
+// Returns *count * CHUNK_ENTRY_SIZE bytes the caller frees, NULL if we have none
+unsigned char* collect_chunks(char *filename, int *count) {
+    long file_size = shared_file_size(filename);
+    if (file_size < 0) return NULL;
+    
+    char filepath[512];
+    char chunks_path[512];
+    sprintf(filepath, "%s/shared/%s", base_dir, filename);
+    get_chunks_path(chunks_path, filename);
+    unsigned char *entries = load_chunk_manifest(chunks_path, filepath, count);
+    if (entries && (size_t)*count * CHUNK_ENTRY_SIZE + 4 > FRAME_MAX_PAYLOAD) {
+        free(entries);  // Too big for one reply
+        entries = NULL;
+    }
+    return entries;
+}
+
+// Content root of a shared file, or of our download in progress
+// Returns 0, or -1 if we have no piece hashes for it
+int lookup_file_root(char *filename, unsigned char *root) {
+    int num_pieces = 0;
+    unsigned char *hashes = collect_manifest(filename, &num_pieces);
+    if (!hashes) return -1;
+    
+    merkle_root(hashes, num_pieces, root);
+    free(hashes);
+    return 0;
+}
+
+// Reply "ERROR <message>" and keep the connection open
+int send_error(PeerSession *session, char *message) {
+    char response[256];
+    snprintf(response, sizeof(response), "ERROR %s\n", message);
+    return session_send(session, response, strlen(response));
+}
+
+// Reply to BITFIELD (text)
+int send_bitfield(PeerSession *session, char *filename) {
+    int num_pieces = 0, seq = 0;
+    unsigned char *bits = collect_bitfield(filename, &num_pieces, &seq);
+    if (!bits) {
+        return send_error(session, "File not found");
+    }
+    
+    char header[128];
+    sprintf(header, "BITFIELD %d %d\n", num_pieces, seq);
+    int result = session_send(session, header, strlen(header));
+    if (result == 0) {
+        result = session_send(session, bits, (num_pieces + 7) / 8);
+    }
+    free(bits);
+    return result;
+}
+
+// Reply to HAVE (text)
+int send_haves(PeerSession *session, char *filename, int seq) {
+    uint32_t raw[MAX_HAVES_PER_REPLY];
+    int new_seq = 0;
+    int count = collect_haves(filename, seq, raw, &new_seq);
+    if (count < 0) {
+        return send_error(session, "File not found");
+    }
+    
+    char header[128];
+    sprintf(header, "HAVE %d %d\n", new_seq, count);
+    if (session_send(session, header, strlen(header)) != 0) return -1;
+    return session_send(session, raw, count * 4);
+}
+
+// Reply to MANIFEST (text)
+int send_manifest(PeerSession *session, char *filename) {
+    int num_pieces = 0;
+    unsigned char *hashes = collect_manifest(filename, &num_pieces);
+    if (!hashes) {
+        return send_error(session, "No piece hashes");
+    }
+    
+    char header[128];
+    sprintf(header, "MANIFEST %d\n", num_pieces);
+    int result = session_send(session, header, strlen(header));
+    if (result == 0) {
+        result = session_send(session, hashes, num_pieces * HASH_SIZE);
+    }
+    free(hashes);
+    return result;
+}
+
+// Reply to CHUNKS (text)
+int send_chunks(PeerSession *session, char *filename) {
+    int count = 0;
+    unsigned char *entries = collect_chunks(filename, &count);
+    if (!entries) {
+        return send_error(session, "No chunk list");
+    }
+    
+    char header[128];
+    sprintf(header, "CHUNKS %d\n", count);
+    int result = session_send(session, header, strlen(header));
+    if (result == 0) {
+        result = session_send(session, entries, (size_t)count * CHUNK_ENTRY_SIZE);
+    }
+    free(entries);
+    return result;
+}
+
+// Text commands, one per line (downloaders that don't speak frames)
+void serve_text_commands(PeerSession *session, char *block_data, ProofCache *proofs) {
+    char buffer[1024];
+    char *piece_data = NULL;  // Whole pieces, for REQUEST_PIECE only (older downloaders)
+    
+    while (session_read_line(session, buffer, sizeof(buffer)) >= 0) {
         if (strncmp(buffer, "FILE_INFO", 9) == 0) {
             char filename[MAX_FILENAME];
-            sscanf(buffer, "FILE_INFO %s", filename);
+            char flag[16] = "";
+            if (sscanf(buffer, "FILE_INFO %99s %15s", filename, flag) < 1) {
+                if (send_error(session, "Bad request") != 0) break;
+                continue;
+            }
+            int want_piece_size = (strcmp(flag, "PIECE_SIZE") == 0);
             
             printf("[Info] Request for file info: %s\n", filename);
             
-            char filepath[512];
-            sprintf(filepath, "%s/shared/%s", base_dir, filename);
-            long file_size = get_file_size(filepath);
-            int num_pieces = calculate_num_pieces(file_size);
+            int piece_size = 0;
+            long file_size = lookup_file_size(filename, &piece_size);
             
             char response[256];
-            sprintf(response, "INFO %d %ld\n", num_pieces, file_size);
-            send(client_fd, response, strlen(response), 0);
-            
-            printf("[Info] Sent: %d pieces, %ld bytes\n", num_pieces, file_size);
+            if (file_size < 0) {
+                sprintf(response, "ERROR File not found\n");
+            } else if (!want_piece_size && piece_size != LEGACY_PIECE_SIZE) {
+                // An older downloader would cut the file into the wrong pieces
+                sprintf(response, "ERROR Piece size %d needs a newer peer\n", piece_size);
+            } else {
+                // The content root goes last: older downloaders don't read it
+                int num_pieces = calculate_num_pieces(file_size, piece_size);
+                unsigned char root[HASH_SIZE];
+                char root_hex[HASH_HEX_SIZE] = "";
+                if (lookup_file_root(filename, root) == 0) hash_to_hex(root, root_hex);
+                if (want_piece_size) {
+                    sprintf(response, "INFO %d %ld %s %d\n", num_pieces, file_size, root_hex[0] ? root_hex : "-", piece_size);
+                } else {
+                    sprintf(response, "INFO %d %ld%s%s\n", num_pieces, file_size, root_hex[0] ? " " : "", root_hex);
+                }
+                printf("[Info] Sent: %d pieces of %d bytes, %ld bytes\n", num_pieces, piece_size, file_size);
+            }
+            if (session_send(session, response, strlen(response)) != 0) break;
         }
         else if (strncmp(buffer, "REQUEST_PIECE", 13) == 0) {
             char filename[MAX_FILENAME];
             int piece_index;
             
-            if (sscanf(buffer, "REQUEST_PIECE %s %d", filename, &piece_index) == 2) {
-                printf("[Upload] Request for %s piece %d\n", filename, piece_index);
+            if (sscanf(buffer, "REQUEST_PIECE %99s %d", filename, &piece_index) != 2) {
+                if (send_error(session, "Bad request") != 0) break;
+                continue;
+            }
+            
+            printf("[Upload] Request for %s piece %d\n", filename, piece_index);
+            
+            int piece_size;
+            char pieces_dir[512];
+            sprintf(pieces_dir, "%s/pieces", base_dir);
+            
+            if (!piece_data) piece_data = (char*)malloc(MAX_PIECE_SIZE);
+            if (piece_data && read_piece(filename, pieces_dir, piece_index, piece_data, &piece_size) == 0) {
+                char response_header[256];
+                sprintf(response_header, "SEND_PIECE %d %d\n", piece_index, piece_size);
+                if (session_send(session, response_header, strlen(response_header)) != 0 ||
+                    session_send(session, piece_data, piece_size) != 0) {
+                    break;
+                }
+                __atomic_add_fetch(&bytes_uploaded, piece_size, __ATOMIC_RELAXED);
                 
-                char *piece_data = (char*)malloc(PIECE_SIZE);
-                int piece_size;
+                printf("[Upload] Sent piece %d (%d bytes)\n", piece_index, piece_size);
+            } else {
+                printf("[Upload] ✗ Piece not found\n");
+                if (send_error(session, "Piece not found") != 0) break;
+            }
+        }
+        else if (strncmp(buffer, "REQUEST_BLOCK", 13) == 0) {
+            char filename[MAX_FILENAME];
+            char flag[16] = "";
+            int piece_index, offset, length;
+            
+            if (sscanf(buffer, "REQUEST_BLOCK %99s %d %d %d %15s", filename, &piece_index, &offset, &length, flag) < 4 ||
+                offset < 0 || length <= 0 || length > BLOCK_SIZE) {
+                if (send_error(session, "Bad request") != 0) break;
+                continue;
+            }
+            int want_proof = (strcmp(flag, "PROOF") == 0);
+            
+            // The downloader got this block elsewhere meanwhile (endgame): skip it,
+            // but still answer so replies stay in request order
+            char cancel[256];
+            snprintf(cancel, sizeof(cancel), "CANCEL %s %d %d", filename, piece_index, offset);
+            if (session_take_line(session, cancel)) {
+                char response[64];
+                sprintf(response, "CANCELLED %d %d\n", piece_index, offset);
+                if (session_send(session, response, strlen(response)) != 0) break;
+                continue;
+            }
+            
+            unsigned char proof[MAX_PROOF_SIZE];
+            int proof_hashes = want_proof ? get_block_proof(proofs, filename, piece_index, offset, proof) : 0;
+            if (proof_hashes >= 0 && load_block(filename, piece_index, offset, length, block_data) == 0) {
+                char response_header[256];
+                if (want_proof) {
+                    sprintf(response_header, "SEND_BLOCK %d %d %d %d\n", piece_index, offset, length, proof_hashes);
+                } else {
+                    sprintf(response_header, "SEND_BLOCK %d %d %d\n", piece_index, offset, length);
+                }
+                if (session_send(session, response_header, strlen(response_header)) != 0 ||
+                    (proof_hashes > 0 && session_send(session, proof, proof_hashes * HASH_SIZE) != 0) ||
+                    session_send(session, block_data, length) != 0) {
+                    break;
+                }
+            } else {
+                if (send_error(session, "Block not found") != 0) break;
+            }
+        }
+        else if (strncmp(buffer, "BITFIELD", 8) == 0) {
+            char filename[MAX_FILENAME];
+            if (sscanf(buffer, "BITFIELD %99s", filename) != 1) {
+                if (send_error(session, "Bad request") != 0) break;
+                continue;
+            }
+            if (send_bitfield(session, filename) != 0) break;
+        }
+        else if (strncmp(buffer, "HAVE", 4) == 0) {
+            char filename[MAX_FILENAME];
+            int seq;
+            if (sscanf(buffer, "HAVE %99s %d", filename, &seq) != 2) {
+                if (send_error(session, "Bad request") != 0) break;
+                continue;
+            }
+            if (send_haves(session, filename, seq) != 0) break;
+        }
+        else if (strncmp(buffer, "MANIFEST", 8) == 0) {
+            char filename[MAX_FILENAME];
+            if (sscanf(buffer, "MANIFEST %99s", filename) != 1) {
+                if (send_error(session, "Bad request") != 0) break;
+                continue;
+            }
+            if (send_manifest(session, filename) != 0) break;
+        }
+        else if (strncmp(buffer, "CHUNKS", 6) == 0) {
+            char filename[MAX_FILENAME];
+            if (sscanf(buffer, "CHUNKS %99s", filename) != 1) {
+                if (send_error(session, "Bad request") != 0) break;
+                continue;
+            }
+            if (send_chunks(session, filename) != 0) break;
+        }
+        else if (strncmp(buffer, "CANCEL", 6) == 0) {
+            // The block was already sent (or skipped above): nothing to do, no reply
+        }
+        else {
+            if (send_error(session, "Unknown command") != 0) break;
+        }
+    }
+    
+    free(piece_data);
+}
+
+// Reply with a FRAME_ERROR for request id
+int send_frame_error(PeerSession *session, unsigned int id, char *message) {
+    return wire_send(session, FRAME_ERROR, id, NULL, 0, message, strlen(message));
+}
+
+// Binary frames (protocol v2, after HELLO)
+void serve_frames(PeerSession *session, char *block_data, ProofCache *proofs) {
+    if (wire_accept_hello(session) != 0) return;
+    
+    FrameHeader h;
+    unsigned char payload[12 + MAX_FILENAME];
+    
+    while (wire_read_header(session, &h) == 0) {
+        // Every request is a few fixed fields and maybe a filename
+        if (h.length > sizeof(payload)) {
+            if (wire_skip(session, h.length) != 0 ||
+                send_frame_error(session, h.id, "Bad request") != 0) break;
+            continue;
+        }
+        if (session_read_exact(session, payload, h.length) != 0) break;
+        
+        // Fixed fields come first, the filename is the rest
+        int fixed = (h.type == FRAME_REQUEST_BLOCK) ? 12 :
+                    (h.type == FRAME_HAVE || h.type == FRAME_CANCEL) ? 4 : 0;
+        if ((int)h.length < fixed) {
+            if (send_frame_error(session, h.id, "Bad request") != 0) break;
+            continue;
+        }
+        char filename[MAX_FILENAME];
+        int name_len = h.length - fixed;
+        if (name_len >= MAX_FILENAME) name_len = MAX_FILENAME - 1;
+        memcpy(filename, payload + fixed, name_len);
+        filename[name_len] = '\0';
+        
+        int result = 0;
+        
+        if (h.type == FRAME_FILE_INFO) {
+            printf("[Info] Request for file info: %s\n", filename);
+            
+            int piece_size = 0;
+            long file_size = lookup_file_size(filename, &piece_size);
+            if (file_size < 0) {
+                result = send_frame_error(session, h.id, "File not found");
+            } else if (!(session->caps & CAP_PIECE_SIZE) && piece_size != LEGACY_PIECE_SIZE) {
+                result = send_frame_error(session, h.id, "Piece size needs a newer peer");
+            } else {
+                int num_pieces = calculate_num_pieces(file_size, piece_size);
+                printf("[Info] Sent: %d pieces of %d bytes, %ld bytes\n", num_pieces, piece_size, file_size);
+                unsigned char info[12 + HASH_SIZE + 4];
+                put_u32(info, num_pieces);
+                put_u32(info + 4, (unsigned long long)file_size >> 32);
+                put_u32(info + 8, (unsigned long long)file_size & 0xFFFFFFFF);
                 
-                char pieces_dir[512];
-                sprintf(pieces_dir, "%s/pieces", base_dir);
+                // With CAP_MERKLE the content root follows (all zeros: we have none),
+                // then with CAP_PIECE_SIZE the piece size
+                int info_len = 12;
+                if (session->caps & CAP_MERKLE) {
+                    if (lookup_file_root(filename, info + 12) != 0) memset(info + 12, 0, HASH_SIZE);
+                    info_len += HASH_SIZE;
+                }
+                if (session->caps & CAP_PIECE_SIZE) {
+                    put_u32(info + info_len, piece_size);
+                    info_len += 4;
+                }
+                result = wire_send(session, FRAME_INFO, h.id, info, info_len, NULL, 0);
+            }
+        }
+        else if (h.type == FRAME_REQUEST_BLOCK) {
+            int piece_index = get_u32(payload);
+            int offset = get_u32(payload + 4);
+            int length = get_u32(payload + 8);
+            
+            if (wire_take_cancel(session, h.id)) {
+                // Got it from another peer meanwhile (endgame)
+                result = wire_send(session, FRAME_CANCELLED, h.id, NULL, 0, NULL, 0);
+            } else if (piece_index < 0 || offset < 0 || length <= 0 || length > BLOCK_SIZE) {
+                result = send_frame_error(session, h.id, "Bad request");
+            } else {
+                // With CAP_MERKLE the block's proof goes between its position and the data
+                unsigned char head[12 + MAX_PROOF_SIZE];
+                int head_len = 8;
+                int found = 1;
+                put_u32(head, piece_index);
+                put_u32(head + 4, offset);
+                if (session->caps & CAP_MERKLE) {
+                    int proof_hashes = get_block_proof(proofs, filename, piece_index, offset, head + 12);
+                    found = (proof_hashes >= 0);
+                    put_u32(head + 8, proof_hashes);
+                    head_len += 4 + (found ? proof_hashes * HASH_SIZE : 0);
+                }
                 
-                if (read_piece(filename, pieces_dir, piece_index, piece_data, &piece_size) == 0) {
-                    char response_header[256];
-                    sprintf(response_header, "SEND_PIECE %d %d\n", piece_index, piece_size);
-                    send(client_fd, response_header, strlen(response_header), 0);
-                    send(client_fd, piece_data, piece_size, 0);
-                    
-                    printf("[Upload] Sent piece %d (%d bytes)\n", piece_index, piece_size);
+                if (found && load_block(filename, piece_index, offset, length, block_data) == 0) {
+                    // With CAP_COMPRESS a block that shrinks goes out as ZBLOCK
+                    unsigned char packed[BLOCK_SIZE];
+                    int packed_len = (session->caps & CAP_COMPRESS) ? compress_block(block_data, length, packed) : 0;
+                    if (packed_len > 0) {
+                        result = wire_send(session, FRAME_ZBLOCK, h.id, head, head_len, packed, packed_len);
+                    } else {
+                        result = wire_send(session, FRAME_BLOCK, h.id, head, head_len, block_data, length);
+                    }
                 } else {
-                    printf("[Upload] ✗ Piece not found\n");
+                    result = send_frame_error(session, h.id, "Block not found");
                 }
-                
-                free(piece_data);
             }
         }
+        else if (h.type == FRAME_BITFIELD) {
+            int num_pieces = 0, seq = 0;
+            unsigned char *bits = collect_bitfield(filename, &num_pieces, &seq);
+            if (!bits) {
+                result = send_frame_error(session, h.id, "File not found");
+            } else {
+                unsigned char counts[8];
+                put_u32(counts, num_pieces);
+                put_u32(counts + 4, seq);
+                result = wire_send(session, FRAME_BITFIELD, h.id, counts, 8, bits, (num_pieces + 7) / 8);
+                free(bits);
+            }
+        }
+        else if (h.type == FRAME_HAVE) {
+            uint32_t raw[MAX_HAVES_PER_REPLY];
+            int new_seq = 0;
+            int count = collect_haves(filename, get_u32(payload), raw, &new_seq);
+            if (count < 0) {
+                result = send_frame_error(session, h.id, "File not found");
+            } else {
+                unsigned char counts[8];
+                put_u32(counts, new_seq);
+                put_u32(counts + 4, count);
+                result = wire_send(session, FRAME_HAVE, h.id, counts, 8, raw, count * 4);
+            }
+        }
+        else if (h.type == FRAME_MANIFEST) {
+            int num_pieces = 0;
+            unsigned char *hashes = collect_manifest(filename, &num_pieces);
+            if (!hashes) {
+                result = send_frame_error(session, h.id, "No piece hashes");
+            } else {
+                unsigned char count[4];
+                put_u32(count, num_pieces);
+                result = wire_send(session, FRAME_MANIFEST, h.id, count, 4, hashes, num_pieces * HASH_SIZE);
+                free(hashes);
+            }
+        }
+        else if (h.type == FRAME_CHUNKS) {
+            int chunk_count = 0;
+            unsigned char *entries = collect_chunks(filename, &chunk_count);
+            if (!entries) {
+                result = send_frame_error(session, h.id, "No chunk list");
+            } else {
+                unsigned char count[4];
+                put_u32(count, chunk_count);
+                result = wire_send(session, FRAME_CHUNKS, h.id, count, 4, entries, chunk_count * CHUNK_ENTRY_SIZE);
+                free(entries);
+            }
+        }
+        else if (h.type == FRAME_CANCEL) {
+            // The block was already sent (or skipped above): nothing to do, no reply
+        }
+        else {
+            result = send_frame_error(session, h.id, "Unknown command");
+        }
+        
+        if (result != 0) break;
+    }
+}
+
+// Handle peer upload
+// Serves commands until the downloader hangs up or goes quiet for PEER_IDLE_TIMEOUT
+// A connection that starts with a frame speaks protocol v2, anything else is text
+void* handle_peer_upload(void *arg) {
+    int client_fd = *(int*)arg;
+    free(arg);
+    
+    // Don't let a downloader that went away keep this thread forever
+    struct timeval idle_timeout = { PEER_IDLE_TIMEOUT, 0 };
+    setsockopt(client_fd, SOL_SOCKET, SO_RCVTIMEO, &idle_timeout, sizeof(idle_timeout));
+    
+    PeerSession *session = session_attach(client_fd);
+    if (!session) {
+        close(client_fd);
+        return NULL;
+    }
+    
+    __atomic_add_fetch(&active_uploads, 1, __ATOMIC_RELAXED);
+    
+    // Uploads go one block at a time (proofs come from stored leaves)
+    char block_data[BLOCK_SIZE];
+    ProofCache *proofs = (ProofCache*)calloc(1, sizeof(ProofCache));
+    if (proofs) {
+        for (int i = 0; i < PROOF_CACHE_PIECES; i++) proofs->pieces[i].piece_index = -1;
+        if (session_peek_byte(session) == FRAME_MAGIC) {
+            serve_frames(session, block_data, proofs);
+        } else {
+            serve_text_commands(session, block_data, proofs);
+        }
     }
     
-    close(client_fd);
+    free(proofs);
+    __atomic_sub_fetch(&active_uploads, 1, __ATOMIC_RELAXED);
+    session_close(session);
     return NULL;
 }
 
@@ -471,7 +1625,7 @@ void list_shared_files() {
         sprintf(filepath, "%s/%s", shared_dir, entry->d_name);
         
         long size = get_file_size(filepath);
-        int pieces = calculate_num_pieces(size);
+        int pieces = calculate_num_pieces(size, choose_piece_size(size));
         
         printf("%d. %s (%.2f MB, %d pieces)\n", count, entry->d_name, 
                size / (1024.0 * 1024.0), pieces);
@@ -520,12 +1674,44 @@ void add_file_to_share() {
     
     printf("✓ File copied to shared directory\n");
     
+    // Pieces and the hashes of every piece, so downloaders can check what
+    // they get (the file may have changed since we last shared it: cut and
+    // hash it again)
+    char manifest_path[512];
+    char leaves_path[512];
+    char chunks_path[512];
+    get_manifest_path(manifest_path, filename);
+    get_leaves_path(leaves_path, filename);
+    get_chunks_path(chunks_path, filename);
+    unlink(manifest_path);
+    unlink(leaves_path);
+    unlink(chunks_path);
+    
     printf("\nSplitting file into pieces...\n");
     
-    char pieces_dir[512];
-    sprintf(pieces_dir, "%s/pieces", base_dir);
+    int num_pieces = -1;
+    unsigned char *hashes = NULL;
+    if (ensure_manifest(filename, 1, NULL) == 0) {
+        long file_size = get_file_size(dest_path);
+        num_pieces = calculate_num_pieces(file_size, choose_piece_size(file_size));
+        printf("✓ Piece hashes saved\n");
+        if (num_pieces > 0) hashes = load_manifest(manifest_path, dest_path, choose_piece_size(file_size));
+    }
     
-    int num_pieces = split_file(dest_path, pieces_dir);
+    // Pieces we already keep for another file are stored once
+    if (hashes) {
+        int shared = store_shared_pieces(filename, hashes, num_pieces, 0);
+        if (shared > 0) {
+            printf("✓ %d/%d pieces were already in the piece store (%.2f MB saved)\n",
+                   shared, num_pieces, shared * (choose_piece_size(get_file_size(dest_path)) / (1024.0 * 1024.0)));
+        }
+        free(hashes);
+        
+        // Pieces the old version of this file had, and nobody else uses
+        char store_dir[512];
+        get_store_dir(store_dir);
+        store_collect_garbage(store_dir);
+    }
     
     if (num_pieces > 0) {
         printf("\n✓ File ready to share: %s (%d pieces)\n", filename, num_pieces);
@@ -557,11 +1743,15 @@ void register_file() {
         return;
     }
     
-    sprintf(message, "REGISTER %s %d\n", filename, my_port);
+    // Files in shared/ are complete: report 100%, and what the content is
+    char root[HASH_HEX_SIZE] = "";
+    if (ensure_manifest(filename, 1, root) != 0) root[0] = '\0';
+    sprintf(message, "REGISTER %s %d 100 %s\n", filename, my_port, root);
     
     printf("Registering with tracker...\n");
-    if (connect_to_tracker(message, response) == 0) {
+    if (tracker_request(message, response, sizeof(response)) == 0) {
         if (strncmp(response, "OK", 2) == 0) {
+            remember_registration(filename, root);
             printf("✓ File '%s' registered successfully!\n", filename);
         } else {
             printf("✗ Registration failed: %s\n", response);
@@ -572,28 +1762,168 @@ void register_file() {
     getchar();
 }
 
-// Query file
+// Register every file in shared/ with the tracker in a few REGISTER_BATCH round trips
+// Returns number of files announced, -1 if the tracker could not be reached
+int register_all_shared(int verbose) {
+    char shared_dir[512];
+    sprintf(shared_dir, "%s/shared", base_dir);
+    
+    DIR *dir = opendir(shared_dir);
+    if (!dir) {
+        if (verbose) printf("✗ Cannot open shared directory\n");
+        return 0;
+    }
+    
+    char (*names)[MAX_FILENAME] = NULL;
+    int count = 0, cap = 0;
+    struct dirent *entry;
+    
+    while ((entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] == '.') continue;
+        if (strstr(entry->d_name, ".piece") != NULL) continue;
+        if (strlen(entry->d_name) >= MAX_FILENAME) continue;
+        
+        if (count == cap) {
+            cap = cap ? cap * 2 : 64;
+            char (*grown)[MAX_FILENAME] = realloc(names, cap * sizeof(*names));
+            if (!grown) break;
+            names = grown;
+        }
+        strcpy(names[count++], entry->d_name);
+    }
+    closedir(dir);
+    
+    if (count == 0) {
+        if (verbose) printf("(No files in shared directory)\n");
+        free(names);
+        return 0;
+    }
+    
+    // Files shared before we kept piece hashes get them now, and every file
+    // is registered with its content root
+    char (*roots)[HASH_HEX_SIZE] = malloc(count * sizeof(*roots));
+    if (!roots) {
+        free(names);
+        return -1;
+    }
+    for (int i = 0; i < count; i++) {
+        if (ensure_manifest(names[i], verbose, roots[i]) != 0) roots[i][0] = '\0';
+    }
+    
+    // Pieces shared before the piece store existed join it (once: after that
+    // they are links, and skipped)
+    for (int i = 0; i < count; i++) {
+        int num_pieces = 0;
+        unsigned char *hashes = roots[i][0] ? collect_manifest(names[i], &num_pieces) : NULL;
+        if (hashes) {
+            store_shared_pieces(names[i], hashes, num_pieces, 1);
+            free(hashes);
+        }
+    }
+    
+    int added = tracker_register_batch(names, roots, count, my_port);
+    if (added < 0) {
+        if (verbose) printf("✗ Cannot contact tracker\n");
+        free(names);
+        free(roots);
+        return -1;
+    }
+    
+    for (int i = 0; i < count; i++) {
+        remember_registration(names[i], roots[i]);
+    }
+    free(names);
+    free(roots);
+    
+    if (verbose) {
+        printf("✓ Announced %d shared file(s) (%d new to tracker)\n", count, added);
+    }
+    return count;
+}
+
+// Register all shared files (menu)
+void register_all_files() {
+    printf("\n--- Register All Shared Files ---\n");
+    printf("Registering with tracker...\n");
+    register_all_shared(1);
+    
+    printf("\nPress Enter to continue...");
+    getchar();
+}
+
+// Show every peer of one file, paging through the whole swarm
+void show_all_peers(char *filename) {
+    char ips[COMPACT_MAX_PEERS][16];
+    int ports[COMPACT_MAX_PEERS];
+    int total = 0;
+    unsigned long long cursor = 0;
+    
+    int shown = 0;
+    do {
+        int count = tracker_query_peers(filename, COMPACT_MAX_PEERS, &cursor, 0, ips, ports, &total);
+        if (count < 0) break;
+        
+        if (count == 0) {
+            if (shown == 0) printf("✗ File not found\n");
+            break;
+        }
+        
+        if (shown == 0) {
+            printf("\n✓ Found peers:\n");
+            printf("-------------------\n");
+            printf("PEERS %d\n", total);
+        }
+        for (int i = 0; i < count; i++) {
+            printf("%s:%d\n", ips[i], ports[i]);
+        }
+        shown += count;
+    } while (cursor != 0 && shown < total);  // A busy swarm can restart the walk: stop after one swarm's worth
+    
+    if (shown > 0) {
+        printf("-------------------\n");
+    }
+}
+
+// Query file(s)
+// One name lists every peer; several names are looked up together with QUERY_BATCH
 void query_file() {
-    char filename[MAX_FILENAME];
-    char message[1024];
-    char response[1024];
+    char line[1024];
+    char names[32][MAX_FILENAME];
+    int count = 0;
     
     printf("\n--- Query File ---\n");
-    printf("Enter filename to search: ");
-    scanf("%s", filename);
-    getchar();
+    printf("Enter filename(s) to search: ");
+    if (!fgets(line, sizeof(line), stdin)) return;
     
-    sprintf(message, "QUERY %s\n", filename);
+    char *token = strtok(line, " \t\n");
+    while (token && count < 32) {
+        strncpy(names[count], token, MAX_FILENAME - 1);
+        names[count][MAX_FILENAME - 1] = '\0';
+        count++;
+        token = strtok(NULL, " \t\n");
+    }
     
     printf("Searching...\n");
-    if (connect_to_tracker(message, response) == 0) {
-        if (strncmp(response, "PEERS", 5) == 0) {
-            printf("\n✓ Found peers:\n");
-            printf("-------------------\n");
-            printf("%s", response);
-            printf("-------------------\n");
-        } else if (strncmp(response, "ERROR", 5) == 0) {
-            printf("✗ File not found\n");
+    
+    if (count == 1) {
+        show_all_peers(names[0]);
+    } else if (count > 1) {
+        char ips[32 * MAX_PEERS][16];
+        int ports[32 * MAX_PEERS];
+        int found[32];
+        
+        if (tracker_query_batch(names, count, MAX_PEERS, ips, ports, found) == 0) {
+            for (int i = 0; i < count; i++) {
+                printf("\n%s: ", names[i]);
+                if (found[i] == 0) {
+                    printf("✗ File not found\n");
+                    continue;
+                }
+                printf("%d peer(s)\n", found[i]);
+                for (int j = 0; j < found[i]; j++) {
+                    printf("  %s:%d\n", ips[i * MAX_PEERS + j], ports[i * MAX_PEERS + j]);
+                }
+            }
         }
     }
     
@@ -671,22 +2001,28 @@ void show_menu() {
     printf("3. Register file with tracker\n");
     printf("4. Query for a file\n");
     printf("5. Download a file (Multi-Source + Stats)\n");
-    printf("6. Exit\n");
+    printf("6. Register all shared files\n");
+    printf("7. Exit\n");
     printf("\nEnter choice: ");
 }
 
 int main(int argc, char *argv[]) {
     pthread_t listener_tid;
+    pthread_t announce_tid;
     int choice;
     
-    if (argc != 3) {
-        printf("Usage: %s <my_port> <tracker_ip>\n", argv[0]);
+    if (argc == 4 && strcmp(argv[3], "--cdc") == 0) {
+        cdc_mode = 1;
+    } else if (argc != 3) {
+        printf("Usage: %s <my_port> <tracker_ip> [--cdc]\n", argv[0]);
         printf("Example: %s 9000 192.168.1.100\n", argv[0]);
+        printf("--cdc: keep content-defined chunk lists, and build new versions of files from old ones\n");
         exit(1);
     }
     
     my_port = atoi(argv[1]);
     strcpy(tracker_ip, argv[2]);
+    tracker_client_init(tracker_ip);
     
     // Auto-detect my real IP
     if (get_my_ip(my_ip) != 0) {
@@ -695,8 +2031,8 @@ int main(int argc, char *argv[]) {
     
     // Create directory structure
     char mkdir_cmd[2048];
-    sprintf(mkdir_cmd, "mkdir -p %s/shared %s/pieces %s/downloads %s/temp_download", 
-            base_dir, base_dir, base_dir, base_dir);
+    sprintf(mkdir_cmd, "mkdir -p %s/shared %s/pieces %s/store %s/downloads %s/temp_download", 
+            base_dir, base_dir, base_dir, base_dir, base_dir);
     system(mkdir_cmd);
     
     printf("========================================\n");
@@ -705,6 +2041,10 @@ int main(int argc, char *argv[]) {
     printf("My IP: %s\n", my_ip);
     printf("My Port: %d\n", my_port);
     printf("Tracker: %s:%d\n", tracker_ip, TRACKER_PORT);
+    if (cdc_mode) {
+        printf("Chunking: content-defined (min %d KB, avg %d KB, max %d KB)\n",
+               CDC_MIN_SIZE / 1024, CDC_AVG_SIZE / 1024, CDC_MAX_SIZE / 1024);
+    }
     printf("========================================\n\n");
     
     printf("Starting listener thread...\n");
@@ -713,6 +2053,25 @@ int main(int argc, char *argv[]) {
         exit(1);
     }
     
+    // Announce everything we already share in a handful of round trips
+    int announced = register_all_shared(0);
+    if (announced > 0) {
+        printf("✓ Announced %d shared file(s) to tracker\n", announced);
+    }
+    
+    // Stored pieces whose files are gone
+    char store_dir[512];
+    get_store_dir(store_dir);
+    int freed = store_collect_garbage(store_dir);
+    if (freed > 0) {
+        printf("✓ Freed %d unused piece(s) from the piece store\n", freed);
+    }
+    
+    if (pthread_create(&announce_tid, NULL, announce_thread, NULL) != 0) {
+        printf("✗ Failed to create announce thread\n");
+        exit(1);
+    }
+    
     sleep(1);
     
     while (1) {
@@ -741,6 +2100,9 @@ int main(int argc, char *argv[]) {
                 download_file();
                 break;
             case 6:
+                register_all_files();
+                break;
+            case 7:
                 printf("\n✓ Exiting...\n");
                 exit(0);
             default:
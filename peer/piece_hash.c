@@ -0,0 +1,400 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <openssl/sha.h>
+#include "piece_hash.h"
+#include "../file_ops.h"
+
+// Work shared by the threads of hash_file_pieces()
+typedef struct {
+    int fd;
+    long file_size;
+    int piece_size;
+    int num_pieces;
+    unsigned char *hashes;
+    unsigned char *leaves;  // NULL, or merkle_leaf_count(piece_size) leaves per piece
+    const char *wanted;
+    int next_piece;       // Next piece nobody took yet (atomic)
+    int failed;
+} HashJob;
+
+int hash_thread_count() {
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cores < 1) return 1;
+    return (cores > MAX_HASH_THREADS) ? MAX_HASH_THREADS : (int)cores;
+}
+
+// A tree node: SHA-256 of its two children side by side
+static void hash_pair(const unsigned char *left, const unsigned char *right, unsigned char *out) {
+    unsigned char both[2 * HASH_SIZE];
+    memcpy(both, left, HASH_SIZE);
+    memcpy(both + HASH_SIZE, right, HASH_SIZE);
+    SHA256(both, sizeof(both), out);
+}
+
+// Fold `count` nodes (a power of two) level by level, in place, down to
+// the root in nodes[0]
+static void merkle_reduce(unsigned char *nodes, int count) {
+    for (; count > 1; count /= 2) {
+        for (int i = 0; i < count / 2; i++) {
+            hash_pair(nodes + (size_t)2 * i * HASH_SIZE, nodes + (size_t)(2 * i + 1) * HASH_SIZE,
+                      nodes + (size_t)i * HASH_SIZE);
+        }
+    }
+}
+
+int merkle_leaf_count(int piece_size) {
+    int blocks = (piece_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    int leaves = 1;
+    while (leaves < blocks) leaves *= 2;
+    return leaves;
+}
+
+int merkle_proof_hashes(int piece_size) {
+    int levels = 0;
+    for (int leaves = merkle_leaf_count(piece_size); leaves > 1; leaves /= 2) levels++;
+    return levels;
+}
+
+void hash_piece_leaves(const char *data, int length, int piece_size, unsigned char *leaves) {
+    int count = merkle_leaf_count(piece_size);
+    memset(leaves, 0, (size_t)count * HASH_SIZE);
+    for (int b = 0; b < count && (long)b * BLOCK_SIZE < length; b++) {
+        int size = (length - b * BLOCK_SIZE < BLOCK_SIZE) ? length - b * BLOCK_SIZE : BLOCK_SIZE;
+        SHA256((const unsigned char*)data + (size_t)b * BLOCK_SIZE, size, leaves + (size_t)b * HASH_SIZE);
+    }
+}
+
+void hash_leaf(const char *data, int length, unsigned char *leaf) {
+    SHA256((const unsigned char*)data, length, leaf);
+}
+
+// Piece hash from a piece's leaves (left as they are)
+static void hash_leaves(const unsigned char *leaves, int piece_size, unsigned char *out) {
+    unsigned char nodes[MAX_MERKLE_LEAVES * HASH_SIZE];
+    int count = merkle_leaf_count(piece_size);
+    memcpy(nodes, leaves, (size_t)count * HASH_SIZE);
+    merkle_reduce(nodes, count);
+    memcpy(out, nodes, HASH_SIZE);
+}
+
+void hash_piece(const char *data, int length, int piece_size, unsigned char *out) {
+    unsigned char leaves[MAX_MERKLE_LEAVES * HASH_SIZE];
+    hash_piece_leaves(data, length, piece_size, leaves);
+    hash_leaves(leaves, piece_size, out);
+}
+
+void merkle_proof(const unsigned char *leaves, int piece_size, int block, unsigned char *proof) {
+    unsigned char nodes[MAX_MERKLE_LEAVES * HASH_SIZE];
+    int count = merkle_leaf_count(piece_size);
+    memcpy(nodes, leaves, (size_t)count * HASH_SIZE);
+
+    // At every level the proof takes our node's sibling, then the level is folded
+    int levels = merkle_proof_hashes(piece_size);
+    for (int level = 0; level < levels; level++) {
+        memcpy(proof + level * HASH_SIZE, nodes + (block ^ 1) * HASH_SIZE, HASH_SIZE);
+        for (int i = 0; i < count / 2; i++) {
+            hash_pair(nodes + 2 * i * HASH_SIZE, nodes + (2 * i + 1) * HASH_SIZE, nodes + i * HASH_SIZE);
+        }
+        count /= 2;
+        block /= 2;
+    }
+}
+
+int verify_block(const unsigned char *piece_hash, int piece_size, int block, const char *data, int length,
+                 const unsigned char *proof) {
+    if (block < 0 || block >= merkle_leaf_count(piece_size)) return 0;
+
+    unsigned char node[HASH_SIZE];
+    SHA256((const unsigned char*)data, length, node);
+
+    // Climb to the top: the sibling goes left of us when we are a right child
+    int levels = merkle_proof_hashes(piece_size);
+    for (int level = 0; level < levels; level++) {
+        const unsigned char *sibling = proof + level * HASH_SIZE;
+        if (block & 1) {
+            hash_pair(sibling, node, node);
+        } else {
+            hash_pair(node, sibling, node);
+        }
+        block /= 2;
+    }
+    return memcmp(node, piece_hash, HASH_SIZE) == 0;
+}
+
+void merkle_root(const unsigned char *piece_hashes, int num_pieces, unsigned char *root) {
+    int width = 1;
+    while (width < num_pieces) width *= 2;
+
+    unsigned char *nodes = (unsigned char*)calloc(width, HASH_SIZE);
+    if (!nodes) {
+        memset(root, 0, HASH_SIZE);  // Matches no real root: nothing gets trusted
+        return;
+    }
+    memcpy(nodes, piece_hashes, (size_t)num_pieces * HASH_SIZE);
+    merkle_reduce(nodes, width);
+    memcpy(root, nodes, HASH_SIZE);
+    free(nodes);
+}
+
+void hash_to_hex(const unsigned char *hash, char *hex) {
+    for (int i = 0; i < HASH_SIZE; i++) {
+        sprintf(hex + 2 * i, "%02x", hash[i]);
+    }
+}
+
+int hex_to_hash(const char *hex, unsigned char *hash) {
+    if (strlen(hex) != 2 * HASH_SIZE) return -1;
+    for (int i = 0; i < HASH_SIZE; i++) {
+        unsigned int byte;
+        if (!isxdigit((unsigned char)hex[2 * i]) || !isxdigit((unsigned char)hex[2 * i + 1]) ||
+            sscanf(hex + 2 * i, "%2x", &byte) != 1) {
+            return -1;
+        }
+        hash[i] = byte;
+    }
+    return 0;
+}
+
+int piece_hash_matches(const unsigned char *expected, const char *data, int length, int piece_size) {
+    unsigned char actual[HASH_SIZE];
+    hash_piece(data, length, piece_size, actual);
+    return memcmp(expected, actual, HASH_SIZE) == 0;
+}
+
+// Read a whole piece with pread() (threads share the fd, nobody moves its offset)
+static int read_piece_at(int fd, long file_size, int piece_size, int piece_index, char *buffer, int *length) {
+    long start = (long)piece_index * piece_size;
+    int size = (file_size - start < piece_size) ? (int)(file_size - start) : piece_size;
+    int done = 0;
+
+    while (done < size) {
+        ssize_t n = pread(fd, buffer + done, size - done, start + done);
+        if (n <= 0) return -1;
+        done += n;
+    }
+    *length = size;
+    return 0;
+}
+
+// Each thread takes the next piece until there are none left
+static void* hash_worker(void *arg) {
+    HashJob *job = (HashJob*)arg;
+    char *buffer = (char*)malloc(job->piece_size);
+    if (!buffer) {
+        __atomic_store_n(&job->failed, 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+
+    while (!__atomic_load_n(&job->failed, __ATOMIC_RELAXED)) {
+        int piece = __atomic_fetch_add(&job->next_piece, 1, __ATOMIC_RELAXED);
+        if (piece >= job->num_pieces) break;
+        if (job->wanted && !job->wanted[piece]) continue;
+
+        int length;
+        if (read_piece_at(job->fd, job->file_size, job->piece_size, piece, buffer, &length) != 0) {
+            __atomic_store_n(&job->failed, 1, __ATOMIC_RELAXED);
+            break;
+        }
+        unsigned char *hash = job->hashes + (size_t)piece * HASH_SIZE;
+        if (job->leaves) {
+            // Keep the leaves too: they go to the leaves file
+            unsigned char *leaves = job->leaves + (size_t)piece * merkle_leaf_count(job->piece_size) * HASH_SIZE;
+            hash_piece_leaves(buffer, length, job->piece_size, leaves);
+            hash_leaves(leaves, job->piece_size, hash);
+        } else {
+            hash_piece(buffer, length, job->piece_size, hash);
+        }
+    }
+
+    free(buffer);
+    return NULL;
+}
+
+// hash_file_pieces(), keeping every piece's leaves as well if leaves isn't NULL
+static int hash_pieces_and_leaves(int fd, long file_size, int piece_size, unsigned char *hashes,
+                                  unsigned char *leaves, const char *wanted) {
+    HashJob job = { fd, file_size, piece_size, calculate_num_pieces(file_size, piece_size), hashes, leaves, wanted, 0, 0 };
+
+    // Small files aren't worth the threads
+    int thread_count = hash_thread_count();
+    if (thread_count > job.num_pieces) thread_count = job.num_pieces;
+
+    pthread_t threads[MAX_HASH_THREADS];
+    int started = 0;
+    for (int i = 1; i < thread_count; i++) {
+        if (pthread_create(&threads[started], NULL, hash_worker, &job) != 0) break;
+        started++;
+    }
+
+    hash_worker(&job);  // This thread helps too
+
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    return job.failed ? -1 : 0;
+}
+
+int hash_file_pieces(int fd, long file_size, int piece_size, unsigned char *hashes, const char *wanted) {
+    return hash_pieces_and_leaves(fd, file_size, piece_size, hashes, NULL, wanted);
+}
+
+// Write a header and its data under a temporary name, then rename: whoever
+// reads the file sees the old one or the whole new one, never half of it
+static int write_hash_file(char *path, ManifestHeader *header, const unsigned char *data, size_t size) {
+    char temp_path[600];
+    snprintf(temp_path, sizeof(temp_path), "%s.tmp%lu", path, (unsigned long)pthread_self());
+
+    FILE *fp = fopen(temp_path, "wb");
+    if (!fp) return -1;
+
+    int written = (fwrite(header, sizeof(*header), 1, fp) == 1 && fwrite(data, 1, size, fp) == size);
+    written = (fclose(fp) == 0) && written;
+
+    if (!written || rename(temp_path, path) != 0) {
+        unlink(temp_path);
+        return -1;
+    }
+    return 0;
+}
+
+int get_file_stamp(char *filepath, long *file_size, FileStamp *stamp) {
+    struct stat st;
+    if (stat(filepath, &st) != 0) return -1;
+
+    *file_size = st.st_size;
+    memset(stamp, 0, sizeof(*stamp));
+    stamp->inode = (long long)st.st_ino;
+    stamp->mtime_sec = (long long)st.st_mtim.tv_sec;
+    stamp->mtime_nsec = (long long)st.st_mtim.tv_nsec;
+    return 0;
+}
+
+// Header a manifest or leaves file of the file at filepath must have right now
+// Returns 0, or -1 if the file is gone
+static int expected_header(char *filepath, int piece_size, unsigned int magic, unsigned int version,
+                           ManifestHeader *header) {
+    long file_size;
+    memset(header, 0, sizeof(*header));
+    if (get_file_stamp(filepath, &file_size, &header->stamp) != 0) return -1;
+
+    header->magic = magic;
+    header->version = version;
+    header->piece_size = piece_size;
+    header->num_pieces = calculate_num_pieces(file_size, piece_size);
+    header->file_size = file_size;
+    return 0;
+}
+
+int create_manifest(char *filepath, char *manifest_path, char *leaves_path) {
+    // Stamped before hashing: if the file changes while we read it, its
+    // mtime moves on and the manifest is out of date right away
+    long file_size;
+    FileStamp stamp;
+    if (get_file_stamp(filepath, &file_size, &stamp) != 0) return -1;
+
+    int fd = open(filepath, O_RDONLY);
+    if (fd < 0) return -1;
+
+    int piece_size = choose_piece_size(file_size);
+    int num_pieces = calculate_num_pieces(file_size, piece_size);
+    size_t leaves_size = (size_t)num_pieces * merkle_leaf_count(piece_size) * HASH_SIZE;
+    unsigned char *hashes = (unsigned char*)malloc((size_t)num_pieces * HASH_SIZE + 1);
+    unsigned char *leaves = leaves_path ? (unsigned char*)malloc(leaves_size + 1) : NULL;
+    if (!hashes || (leaves_path && !leaves)) {
+        free(hashes);
+        free(leaves);
+        close(fd);
+        return -1;
+    }
+
+    int result = hash_pieces_and_leaves(fd, file_size, piece_size, hashes, leaves, NULL);
+    close(fd);
+
+    // The leaves first: a manifest is only ever newer than its leaves file
+    if (result == 0 && leaves_path) {
+        ManifestHeader header = { LEAVES_MAGIC, LEAVES_VERSION, piece_size, num_pieces, file_size, stamp };
+        result = write_hash_file(leaves_path, &header, leaves, leaves_size);
+    }
+    if (result == 0) {
+        ManifestHeader header = { MANIFEST_MAGIC, MANIFEST_VERSION, piece_size, num_pieces, file_size, stamp };
+        result = write_hash_file(manifest_path, &header, hashes, (size_t)num_pieces * HASH_SIZE);
+    }
+    free(hashes);
+    free(leaves);
+    return (result == 0) ? num_pieces : -1;
+}
+
+unsigned char* load_manifest(char *manifest_path, char *filepath, int piece_size) {
+    ManifestHeader expected;
+    if (expected_header(filepath, piece_size, MANIFEST_MAGIC, MANIFEST_VERSION, &expected) != 0) return NULL;
+
+    FILE *fp = fopen(manifest_path, "rb");
+    if (!fp) return NULL;
+
+    ManifestHeader header;
+    int num_pieces = expected.num_pieces;
+    if (fread(&header, sizeof(header), 1, fp) != 1 || memcmp(&header, &expected, sizeof(header)) != 0) {
+        fclose(fp);
+        return NULL;  // Missing, damaged, or made for an older version of the file (or other pieces)
+    }
+
+    unsigned char *hashes = (unsigned char*)malloc((size_t)num_pieces * HASH_SIZE + 1);
+    if (hashes && fread(hashes, HASH_SIZE, num_pieces, fp) != (size_t)num_pieces) {
+        free(hashes);
+        hashes = NULL;
+    }
+    fclose(fp);
+    return hashes;
+}
+
+// Open a leaves file, only if it belongs to the file at filepath as it is
+// now, cut into pieces of piece_size bytes, and holds all of their leaves
+// Returns the fd (and the number of pieces), or -1
+static int open_leaves_file(char *leaves_path, char *filepath, int piece_size, int *num_pieces) {
+    ManifestHeader expected;
+    if (expected_header(filepath, piece_size, LEAVES_MAGIC, LEAVES_VERSION, &expected) != 0) return -1;
+
+    int fd = open(leaves_path, O_RDONLY);
+    if (fd < 0) return -1;
+
+    ManifestHeader header;
+    off_t size = sizeof(header) + (off_t)expected.num_pieces * merkle_leaf_count(piece_size) * HASH_SIZE;
+    if (pread(fd, &header, sizeof(header), 0) != sizeof(header) ||
+        memcmp(&header, &expected, sizeof(header)) != 0 || lseek(fd, 0, SEEK_END) != size) {
+        close(fd);
+        return -1;
+    }
+    *num_pieces = expected.num_pieces;
+    return fd;
+}
+
+int leaves_file_matches(char *leaves_path, char *filepath, int piece_size) {
+    int num_pieces;
+    int fd = open_leaves_file(leaves_path, filepath, piece_size, &num_pieces);
+    if (fd < 0) return 0;
+    close(fd);
+    return 1;
+}
+
+int load_piece_leaves(char *leaves_path, char *filepath, int piece_size, int piece_index,
+                      unsigned char *leaves) {
+    int num_pieces;
+    int fd = open_leaves_file(leaves_path, filepath, piece_size, &num_pieces);
+    if (fd < 0) return -1;
+    if (piece_index < 0 || piece_index >= num_pieces) {
+        close(fd);
+        return -1;
+    }
+
+    size_t size = (size_t)merkle_leaf_count(piece_size) * HASH_SIZE;
+    off_t offset = sizeof(ManifestHeader) + (off_t)piece_index * size;
+    ssize_t n = pread(fd, leaves, size, offset);
+    close(fd);
+    return (n == (ssize_t)size) ? 0 : -1;
+}
@@ -0,0 +1,126 @@
+#ifndef PIECE_HASH_H
+#define PIECE_HASH_H
+
+#include "../common/protocol.h"
+
+// Piece hashes: a SHA-256 Merkle tree over every file, so a downloader can
+// tell good data from corrupt data before it writes it to disk
+//
+//   leaves      SHA-256 of each BLOCK_SIZE block of a piece, padded with
+//               zero hashes to merkle_leaf_count(piece size)
+//   piece hash  Merkle root over the leaves of one piece
+//   root        Merkle root over the piece hashes (padded the same way):
+//               names the content, the tracker keeps it for every file
+//   node        SHA-256(left child || right child)
+//
+// The peer that shares a file hashes it once and keeps the piece hashes in
+// a manifest file (pieces/<file>.manifest), and the leaves of every piece in
+// a leaves file (pieces/<file>.leaves, 32 bytes per block) to prove the
+// blocks it uploads without reading whole pieces. Downloaders ask for them with
+// MANIFEST and check them against the root from the tracker. Each block
+// then arrives with its proof (the sibling hashes up to its piece hash), so
+// it is checked on its own and a peer that sends bad data is caught at once.
+// SHA-256 comes from OpenSSL, which picks the fastest code for the CPU
+// (SHA extensions / AVX2); big jobs are spread over every core.
+
+#define MAX_HASH_THREADS 16
+#define MANIFEST_MAGIC 0x4D503250   // "P2PM"
+#define MANIFEST_VERSION 3          // 1 had flat SHA-256 piece hashes, 2 no FileStamp
+#define MANIFEST_PEER_TRIES 5       // Peers asked for the manifest before downloading without one
+#define LEAVES_MAGIC 0x4C503250     // "P2PL"
+#define LEAVES_VERSION 2            // 1 had no FileStamp
+
+// Leaves and proof hashes of the biggest pieces (MAX_PIECE_SIZE): buffers
+// of this size fit any piece
+#define MAX_MERKLE_LEAVES (MAX_PIECE_SIZE / BLOCK_SIZE)
+#define MAX_PROOF_HASHES 10
+#define MAX_PROOF_SIZE (MAX_PROOF_HASHES * HASH_SIZE)
+
+// Which version of a shared file a manifest was made from. A file replaced
+// by other content of the same size (a fixed-size image) still gets a new
+// inode or modification time, so its old hashes aren't reused
+typedef struct {
+    long long inode;
+    long long mtime_sec;
+    long long mtime_nsec;
+} FileStamp;
+
+// Header of a manifest (and of a leaves file, with its own magic and version)
+typedef struct {
+    unsigned int magic;
+    unsigned int version;
+    unsigned int piece_size;
+    unsigned int num_pieces;
+    long long file_size;
+    FileStamp stamp;
+} ManifestHeader;
+
+// Size and stamp of a file. Returns 0, or -1 if it can't be stat'ed
+int get_file_stamp(char *filepath, long *file_size, FileStamp *stamp);
+
+// How many threads hash in parallel (one per core, at most MAX_HASH_THREADS)
+int hash_thread_count();
+
+// Leaves of a piece of piece_size bytes: its blocks, rounded up to a power of two
+int merkle_leaf_count(int piece_size);
+
+// Hashes in the proof of one of its blocks: one sibling per tree level
+int merkle_proof_hashes(int piece_size);
+
+// Piece hash (Merkle root of its blocks) of one piece
+void hash_piece(const char *data, int length, int piece_size, unsigned char *out);
+
+// The leaf hashes of a piece (blocks past its end are zero hashes)
+void hash_piece_leaves(const char *data, int length, int piece_size, unsigned char *leaves);
+
+// Leaf hash of one block
+void hash_leaf(const char *data, int length, unsigned char *leaf);
+
+// Proof for block `block` of a piece from the piece's leaves:
+// merkle_proof_hashes(piece_size) hashes
+void merkle_proof(const unsigned char *leaves, int piece_size, int block, unsigned char *proof);
+
+// Does a block with this proof lead to the piece hash? 1 = yes, 0 = no
+int verify_block(const unsigned char *piece_hash, int piece_size, int block, const char *data, int length,
+                 const unsigned char *proof);
+
+// Content root of a file from its piece hashes
+void merkle_root(const unsigned char *piece_hashes, int num_pieces, unsigned char *root);
+
+// Roots travel as text: 64 lowercase hex characters and a '\0' (HASH_HEX_SIZE)
+void hash_to_hex(const unsigned char *hash, char *hex);
+
+// Returns 0, or -1 if hex is not exactly 64 hex characters
+int hex_to_hash(const char *hex, unsigned char *hash);
+
+// Does a piece match its hash from the manifest? 1 = yes, 0 = no
+int piece_hash_matches(const unsigned char *expected, const char *data, int length, int piece_size);
+
+// Hash the pieces of an open file on every core
+// hashes gets HASH_SIZE bytes per piece. wanted: one byte per piece, only
+// pieces with a non-zero byte are hashed (NULL = all of them)
+// Returns 0, or -1 if the file could not be read
+int hash_file_pieces(int fd, long file_size, int piece_size, unsigned char *hashes, const char *wanted);
+
+// Hash a file (in pieces of choose_piece_size() bytes) and write its
+// manifest, and its leaves file too if leaves_path isn't NULL
+// Both are stamped with the file's current size, inode and mtime
+// Returns the number of pieces, or -1
+int create_manifest(char *filepath, char *manifest_path, char *leaves_path);
+
+// Read a manifest, only if it was made from the file at filepath as it is
+// now (same size, inode and mtime), cut into pieces of piece_size bytes
+// Returns num_pieces * HASH_SIZE bytes the caller frees, or NULL
+unsigned char* load_manifest(char *manifest_path, char *filepath, int piece_size);
+
+// Is there a leaves file for the file at filepath as it is now, cut into
+// pieces of piece_size bytes? 1 = yes, 0 = no
+int leaves_file_matches(char *leaves_path, char *filepath, int piece_size);
+
+// Read the merkle_leaf_count(piece_size) leaves of one piece from a leaves file
+// Returns 0, or -1 if the file is missing, belongs to another file (or an
+// older version of it) or is too short
+int load_piece_leaves(char *leaves_path, char *filepath, int piece_size, int piece_index,
+                      unsigned char *leaves);
+
+#endif
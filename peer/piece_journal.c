@@ -0,0 +1,110 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "piece_journal.h"
+#include "../common/protocol.h"
+
+static size_t journal_size(int num_pieces) {
+    return sizeof(JournalHeader) + (num_pieces + 7) / 8;
+}
+
+// Map an open state file of the right size
+static int journal_map(PieceJournal *j, int fd, int num_pieces) {
+    j->map_size = journal_size(num_pieces);
+    j->map = mmap(NULL, j->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (j->map == MAP_FAILED) {
+        j->map = NULL;
+        close(fd);
+        j->fd = -1;
+        return -1;
+    }
+
+    j->fd = fd;
+    j->done = j->map + sizeof(JournalHeader);
+    j->num_pieces = num_pieces;
+    return 0;
+}
+
+int journal_create(PieceJournal *j, char *path, int num_pieces, long file_size, int piece_size) {
+    j->fd = -1;
+    j->map = NULL;
+
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return -1;
+
+    // ftruncate() fills the file with zeros: no piece is done yet
+    if (ftruncate(fd, journal_size(num_pieces)) != 0) {
+        close(fd);
+        unlink(path);
+        return -1;
+    }
+
+    if (journal_map(j, fd, num_pieces) != 0) {
+        unlink(path);
+        return -1;
+    }
+
+    JournalHeader header = { JOURNAL_MAGIC, JOURNAL_VERSION, piece_size, num_pieces, file_size };
+    memcpy(j->map, &header, sizeof(header));
+    return 0;
+}
+
+int journal_open(PieceJournal *j, char *path, int num_pieces, long file_size, int piece_size) {
+    j->fd = -1;
+    j->map = NULL;
+
+    int fd = open(path, O_RDWR);
+    if (fd < 0) return -1;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size != journal_size(num_pieces)) {
+        close(fd);
+        return -1;
+    }
+
+    if (journal_map(j, fd, num_pieces) != 0) return -1;
+
+    // Is it the journal of this very file?
+    JournalHeader header;
+    memcpy(&header, j->map, sizeof(header));
+    if (header.magic != JOURNAL_MAGIC || header.version != JOURNAL_VERSION ||
+        (int)header.piece_size != piece_size || (int)header.num_pieces != num_pieces ||
+        header.file_size != file_size) {
+        journal_close(j);
+        return -1;
+    }
+
+    // No bits past the last piece
+    int spare = (num_pieces + 7) / 8 * 8 - num_pieces;
+    if (spare > 0 && (j->done[(num_pieces - 1) / 8] >> (8 - spare)) != 0) {
+        journal_close(j);
+        return -1;
+    }
+
+    int count = 0;
+    for (int i = 0; i < num_pieces; i++) {
+        count += journal_has(j, i);
+    }
+    return count;
+}
+
+int journal_has(PieceJournal *j, int piece_index) {
+    if (j->fd < 0) return 0;
+    return (j->done[piece_index / 8] >> (piece_index % 8)) & 1;
+}
+
+void journal_mark(PieceJournal *j, int piece_index) {
+    if (j->fd < 0) return;
+    __atomic_fetch_or(&j->done[piece_index / 8], 1 << (piece_index % 8), __ATOMIC_RELEASE);
+}
+
+void journal_close(PieceJournal *j) {
+    if (j->map) munmap(j->map, j->map_size);
+    if (j->fd >= 0) close(j->fd);
+    j->map = NULL;
+    j->fd = -1;
+}
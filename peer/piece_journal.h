@@ -0,0 +1,50 @@
+#ifndef PIECE_JOURNAL_H
+#define PIECE_JOURNAL_H
+
+#include <stddef.h>
+
+// Piece journal: which pieces of a download are safely in its .part file
+// A small state file next to the download holds a header (what file this
+// is) and one bit per piece. It is mmap'd, so marking a piece done is a
+// single bit set in memory; the kernel writes it out, and it survives the
+// peer process dying. An interrupted download reads it back and only
+// fetches the pieces that are missing.
+
+#define JOURNAL_MAGIC 0x4A503250   // "P2PJ"
+#define JOURNAL_VERSION 1
+
+typedef struct {
+    unsigned int magic;
+    unsigned int version;
+    unsigned int piece_size;
+    unsigned int num_pieces;
+    long long file_size;
+} JournalHeader;
+
+typedef struct {
+    int fd;                    // -1 = no journal
+    unsigned char *map;        // Header, then the bitmap
+    size_t map_size;
+    unsigned char *done;       // One bit per piece: written to the .part file
+    int num_pieces;
+} PieceJournal;
+
+// Start a fresh journal for a download (replaces an old one)
+// Returns 0, or -1 on error (j->fd is -1 then)
+int journal_create(PieceJournal *j, char *path, int num_pieces, long file_size, int piece_size);
+
+// Open the journal of an interrupted download of the same file
+// Checks that it belongs to this file (size, piece size, piece count)
+// Returns how many pieces are done, or -1 if there is no usable journal
+int journal_open(PieceJournal *j, char *path, int num_pieces, long file_size, int piece_size);
+
+// Is a piece recorded as done?
+int journal_has(PieceJournal *j, int piece_index);
+
+// Record a piece as done - only after its data is written (thread-safe)
+void journal_mark(PieceJournal *j, int piece_index);
+
+// Unmap and close (the state file stays on disk)
+void journal_close(PieceJournal *j);
+
+#endif
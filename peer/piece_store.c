@@ -0,0 +1,89 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "piece_store.h"
+#include "piece_hash.h"
+#include "../file_ops.h"
+
+void store_path(char *path, char *store_dir, const unsigned char *hash) {
+    char hex[HASH_HEX_SIZE];
+    hash_to_hex(hash, hex);
+    sprintf(path, "%s/%s", store_dir, hex);
+}
+
+int store_intern(char *store_dir, const unsigned char *hash, char *piece_path) {
+    char stored[600];
+    store_path(stored, store_dir, hash);
+
+    // New to the store: the piece file itself becomes the stored copy
+    if (link(piece_path, stored) == 0) return 0;
+    if (errno != EEXIST) return -1;
+
+    struct stat piece_st, stored_st;
+    if (stat(piece_path, &piece_st) != 0 || stat(stored, &stored_st) != 0) return -1;
+    if (piece_st.st_ino == stored_st.st_ino && piece_st.st_dev == stored_st.st_dev) return 1;
+    if (piece_st.st_size != stored_st.st_size) return -1;  // Same hash, different size: leave both alone
+
+    // The store has it already: swap our copy for a link to it. rename() is
+    // atomic, so an upload reading the piece sees one or the other, both whole
+    char temp_path[620];
+    snprintf(temp_path, sizeof(temp_path), "%s.link%lu", piece_path, (unsigned long)pthread_self());
+    unlink(temp_path);
+    if (link(stored, temp_path) != 0) return -1;
+    if (rename(temp_path, piece_path) != 0) {
+        unlink(temp_path);
+        return -1;
+    }
+    return 1;
+}
+
+int store_is_linked(char *piece_path) {
+    struct stat st;
+    return stat(piece_path, &st) == 0 && st.st_nlink > 1;
+}
+
+int store_copy_piece(char *store_dir, const unsigned char *hash, int fd, long offset, int length) {
+    char stored[600];
+    store_path(stored, store_dir, hash);
+
+    int in = open(stored, O_RDONLY);
+    if (in < 0) return -1;
+
+    struct stat st;
+    if (fstat(in, &st) != 0 || st.st_size != length) {
+        close(in);
+        return -1;
+    }
+
+    int result = copy_file_part(in, 0, fd, offset, length);
+    close(in);
+    return result;
+}
+
+int store_collect_garbage(char *store_dir) {
+    DIR *dir = opendir(store_dir);
+    if (!dir) return 0;
+
+    int deleted = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] == '.') continue;
+
+        char path[600];
+        snprintf(path, sizeof(path), "%s/%s", store_dir, entry->d_name);
+
+        // Only the store's own link is left: no file uses this piece
+        struct stat st;
+        if (stat(path, &st) == 0 && S_ISREG(st.st_mode) && st.st_nlink == 1 && unlink(path) == 0) {
+            deleted++;
+        }
+    }
+    closedir(dir);
+    return deleted;
+}
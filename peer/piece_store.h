@@ -0,0 +1,34 @@
+#ifndef PIECE_STORE_H
+#define PIECE_STORE_H
+
+// Piece store: every piece we share, kept once by content
+// store/<piece hash in hex> holds the data of a piece. The pieces/ files of
+// every shared file are hard links to it, so two files (or two versions of
+// one file) that have a piece in common keep it on disk once. The link
+// count is the reference count: a stored piece with st_nlink == 1 is used
+// by no file any more and is deleted by store_collect_garbage().
+// Downloads look here before the network: a piece the store already has is
+// copied into the .part file instead of fetched.
+
+// Path of a piece in the store (the buffer holds at least 600 bytes)
+void store_path(char *path, char *store_dir, const unsigned char *hash);
+
+// Put a piece file into the store under its hash
+// If the store already had that piece, piece_path is replaced by a link to
+// it and its own copy is freed
+// Returns 1 if the store already had it, 0 if it was added, -1 on error
+int store_intern(char *store_dir, const unsigned char *hash, char *piece_path);
+
+// Is a piece file linked into the store already?
+int store_is_linked(char *piece_path);
+
+// Copy a stored piece of `length` bytes to its place (offset) in a download's file
+// (copy_file_range(): the filesystem shares the blocks when it can)
+// Returns 0, or -1 if the store doesn't have it
+int store_copy_piece(char *store_dir, const unsigned char *hash, int fd, long offset, int length);
+
+// Delete the stored pieces no file links to any more
+// Returns how many were deleted
+int store_collect_garbage(char *store_dir);
+
+#endif
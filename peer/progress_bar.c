@@ -8,6 +8,7 @@ void init_progress(ProgressTracker *tracker, int total_pieces, long total_bytes)
     tracker->downloaded_pieces = 0;
     tracker->total_bytes = total_bytes;
     tracker->downloaded_bytes = 0;
+    tracker->resumed_bytes = 0;
     tracker->start_time = time(NULL);
     tracker->last_update = time(NULL);
 }
@@ -18,11 +19,17 @@ void update_progress(ProgressTracker *tracker, int piece_size) {
     tracker->last_update = time(NULL);
 }
 
+void add_resumed_progress(ProgressTracker *tracker, int pieces, long bytes) {
+    tracker->downloaded_pieces += pieces;
+    tracker->downloaded_bytes += bytes;
+    tracker->resumed_bytes += bytes;
+}
+
 double get_speed_mbps(ProgressTracker *tracker) {
     time_t elapsed = time(NULL) - tracker->start_time;
     if (elapsed == 0) return 0.0;
     
-    double bytes_per_sec = (double)tracker->downloaded_bytes / elapsed;
+    double bytes_per_sec = (double)(tracker->downloaded_bytes - tracker->resumed_bytes) / elapsed;
     return bytes_per_sec / (1024.0 * 1024.0); // Convert to MB/s
 }
 
@@ -8,6 +8,7 @@ typedef struct {
     int downloaded_pieces;
     long total_bytes;
     long downloaded_bytes;
+    long resumed_bytes;      // Already on disk when the download started (not part of the speed)
     time_t start_time;
     time_t last_update;
 } ProgressTracker;
@@ -18,6 +19,10 @@ void init_progress(ProgressTracker *tracker, int total_pieces, long total_bytes)
 // Update progress (call after each piece)
 void update_progress(ProgressTracker *tracker, int piece_size);
 
+// Count pieces an interrupted download already had: they fill the bar,
+// but don't make the download look faster than it is
+void add_resumed_progress(ProgressTracker *tracker, int pieces, long bytes);
+
 // Display progress bar
 void display_progress(ProgressTracker *tracker);
 
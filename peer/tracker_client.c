@@ -0,0 +1,280 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "tracker_client.h"
+
+static char tracker_addr_str[16];
+static int tracker_sock = -1;
+static pthread_mutex_t tracker_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Bytes read from the tracker but not consumed yet
+static char rx_buf[4096];
+static int rx_start = 0;
+static int rx_len = 0;
+
+void tracker_client_init(char *tracker_ip) {
+    strncpy(tracker_addr_str, tracker_ip, sizeof(tracker_addr_str) - 1);
+}
+
+static void disconnect_tracker() {
+    if (tracker_sock >= 0) close(tracker_sock);
+    tracker_sock = -1;
+    rx_start = rx_len = 0;
+}
+
+// Open the connection if we don't have one
+static int ensure_connected() {
+    if (tracker_sock >= 0) return 0;
+
+    struct sockaddr_in tracker_addr;
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0) {
+        printf("✗ Socket creation failed\n");
+        return -1;
+    }
+
+    tracker_addr.sin_family = AF_INET;
+    tracker_addr.sin_port = htons(TRACKER_PORT);
+    tracker_addr.sin_addr.s_addr = inet_addr(tracker_addr_str);
+
+    if (connect(sock, (struct sockaddr *)&tracker_addr, sizeof(tracker_addr)) < 0) {
+        printf("✗ Cannot connect to tracker at %s:%d\n", tracker_addr_str, TRACKER_PORT);
+        close(sock);
+        return -1;
+    }
+
+    tracker_sock = sock;
+    rx_start = rx_len = 0;
+    return 0;
+}
+
+static int send_all(char *data, int len) {
+    while (len > 0) {
+        int sent = send(tracker_sock, data, len, MSG_NOSIGNAL);
+        if (sent <= 0) return -1;
+        data += sent;
+        len -= sent;
+    }
+    return 0;
+}
+
+static int fill_rx() {
+    if (rx_start > 0) {
+        memmove(rx_buf, rx_buf + rx_start, rx_len);
+        rx_start = 0;
+    }
+    int bytes = read(tracker_sock, rx_buf + rx_len, sizeof(rx_buf) - rx_len);
+    if (bytes <= 0) return -1;
+    rx_len += bytes;
+    return 0;
+}
+
+// Read exactly len bytes
+static int recv_exact(void *buf, int len) {
+    char *out = buf;
+    while (len > 0) {
+        if (rx_len == 0 && fill_rx() < 0) return -1;
+        int n = rx_len < len ? rx_len : len;
+        memcpy(out, rx_buf + rx_start, n);
+        rx_start += n;
+        rx_len -= n;
+        out += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Read one '\n' terminated line (the '\n' is kept, like the old single-read replies)
+static int recv_line(char *line, int size) {
+    int pos = 0;
+    while (pos < size - 1) {
+        if (rx_len == 0 && fill_rx() < 0) return -1;
+        char ch = rx_buf[rx_start++];
+        rx_len--;
+        line[pos++] = ch;
+        if (ch == '\n') break;
+    }
+    line[pos] = '\0';
+    return 0;
+}
+
+int tracker_request(char *message, char *response, int size) {
+    pthread_mutex_lock(&tracker_mutex);
+
+    // Second attempt covers a connection the tracker closed (e.g. restart)
+    for (int attempt = 0; attempt < 2; attempt++) {
+        if (ensure_connected() < 0) break;
+
+        if (send_all(message, strlen(message)) == 0 && recv_line(response, size) == 0) {
+            pthread_mutex_unlock(&tracker_mutex);
+            return 0;
+        }
+        disconnect_tracker();
+    }
+
+    pthread_mutex_unlock(&tracker_mutex);
+    return -1;
+}
+
+static uint32_t get_u32(unsigned char *p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+// Read one QUERY_COMPACT reply, returns peer count or -1
+static int recv_compact_reply(int limit, unsigned long long *cursor,
+                              char ips[][16], int *ports, int *total) {
+    unsigned char header[COMPACT_HEADER_SIZE];
+    unsigned char peers[COMPACT_MAX_PEERS * COMPACT_PEER_SIZE];
+
+    if (recv_exact(header, COMPACT_HEADER_SIZE) < 0) return -1;
+
+    int count = (header[2] << 8) | header[3];
+    if (total) *total = (int)get_u32(header + 4);
+    if (cursor) *cursor = ((unsigned long long)get_u32(header + 8) << 32) | get_u32(header + 12);
+
+    if (count > COMPACT_MAX_PEERS) return -1;
+    if (count > 0 && recv_exact(peers, count * COMPACT_PEER_SIZE) < 0) return -1;
+    if (header[0] != 0) return 0;
+    if (count > limit) count = limit;
+
+    // Each peer: 4 bytes IPv4 (network order) + 2 bytes port (big-endian)
+    for (int i = 0; i < count; i++) {
+        unsigned char *p = peers + i * COMPACT_PEER_SIZE;
+        struct in_addr addr;
+        memcpy(&addr.s_addr, p, 4);
+        inet_ntop(AF_INET, &addr, ips[i], 16);
+        ports[i] = (p[4] << 8) | p[5];
+    }
+
+    return count;
+}
+
+int tracker_query_peers(char *filename, int limit, unsigned long long *cursor, int ranked,
+                        char ips[][16], int *ports, int *total) {
+    char message[256];
+    snprintf(message, sizeof(message), "QUERY_COMPACT %s %d %llu %d\n", filename, limit, *cursor, ranked);
+
+    pthread_mutex_lock(&tracker_mutex);
+
+    int count = -1;
+    for (int attempt = 0; attempt < 2 && count < 0; attempt++) {
+        if (ensure_connected() < 0) break;
+
+        if (send_all(message, strlen(message)) == 0) {
+            count = recv_compact_reply(limit, cursor, ips, ports, total);
+        }
+        if (count < 0) disconnect_tracker();
+    }
+
+    pthread_mutex_unlock(&tracker_mutex);
+    return count;
+}
+
+// Build "<header>\n" + one filename per line
+// With roots (may be NULL), a file that has one goes as "<filename> 100 <root>"
+static char *build_batch(char *header, char names[][MAX_FILENAME], char roots[][HASH_HEX_SIZE],
+                         int count, int *len) {
+    int cap = strlen(header) + count * (MAX_FILENAME + HASH_HEX_SIZE + 6);
+    char *buf = malloc(cap);
+    if (!buf) return NULL;
+
+    int pos = sprintf(buf, "%s", header);
+    for (int i = 0; i < count; i++) {
+        if (roots && roots[i][0]) {
+            pos += sprintf(buf + pos, "%s 100 %s\n", names[i], roots[i]);
+        } else {
+            pos += sprintf(buf + pos, "%s\n", names[i]);
+        }
+    }
+    *len = pos;
+    return buf;
+}
+
+int tracker_register_batch(char names[][MAX_FILENAME], char roots[][HASH_HEX_SIZE], int count, int port) {
+    int added = 0;
+
+    pthread_mutex_lock(&tracker_mutex);
+
+    for (int done = 0; done < count; ) {
+        int chunk = count - done < BATCH_MAX_FILES ? count - done : BATCH_MAX_FILES;
+        char header[64];
+        char response[128];
+        int len;
+
+        sprintf(header, "REGISTER_BATCH %d %d\n", port, chunk);
+        char *buf = build_batch(header, names + done, roots ? roots + done : NULL, chunk, &len);
+        if (!buf) break;
+
+        int ok = ensure_connected() == 0 && send_all(buf, len) == 0 &&
+                 recv_line(response, sizeof(response)) == 0;
+        free(buf);
+
+        int n;
+        if (!ok || sscanf(response, "OK %d", &n) != 1) {
+            disconnect_tracker();
+            added = -1;
+            break;
+        }
+
+        added += n;
+        done += chunk;
+    }
+
+    pthread_mutex_unlock(&tracker_mutex);
+    return added;
+}
+
+int tracker_query_batch(char names[][MAX_FILENAME], int count, int limit,
+                        char ips[][16], int *ports, int *found) {
+    int result = 0;
+
+    if (limit > COMPACT_MAX_PEERS) limit = COMPACT_MAX_PEERS;
+
+    pthread_mutex_lock(&tracker_mutex);
+
+    for (int done = 0; done < count && result == 0; ) {
+        int chunk = count - done < BATCH_MAX_FILES ? count - done : BATCH_MAX_FILES;
+        char header[64];
+        int len;
+
+        sprintf(header, "QUERY_BATCH %d %d\n", limit, chunk);
+        char *buf = build_batch(header, names + done, NULL, chunk, &len);
+        if (!buf || ensure_connected() < 0 || send_all(buf, len) < 0) {
+            free(buf);
+            disconnect_tracker();
+            result = -1;
+            break;
+        }
+        free(buf);
+
+        // Replies come back in request order
+        for (int i = done; i < done + chunk; i++) {
+            found[i] = recv_compact_reply(limit, NULL, ips + i * limit, ports + i * limit, NULL);
+            if (found[i] < 0) {
+                disconnect_tracker();
+                result = -1;
+                break;
+            }
+        }
+        done += chunk;
+    }
+
+    pthread_mutex_unlock(&tracker_mutex);
+    return result;
+}
+
+int tracker_get_root(char *filename, char *root) {
+    char message[256];
+    char response[256];
+    snprintf(message, sizeof(message), "ROOT %s\n", filename);
+
+    if (tracker_request(message, response, sizeof(response)) != 0) return -1;
+    if (sscanf(response, "ROOT %64s", root) != 1 || strlen(root) != HASH_HEX_SIZE - 1) return 1;
+    return 0;
+}
@@ -0,0 +1,40 @@
+#ifndef TRACKER_CLIENT_H
+#define TRACKER_CLIENT_H
+
+#include "../common/protocol.h"
+
+// Persistent connection to the tracker
+// One TCP connection is opened on first use and reused for every request
+// (reconnecting once if the tracker went away). Safe to call from several
+// threads: requests are serialized on the connection.
+
+// Remember the tracker address (no connection is made yet)
+void tracker_client_init(char *tracker_ip);
+
+// Send one text command and read the one-line reply into response (size bytes)
+int tracker_request(char *message, char *response, int size);
+
+// QUERY_COMPACT: get a page of peers (see protocol.h)
+// *cursor = 0 asks for a random sample of up to `limit` peers; on return it holds
+// the cursor for the next page (0 when there are no more peers).
+// ranked = 1 asks for the best `limit` peers for us instead (single page)
+// Returns number of peers written to ips/ports (0 if the file is unknown), -1 on error
+int tracker_query_peers(char *filename, int limit, unsigned long long *cursor, int ranked,
+                        char ips[][16], int *ports, int *total);
+
+// REGISTER_BATCH: register many files in one round trip per BATCH_MAX_FILES
+// roots[i] is the content root (hex) of names[i], "" if unknown; roots may be NULL
+// Returns number of newly registered files, -1 on error
+int tracker_register_batch(char names[][MAX_FILENAME], char roots[][HASH_HEX_SIZE], int count, int port);
+
+// QUERY_BATCH: look up many files in one round trip per BATCH_MAX_FILES
+// For file i, up to `limit` peers go to ips[i*limit...] / ports[i*limit...]
+// and the number found to found[i]. Returns 0, or -1 on error
+int tracker_query_batch(char names[][MAX_FILENAME], int count, int limit,
+                        char ips[][16], int *ports, int *found);
+
+// ROOT: the content root (hex, HASH_HEX_SIZE bytes) the tracker knows for a file
+// Returns 0, 1 if it has none, -1 if the tracker can't be reached
+int tracker_get_root(char *filename, char *root);
+
+#endif
@@ -0,0 +1,195 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include "wire.h"
+
+void put_u32(unsigned char *p, unsigned int v) {
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+unsigned int get_u32(const unsigned char *p) {
+    return ((unsigned int)p[0] << 24) | ((unsigned int)p[1] << 16) |
+           ((unsigned int)p[2] << 8) | p[3];
+}
+
+static void build_header(unsigned char *h, int type, unsigned int length, unsigned int id) {
+    h[0] = FRAME_MAGIC;
+    h[1] = type;
+    h[2] = 0;   // Flags
+    h[3] = 0;
+    put_u32(h + 4, length);
+    put_u32(h + 8, id);
+}
+
+// HELLO payload: version (2), capabilities (4), 0, '\n'
+static void build_hello(unsigned char *p, int version, unsigned int caps) {
+    p[0] = version >> 8;
+    p[1] = version;
+    put_u32(p + 2, caps);
+    p[6] = 0;
+    p[7] = '\n';
+}
+
+int wire_encode(unsigned char *out, int type, unsigned int id,
+                const void *head, int head_len, const void *body, int body_len) {
+    build_header(out, type, head_len + body_len, id);
+    if (head_len > 0) memcpy(out + FRAME_HEADER_SIZE, head, head_len);
+    if (body_len > 0) memcpy(out + FRAME_HEADER_SIZE + head_len, body, body_len);
+    return FRAME_HEADER_SIZE + head_len + body_len;
+}
+
+void wire_hello(unsigned char *p) {
+    build_hello(p, WIRE_VERSION, WIRE_CAPS);
+}
+
+int wire_send(PeerSession *s, int type, unsigned int id,
+              const void *head, int head_len, const void *body, int body_len) {
+    unsigned char header[FRAME_HEADER_SIZE];
+    build_header(header, type, head_len + body_len, id);
+
+    struct iovec iov[3] = {
+        { header, FRAME_HEADER_SIZE },
+        { (void*)head, head_len },
+        { (void*)body, body_len },
+    };
+    struct iovec *next = iov;
+    int count = 3;
+
+    while (count > 0) {
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = next;
+        msg.msg_iovlen = count;
+
+        // MSG_NOSIGNAL: a peer that hung up gives us an error, not SIGPIPE
+        ssize_t sent = sendmsg(s->fd, &msg, MSG_NOSIGNAL);
+        if (sent <= 0) return -1;
+
+        // Skip what went out, the rest goes in the next round
+        while (count > 0 && sent >= (ssize_t)next->iov_len) {
+            sent -= next->iov_len;
+            next++;
+            count--;
+        }
+        if (count > 0) {
+            next->iov_base = (char*)next->iov_base + sent;
+            next->iov_len -= sent;
+        }
+    }
+    return 0;
+}
+
+int wire_read_header(PeerSession *s, FrameHeader *h) {
+    unsigned char raw[FRAME_HEADER_SIZE];
+    if (session_read_exact(s, raw, FRAME_HEADER_SIZE) != 0) return -1;
+    if (raw[0] != FRAME_MAGIC) return -1;  // Out of sync
+
+    h->type = raw[1];
+    h->length = get_u32(raw + 4);
+    h->id = get_u32(raw + 8);
+    return (h->length <= FRAME_MAX_PAYLOAD) ? 0 : -1;
+}
+
+int wire_skip(PeerSession *s, unsigned int length) {
+    char scrap[1024];
+    while (length > 0) {
+        int take = (length < sizeof(scrap)) ? length : sizeof(scrap);
+        if (session_read_exact(s, scrap, take) != 0) return -1;
+        length -= take;
+    }
+    return 0;
+}
+
+// Returns 0 (v2 or text, see s->version), or -1 if the peer hung up
+static int client_hello(PeerSession *s) {
+    unsigned char hello[8];
+    build_hello(hello, WIRE_VERSION, WIRE_CAPS);
+    if (wire_send(s, FRAME_HELLO, 0, hello, sizeof(hello), NULL, 0) != 0) return -1;
+
+    int first = session_peek_byte(s);
+    if (first < 0) return -1;
+
+    if (first != FRAME_MAGIC) {
+        // A text peer: it answered our HELLO like any unknown command
+        char line[256];
+        if (session_read_line(s, line, sizeof(line)) < 0) return -1;
+        s->version = 1;
+        return 0;
+    }
+
+    FrameHeader h;
+    if (wire_read_header(s, &h) != 0 || h.type != FRAME_HELLO || h.length < 6) return -1;
+    unsigned char reply[64];
+    if (h.length > sizeof(reply) || session_read_exact(s, reply, h.length) != 0) return -1;
+
+    s->version = (reply[0] << 8) | reply[1];
+    s->caps = get_u32(reply + 2) & WIRE_CAPS;
+    return 0;
+}
+
+PeerSession* wire_connect(char *ip, int port) {
+    PeerSession *s = session_connect(ip, port);
+    if (!s) return NULL;
+
+    // Don't wait forever on a peer that reads HELLO and says nothing
+    struct timeval timeout = { HELLO_TIMEOUT, 0 };
+    setsockopt(s->fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    if (client_hello(s) != 0) {
+        // The oldest peers close the connection on a command they don't know:
+        // talk text to them on a fresh one
+        session_close(s);
+        s = session_connect(ip, port);
+        if (!s) return NULL;
+    }
+
+    struct timeval none = { 0, 0 };
+    setsockopt(s->fd, SOL_SOCKET, SO_RCVTIMEO, &none, sizeof(none));
+    return s;
+}
+
+int wire_accept_hello(PeerSession *s) {
+    FrameHeader h;
+    if (wire_read_header(s, &h) != 0 || h.type != FRAME_HELLO || h.length < 6) return -1;
+
+    unsigned char hello[64];
+    if (h.length > sizeof(hello) || session_read_exact(s, hello, h.length) != 0) return -1;
+
+    // Speak the older of the two versions, use only what both sides support
+    int version = (hello[0] << 8) | hello[1];
+    if (version < 2) return -1;
+    if (version > WIRE_VERSION) version = WIRE_VERSION;
+    s->version = version;
+    s->caps = get_u32(hello + 2) & WIRE_CAPS;
+
+    build_hello(hello, s->version, s->caps);
+    return wire_send(s, FRAME_HELLO, h.id, hello, 8, NULL, 0);
+}
+
+int wire_take_cancel(PeerSession *s, unsigned int id) {
+    session_read_available(s);
+
+    // Walk the complete frames sitting in the buffer
+    unsigned char *p = (unsigned char*)s->buf + s->start;
+    unsigned char *end = p + s->len;
+    while (end - p >= FRAME_HEADER_SIZE && p[0] == FRAME_MAGIC) {
+        unsigned int length = get_u32(p + 4);
+        if (length > (unsigned int)(end - p - FRAME_HEADER_SIZE)) break;  // Not all here yet
+
+        unsigned char *next = p + FRAME_HEADER_SIZE + length;
+        if (p[1] == FRAME_CANCEL && length == 4 && get_u32(p + FRAME_HEADER_SIZE) == id) {
+            // Close the gap so the frames around it are read as usual
+            memmove(p, next, end - next);
+            s->len -= next - p;
+            return 1;
+        }
+        p = next;
+    }
+    return 0;
+}
@@ -0,0 +1,56 @@
+#ifndef WIRE_H
+#define WIRE_H
+
+#include "peer_session.h"
+#include "../common/protocol.h"
+
+// Peer wire protocol v2: binary frames on top of a PeerSession
+// Every message is a fixed 12 byte header (type, payload length, request id)
+// and a payload, so both sides read exactly what they need - no line
+// parsing, no guessing where binary data starts. The request id comes back
+// in the reply and lets a CANCEL name the request it is about.
+// See common/protocol.h for the frame layout and message types.
+
+typedef struct {
+    int type;
+    unsigned int length;   // Payload bytes that follow the header
+    unsigned int id;
+} FrameHeader;
+
+// Connect to a peer and agree on a protocol version (HELLO)
+// Falls back to text commands for peers that don't know v2. NULL if unreachable
+PeerSession* wire_connect(char *ip, int port);
+
+// Answer the HELLO a downloader opened the connection with (uploader side)
+// Returns 0, or -1 if it wasn't a valid HELLO
+int wire_accept_hello(PeerSession *s);
+
+// Send one frame: the header, then `head` (fixed fields) and `body` (a
+// filename or block data) in one system call. Returns 0, or -1 on error
+int wire_send(PeerSession *s, int type, unsigned int id,
+              const void *head, int head_len, const void *body, int body_len);
+
+// Build a frame in memory instead of sending it (for non-blocking sockets that
+// queue their output). out needs FRAME_HEADER_SIZE + head_len + body_len bytes.
+// Returns the frame's size
+int wire_encode(unsigned char *out, int type, unsigned int id,
+                const void *head, int head_len, const void *body, int body_len);
+
+// Our HELLO payload (8 bytes): the version and capabilities we offer
+void wire_hello(unsigned char *p);
+
+// Read the next frame header. Returns 0, or -1 on error, EOF or a bad header
+int wire_read_header(PeerSession *s, FrameHeader *h);
+
+// Read and throw away a payload we don't need. Returns 0, or -1 on error
+int wire_skip(PeerSession *s, unsigned int length);
+
+// Look for a CANCEL of request `id` that already arrived but wasn't read
+// yet, and remove it. Returns 1 if found, 0 if not
+int wire_take_cancel(PeerSession *s, unsigned int id);
+
+// Big-endian fields inside payloads
+void put_u32(unsigned char *p, unsigned int v);
+unsigned int get_u32(const unsigned char *p);
+
+#endif
@@ -0,0 +1,103 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "protocol.h"
+#include "chunker.h"
+
+int failures = 0;
+
+void check(int ok, char *what) {
+    printf("%s %s\n", ok ? "✓" : "✗", what);
+    if (!ok) failures++;
+}
+
+// Fill a buffer with bytes that look random but are the same every run
+void fill(unsigned char *data, long length, unsigned int seed) {
+    for (long i = 0; i < length; i++) {
+        seed = seed * 1103515245 + 12345;
+        data[i] = (unsigned char)(seed >> 16);
+    }
+}
+
+// Do the chunks cover the buffer end to end, within the size limits?
+int chunks_cover(Chunk *chunks, int count, long size) {
+    long long offset = 0;
+    for (int i = 0; i < count; i++) {
+        if (chunks[i].offset != offset || chunks[i].length > CDC_MAX_SIZE) return 0;
+        if (chunks[i].length < CDC_MIN_SIZE && i != count - 1) return 0;  // Only the last may be short
+        offset += chunks[i].length;
+    }
+    return offset == size;
+}
+
+// Is there a chunk ending at this offset?
+int has_boundary(Chunk *chunks, int count, long long end) {
+    for (int i = 0; i < count; i++) {
+        if (chunks[i].offset + chunks[i].length == end) return 1;
+    }
+    return 0;
+}
+
+int main() {
+    long size = 8 * 1024 * 1024;
+    int prefix = 1000;   // Bytes inserted at the start of the new version
+    unsigned char *old_data = malloc(size);
+    unsigned char *new_data = malloc(size + prefix);
+    Chunk *old_chunks = NULL;
+    Chunk *new_chunks = NULL;
+    
+    printf("========================================\n");
+    printf("    Testing Content-Defined Chunking\n");
+    printf("========================================\n\n");
+    
+    fill(old_data, size, 7);
+    fill(new_data, prefix, 99);
+    memcpy(new_data + prefix, old_data, size);
+    
+    // Test 1: Chunks cover the whole buffer
+    int old_count = chunk_buffer(old_data, size, &old_chunks);
+    int new_count = chunk_buffer(new_data, size + prefix, &new_chunks);
+    printf("Old version: %d chunks, new version: %d chunks\n", old_count, new_count);
+    check(old_count > 0 && chunks_cover(old_chunks, old_count, size), "Old version's chunks cover it end to end");
+    check(new_count > 0 && chunks_cover(new_chunks, new_count, size + prefix), "New version's chunks cover it end to end");
+    
+    // Test 2: Same data, same chunks (chunking is deterministic)
+    Chunk *again = NULL;
+    int again_count = chunk_buffer(old_data, size, &again);
+    check(again_count == old_count && memcmp(again, old_chunks, old_count * sizeof(Chunk)) == 0,
+          "Chunking the same data twice gives the same chunks");
+    free(again);
+    
+    // Test 3: Every boundary after the first chunk moves with the inserted prefix
+    int moved = 0;
+    for (int i = 1; i < old_count; i++) {
+        long long end = old_chunks[i].offset + old_chunks[i].length;
+        moved += has_boundary(new_chunks, new_count, end + prefix);
+    }
+    printf("Boundaries found again after the prefix: %d/%d\n", moved, old_count - 1);
+    check(moved == old_count - 1, "Boundaries are the same with and without an inserted prefix");
+    
+    // Test 4: And so are the chunks between them, hashes included
+    int shared = 0;
+    for (int i = 1; i < old_count; i++) {
+        for (int k = 0; k < new_count; k++) {
+            if (new_chunks[k].offset == old_chunks[i].offset + prefix &&
+                new_chunks[k].length == old_chunks[i].length &&
+                memcmp(new_chunks[k].hash, old_chunks[i].hash, HASH_SIZE) == 0) {
+                shared++;
+                break;
+            }
+        }
+    }
+    check(shared == old_count - 1, "Every chunk after the first has the same length and hash");
+    
+    printf("\n========================================\n");
+    printf("%s (%d failed)\n", failures ? "FAILED" : "All tests passed", failures);
+    printf("========================================\n");
+    
+    free(old_chunks);
+    free(new_chunks);
+    free(old_data);
+    free(new_data);
+    return failures ? 1 : 0;
+}
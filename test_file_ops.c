@@ -14,7 +14,8 @@ int main() {
     printf("File size: %ld bytes\n", size);
     
     // Test 2: Calculate pieces
-    int num_pieces = calculate_num_pieces(size);
+    int piece_size = choose_piece_size(size);
+    int num_pieces = calculate_num_pieces(size, piece_size);
     printf("Number of pieces: %d\n\n", num_pieces);
     
     // Test 3: Split file
@@ -23,7 +24,7 @@ int main() {
     
     printf("\n--- Assembling file ---\n");
     // Test 4: Assemble file
-    assemble_file(filename, "pieces", num_pieces, "testfile_copy.txt");
+    assemble_file(filename, "pieces", num_pieces, piece_size, "testfile_copy.txt");
     
     printf("\n========================================\n");
     printf("Done! Check if files are identical:\n");
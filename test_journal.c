@@ -0,0 +1,94 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include "protocol.h"
+#include "piece_journal.h"
+
+int failures = 0;
+
+void check(int ok, char *what) {
+    printf("%s %s\n", ok ? "✓" : "✗", what);
+    if (!ok) failures++;
+}
+
+// Overwrite bytes of the journal file at offset
+void patch(char *path, long offset, void *data, int length) {
+    int fd = open(path, O_WRONLY);
+    if (fd < 0 || pwrite(fd, data, length, offset) != length) printf("✗ Cannot patch %s\n", path);
+    if (fd >= 0) close(fd);
+}
+
+int main() {
+    char *path = "test_journal.state";
+    int num_pieces = 13;            // Not a multiple of 8: 3 spare bits in the last byte
+    long file_size = 13 * 16384 - 100;
+    int piece_size = 16384;
+    PieceJournal j;
+    
+    printf("========================================\n");
+    printf("      Testing Piece Journal\n");
+    printf("========================================\n\n");
+    
+    // Test 1: Marked pieces come back
+    check(journal_create(&j, path, num_pieces, file_size, piece_size) == 0, "Create journal");
+    journal_mark(&j, 0);
+    journal_mark(&j, 5);
+    journal_mark(&j, 12);
+    journal_close(&j);
+    
+    int done = journal_open(&j, path, num_pieces, file_size, piece_size);
+    check(done == 3, "Reopened journal has 3 pieces done");
+    check(journal_has(&j, 5) && journal_has(&j, 12) && !journal_has(&j, 6), "The right pieces are done");
+    journal_close(&j);
+    
+    // Test 2: A journal for another file is rejected
+    check(journal_open(&j, path, num_pieces, file_size + 1, piece_size) < 0, "Other file size is rejected");
+    check(journal_open(&j, path, num_pieces, file_size, piece_size * 2) < 0, "Other piece size is rejected");
+    check(journal_open(&j, path, num_pieces + 1, file_size, piece_size) < 0, "Other piece count is rejected");
+    
+    // Test 3: A damaged header is rejected
+    JournalHeader header;
+    int fd = open(path, O_RDONLY);
+    check(fd >= 0 && read(fd, &header, sizeof(header)) == sizeof(header), "Read header");
+    if (fd >= 0) close(fd);
+    
+    unsigned int bad_magic = header.magic ^ 1;
+    patch(path, 0, &bad_magic, sizeof(bad_magic));
+    check(journal_open(&j, path, num_pieces, file_size, piece_size) < 0, "Wrong magic is rejected");
+    patch(path, 0, &header.magic, sizeof(header.magic));
+    
+    unsigned int bad_version = header.version + 1;
+    patch(path, sizeof(unsigned int), &bad_version, sizeof(bad_version));
+    check(journal_open(&j, path, num_pieces, file_size, piece_size) < 0, "Wrong version is rejected");
+    patch(path, sizeof(unsigned int), &header.version, sizeof(header.version));
+    
+    check(journal_open(&j, path, num_pieces, file_size, piece_size) == 3, "Repaired header opens again");
+    journal_close(&j);
+    
+    // Test 4: Stray bits past the last piece are rejected
+    long last_byte = sizeof(JournalHeader) + (num_pieces - 1) / 8;
+    unsigned char byte;
+    fd = open(path, O_RDONLY);
+    check(fd >= 0 && pread(fd, &byte, 1, last_byte) == 1, "Read last bitmap byte");
+    if (fd >= 0) close(fd);
+    
+    unsigned char stray = byte | (1 << (num_pieces % 8));   // Bit of piece 13, which doesn't exist
+    patch(path, last_byte, &stray, 1);
+    check(journal_open(&j, path, num_pieces, file_size, piece_size) < 0, "Bit past the last piece is rejected");
+    patch(path, last_byte, &byte, 1);
+    
+    // Test 5: A file of the wrong length is rejected
+    fd = open(path, O_WRONLY | O_APPEND);
+    check(fd >= 0 && write(fd, "x", 1) == 1, "Append a byte");
+    if (fd >= 0) close(fd);
+    check(journal_open(&j, path, num_pieces, file_size, piece_size) < 0, "Journal of the wrong length is rejected");
+    
+    unlink(path);
+    
+    printf("\n========================================\n");
+    printf("%s (%d failed)\n", failures ? "FAILED" : "All tests passed", failures);
+    printf("========================================\n");
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,99 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "protocol.h"
+#include "piece_hash.h"
+
+int failures = 0;
+
+void check(int ok, char *what) {
+    printf("%s %s\n", ok ? "✓" : "✗", what);
+    if (!ok) failures++;
+}
+
+// Fill a buffer with bytes that look random but are the same every run
+void fill(char *data, int length, unsigned int seed) {
+    for (int i = 0; i < length; i++) {
+        seed = seed * 1103515245 + 12345;
+        data[i] = (char)(seed >> 16);
+    }
+}
+
+// Does every block of a piece pass with its own proof?
+int all_blocks_pass(char *data, int length, int piece_size) {
+    unsigned char piece_hash[HASH_SIZE];
+    unsigned char leaves[MAX_MERKLE_LEAVES * HASH_SIZE];
+    unsigned char proof[MAX_PROOF_SIZE];
+    
+    hash_piece(data, length, piece_size, piece_hash);
+    hash_piece_leaves(data, length, piece_size, leaves);
+    
+    for (int offset = 0; offset < length; offset += BLOCK_SIZE) {
+        int block = offset / BLOCK_SIZE;
+        int size = (length - offset < BLOCK_SIZE) ? length - offset : BLOCK_SIZE;
+        merkle_proof(leaves, piece_size, block, proof);
+        if (!verify_block(piece_hash, piece_size, block, data + offset, size, proof)) return 0;
+    }
+    return 1;
+}
+
+int main() {
+    int piece_size = 128 * 1024;   // 8 blocks: 3 hashes per proof
+    char *data = malloc(piece_size);
+    unsigned char piece_hash[HASH_SIZE];
+    unsigned char leaves[MAX_MERKLE_LEAVES * HASH_SIZE];
+    unsigned char proof[MAX_PROOF_SIZE];
+    
+    printf("========================================\n");
+    printf("      Testing Merkle Block Proofs\n");
+    printf("========================================\n\n");
+    
+    // Test 1: Proof sizes
+    check(merkle_proof_hashes(16 * 1024) == 0, "16 KB piece: no proof hashes (the block is the piece)");
+    check(merkle_proof_hashes(piece_size) == 3, "128 KB piece: 3 proof hashes");
+    check(merkle_proof_hashes(MAX_PIECE_SIZE) <= MAX_PROOF_HASHES, "Biggest piece fits MAX_PROOF_HASHES");
+    
+    // Test 2: Correct proofs pass, for full and short pieces
+    fill(data, piece_size, 1);
+    check(all_blocks_pass(data, piece_size, piece_size), "Every block of a full piece passes");
+    check(all_blocks_pass(data, 100000, piece_size), "Every block of a short last piece passes");
+    check(all_blocks_pass(data, 5000, 16 * 1024), "A 16 KB piece's only block passes");
+    
+    hash_piece(data, piece_size, piece_size, piece_hash);
+    hash_piece_leaves(data, piece_size, piece_size, leaves);
+    int block = 5;
+    char *block_data = data + block * BLOCK_SIZE;
+    merkle_proof(leaves, piece_size, block, proof);
+    
+    // Test 3: A flipped byte in the block fails
+    block_data[100] ^= 0x01;
+    check(!verify_block(piece_hash, piece_size, block, block_data, BLOCK_SIZE, proof), "Flipped data byte fails");
+    block_data[100] ^= 0x01;
+    
+    // Test 4: A wrong sibling fails, at every level
+    for (int level = 0; level < merkle_proof_hashes(piece_size); level++) {
+        char what[64];
+        proof[level * HASH_SIZE] ^= 0x80;
+        sprintf(what, "Wrong sibling at level %d fails", level);
+        check(!verify_block(piece_hash, piece_size, block, block_data, BLOCK_SIZE, proof), what);
+        proof[level * HASH_SIZE] ^= 0x80;
+    }
+    
+    // Test 5: The right data under another block's position or proof fails
+    check(!verify_block(piece_hash, piece_size, block ^ 1, block_data, BLOCK_SIZE, proof), "Block at the wrong position fails");
+    merkle_proof(leaves, piece_size, block ^ 1, proof);
+    check(!verify_block(piece_hash, piece_size, block, block_data, BLOCK_SIZE, proof), "Another block's proof fails");
+    
+    // Test 6: A truncated block fails, so does a block index past the tree
+    merkle_proof(leaves, piece_size, block, proof);
+    check(!verify_block(piece_hash, piece_size, block, block_data, BLOCK_SIZE - 1, proof), "Truncated block fails");
+    check(!verify_block(piece_hash, piece_size, merkle_leaf_count(piece_size), block_data, BLOCK_SIZE, proof),
+          "Block index past the last leaf fails");
+    
+    printf("\n========================================\n");
+    printf("%s (%d failed)\n", failures ? "FAILED" : "All tests passed", failures);
+    printf("========================================\n");
+    
+    free(data);
+    return failures ? 1 : 0;
+}
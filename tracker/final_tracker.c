@@ -1,105 +1,419 @@
+#define _GNU_SOURCE   // pthread_rwlockattr_setkind_np()
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include "../common/protocol.h"
+#include "registry.h"
+#include "persist.h"
 
-// Stores filename, ip address and port number
+// Pending connections the kernel queues for us (capped by net.core.somaxconn)
+#define TRACKER_BACKLOG 4096
+
+// Bytes buffered per client while waiting for a complete command line
+#define CONN_BUFFER_SIZE 4096
+
+// Replies waiting for a client that doesn't read them: past the limit we stop
+// reading its commands until it catches up, past the hard limit it is dropped
+#define CONN_OUTPUT_LIMIT (256 * 1024)
+#define CONN_OUTPUT_HARD_LIMIT (4 * 1024 * 1024)
+
+// Default directory for the saved registry (see persist.h)
+#define TRACKER_STATE_DIR "tracker_data"
+
+// Events handled per epoll_wait() call
+#define MAX_EVENTS 256
+
+#define BATCH_NONE 0
+#define BATCH_REGISTER 1
+#define BATCH_QUERY 2
+
+// One client connection owned by an event loop
 typedef struct {
-    char filename[MAX_FILENAME];
-    char peer_ip[16];
-    int peer_port;
-} FileRecord;
-
-// Array to store all registered files (max 10 files)
-FileRecord registered_files[10]; 
-int file_count = 0; // counter
-
-// Function to add a file to our memory
-void add_file(char *filename, char *ip, int port) {
-    if (file_count >= 10) {
-        printf("✗ Storage full! Cannot register more files.\n");
-        return;
+    int fd;
+    char client_ip[16];
+    uint32_t client_addr;   // Same IP in network byte order (registry key)
+
+    // Incoming bytes not yet split into commands
+    char in_buf[CONN_BUFFER_SIZE];
+    int in_len;
+
+    // Batch in progress: the next batch_remaining lines are filenames
+    int batch_type;         // BATCH_NONE, BATCH_REGISTER or BATCH_QUERY
+    int batch_remaining;
+    int batch_port;         // REGISTER_BATCH: port the files are shared on
+    int batch_limit;        // QUERY_BATCH: peers per file
+    int batch_added;
+
+    // Replies the socket could not take yet (sent when EPOLLOUT fires)
+    char *out_buf;
+    int out_len;
+    int out_cap;
+    int out_sent;
+
+    unsigned int events;    // What epoll watches for right now
+    int read_closed;        // Client sent EOF: close once out_buf has drained
+} Connection;
+
+// Registry is shared by every event loop thread: lookups (QUERY*, ROOT) take
+// it for reading and run side by side, changes take it for writing.
+// Set up in main() to prefer writers, so a stream of queries can't hold
+// off REGISTER and expiry forever
+pthread_rwlock_t registry_lock;
+
+int listen_backlog = TRACKER_BACKLOG;
+
+// Last second in which stale peers were expired (shared by all loops)
+time_t last_expire_check = 0;
+
+// Registry is saved to disk unless started with -n
+int persistence_enabled = 1;
+
+// Port to listen on (-p, mainly for benchmarks)
+int tracker_port = TRACKER_PORT;
+
+// -q turns off per-command logging (printing costs more than handling a command)
+int quiet = 0;
+#define LOG(...) do { if (!quiet) printf(__VA_ARGS__); } while (0)
+
+// Ranking of QUERY replies (see peer_score)
+#define RANK_CANDIDATE_FACTOR 4     // Candidates drawn per peer returned
+#define RANK_MAX_CANDIDATES 1024
+#define RANK_SAME_SUBNET_BONUS 50
+#define RANK_NEAR_SUBNET_BONUS 20
+#define RANK_UPLOAD_PENALTY 10      // Per active upload
+#define RANK_JITTER 25
+
+// QUERY_COMPACT cursors hold the swarm size in 24 bits (see find_peers_compact)
+#define CURSOR_MAX_TOTAL 0xFFFFFF
+
+// Number of registrations up to which print_all_files() lists every entry
+#define PRINT_ALL_LIMIT 20
+
+// Is this a content root: 64 lowercase hex characters?
+int valid_root(char *root) {
+    return strlen(root) == HASH_HEX_SIZE - 1 && strspn(root, "0123456789abcdef") == HASH_HEX_SIZE - 1;
+}
+
+// Function to add a file to our registry
+// root: content root the peer has ("" if it didn't say). A file has one
+// content root at a time. A complete copy (100%) with a new root is a new
+// version of the file: it takes the swarm over, and every peer registered
+// under the old root is dropped. A partial copy with another root is
+// refused (-2), and so is a version the file had before (-3)
+int add_file(char *filename, uint32_t ip, int port, int completion, char *root, time_t now) {
+    char ip_str[16];
+    inet_ntop(AF_INET, &ip, ip_str, sizeof(ip_str));
+
+    Swarm *swarm = registry_find_swarm(filename);
+    int new_version = 0;
+    if (root[0] && swarm && swarm->root[0] && strcmp(swarm->root, root) != 0) {
+        if (registry_root_superseded(swarm, root)) {
+            LOG("✗ Outdated content: %s from %s:%d\n", filename, ip_str, port);
+            return -3;
+        }
+        if (completion < 100) {
+            LOG("✗ Different content: %s from %s:%d\n", filename, ip_str, port);
+            return -2;
+        }
+        new_version = 1;
+    }
+
+    Membership *existing = registry_find_membership(filename, ip, (uint16_t)port);
+    int old_completion = existing ? existing->completion : 100;
+
+    int added = registry_add(filename, ip, (uint16_t)port, completion, now);
+    if (added < 0) {
+        LOG("✗ Out of memory! Cannot register %s from %s:%d\n", filename, ip_str, port);
+        return added;
+    } else if (added == 0) {
+        LOG("✓ Already registered: %s from %s:%d\n", filename, ip_str, port);
+    } else {
+        if (persistence_enabled) persist_log_register(filename, ip, (uint16_t)port);
+        LOG("✓ Registered: %s from %s:%d\n", filename, ip_str, port);
+    }
+
+    // A replayed 'R' counts as complete: log anything less, and every change
+    Membership *m = registry_find_membership(filename, ip, (uint16_t)port);
+    if (persistence_enabled && m && m->completion != old_completion) {
+        persist_log_completion(filename, ip, (uint16_t)port, m->completion);
+    }
+
+    // First peer to tell us what the content is, or the first seeder of a new version
+    swarm = registry_find_swarm(filename);
+    if (root[0] && swarm && (!swarm->root[0] || new_version)) {
+        registry_set_root(swarm, root);
+        if (persistence_enabled) persist_log_root(filename, root);
+    }
+
+    // The old version's peers leave the swarm. Walking down, a removal only
+    // moves an already visited member (the new seeder) into the slot
+    if (new_version && swarm) {
+        int dropped = 0;
+        for (int i = swarm->member_count - 1; i >= 0; i--) {
+            PeerNode *peer = swarm->members[i]->peer;
+            if (peer->ip == ip && peer->port == (uint16_t)port) continue;
+
+            uint32_t old_ip = peer->ip;
+            uint16_t old_port = peer->port;
+            registry_remove(filename, old_ip, old_port);
+            if (persistence_enabled) persist_log_unregister(filename, old_ip, old_port);
+            dropped++;
+        }
+        LOG("✓ New version of %s from %s:%d, dropped %d peer(s) of the old one\n",
+            filename, ip_str, port, dropped);
+    }
+    return added;
+}
+
+// Function to remove a file registration
+int remove_file(char *filename, uint32_t ip, int port) {
+    char ip_str[16];
+    inet_ntop(AF_INET, &ip, ip_str, sizeof(ip_str));
+
+    int removed = registry_remove(filename, ip, (uint16_t)port);
+    if (removed) {
+        if (persistence_enabled) persist_log_unregister(filename, ip, (uint16_t)port);
+        LOG("✓ Unregistered: %s from %s:%d\n", filename, ip_str, port);
+    } else {
+        LOG("✗ Not registered: %s from %s:%d\n", filename, ip_str, port);
     }
-    
-    strcpy(registered_files[file_count].filename, filename);
-    strcpy(registered_files[file_count].peer_ip, ip);
-    registered_files[file_count].peer_port = port;
-    file_count++;
-    
-    printf("✓ Registered: %s from %s:%d\n", filename, ip, port);
+    return removed;
 }
 
 // Function to find peers who have a specific file
 // response is pointer to buffer where we will write response message
-void find_peers(char *filename, char *response) {
-    int found = 0;
-    char temp[1024] = "";
-    
-    // Search through all registered files
-    for (int i = 0; i < file_count; i++) {
-        if (strcmp(registered_files[i].filename, filename) == 0) {
-            // Found a match!
+// Peers that do not fit in response_size are left out (count says how many are listed)
+void find_peers(char *filename, char *response, int response_size) {
+    Swarm *swarm = registry_find_swarm(filename);
+
+    if (!swarm) {
+        snprintf(response, response_size, "ERROR File not found\n");
+        LOG("✗ No peers have file: %s\n", filename);
+        return;
+    }
+
+    // Leave room for the "PEERS <count>\n" header
+    char temp[1024];
+    int temp_len = 0;
+    int listed = 0;
+    int max_len = response_size - 32 < (int)sizeof(temp) ? response_size - 32 : (int)sizeof(temp);
+
+    for (int i = 0; i < swarm->member_count; i++) {
+        PeerNode *peer = swarm->members[i]->peer;
+        char ip_str[16];
+        inet_ntop(AF_INET, &peer->ip, ip_str, sizeof(ip_str));
+
+        // Creates a string like "192.168.1.5:9000\n" at the end of temp
+        int len = snprintf(temp + temp_len, max_len - temp_len, "%s:%d\n", ip_str, peer->port);
+        if (len < 0 || len >= max_len - temp_len) break;
+        temp_len += len;
+        listed++;
+    }
+    temp[temp_len] = '\0';
+
+    snprintf(response, response_size, "PEERS %d\n%s", listed, temp);
+    LOG("✓ Found %d peer(s) with file: %s\n", swarm->member_count, filename);
+}
+
+// Big-endian helpers for binary replies
+static unsigned char *put_u16(unsigned char *p, uint16_t v) {
+    p[0] = v >> 8; p[1] = v;
+    return p + 2;
+}
+
+static unsigned char *put_u32(unsigned char *p, uint32_t v) {
+    p[0] = v >> 24; p[1] = v >> 16; p[2] = v >> 8; p[3] = v;
+    return p + 4;
+}
+
+static unsigned char *put_u64(unsigned char *p, uint64_t v) {
+    p = put_u32(p, (uint32_t)(v >> 32));
+    return put_u32(p, (uint32_t)v);
+}
+
+static uint32_t gcd_u32(uint32_t a, uint32_t b) {
+    while (b) {
+        uint32_t t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+// Random seed per event loop thread
+static __thread unsigned int rand_state = 0;
+
+// Score used to rank peers for a requester, higher is better:
+// peers that have the whole file, are idle and sit in the requester's subnet
+// come first. The random jitter makes equally good peers take turns, so the
+// first seeder in the swarm is not handed to every downloader.
+static int peer_score(Membership *m, uint32_t requester) {
+    PeerNode *peer = m->peer;
+    uint32_t a = ntohl(peer->ip);
+    uint32_t b = ntohl(requester);
+    int score = m->completion;
+
+    if ((a >> 8) == (b >> 8)) score += RANK_SAME_SUBNET_BONUS;         // Same /24
+    else if ((a >> 16) == (b >> 16)) score += RANK_NEAR_SUBNET_BONUS;  // Same /16
+
+    int uploads = peer->active_uploads < 10 ? peer->active_uploads : 10;
+    int mbps = peer->upload_kbps / 1024 < 50 ? peer->upload_kbps / 1024 : 50;
+    score -= uploads * RANK_UPLOAD_PENALTY + mbps;
+
+    return score + rand_r(&rand_state) % RANK_JITTER;
+}
+
+typedef struct {
+    int score;
+    PeerNode *peer;
+} RankedPeer;
+
+static int compare_ranked(const void *a, const void *b) {
+    return ((const RankedPeer*)b)->score - ((const RankedPeer*)a)->score;
+}
+
+// Compact version of find_peers() for QUERY_COMPACT (format in protocol.h)
+// Peers are visited in the order start, start+stride, start+2*stride... (mod total)
+// with stride coprime to total, which touches every peer exactly once. start and
+// stride come from a random seed carried in the cursor, so the first page is a
+// random sample and later pages continue the same walk.
+// The cursor is seed (16 bits) | total (24 bits) | k (24 bits). start and stride
+// depend on total, so a cursor from before the swarm grew or shrank would land
+// on a different walk: then a new walk starts from k = 0 (peers may repeat).
+// With `ranked` set, a larger random candidate set is drawn from the walk and
+// the best `limit` peers for `requester` are returned (no further pages).
+// reply must hold COMPACT_HEADER_SIZE + COMPACT_MAX_PEERS * COMPACT_PEER_SIZE bytes
+int find_peers_compact(char *filename, int limit, uint64_t cursor, uint32_t requester,
+                       int ranked, unsigned char *reply) {
+    Swarm *swarm = registry_find_swarm(filename);
+    unsigned char *p = reply + COMPACT_HEADER_SIZE;
+
+    if (!swarm) {
+        memset(reply, 0, COMPACT_HEADER_SIZE);
+        reply[0] = 1;
+        return COMPACT_HEADER_SIZE;
+    }
+
+    if (limit < 1) limit = 1;
+    if (limit > COMPACT_MAX_PEERS) limit = COMPACT_MAX_PEERS;
+
+    uint32_t total = (uint32_t)swarm->member_count;
+    if (total > CURSOR_MAX_TOTAL) total = CURSOR_MAX_TOTAL;  // Walk only the first 16M members
+    uint32_t seed = (uint32_t)(cursor >> 48);
+    uint32_t walk_total = (uint32_t)(cursor >> 24) & CURSOR_MAX_TOTAL;
+    uint32_t k = (uint32_t)cursor & CURSOR_MAX_TOTAL;
+
+    if (seed == 0 || walk_total != total || k >= total) {
+        if (rand_state == 0) rand_state = (unsigned int)time(NULL) ^ (unsigned int)(uintptr_t)&rand_state;
+        seed = (((uint32_t)rand_r(&rand_state) << 1) | 1) & 0xFFFF;
+        k = 0;
+    }
+
+    uint32_t start = (uint32_t)(hash_u64(seed) % total);
+    uint32_t stride = 1;
+    if (total > 2) {
+        stride = 1 + (uint32_t)(hash_u64((uint64_t)seed << 1) % (total - 1));
+        while (gcd_u32(stride, total) != 1) stride = stride % (total - 1) + 1;
+    }
+
+    int count = 0;
+    uint64_t next_cursor = 0;
+
+    if (ranked) {
+        static __thread RankedPeer candidates[RANK_MAX_CANDIDATES];
+        uint32_t wanted = limit * RANK_CANDIDATE_FACTOR;
+        if (wanted > RANK_MAX_CANDIDATES) wanted = RANK_MAX_CANDIDATES;
+
+        int found = 0;
+        for (k = 0; k < total && k < wanted; k++) {
+            Membership *m = swarm->members[(start + (uint64_t)k * stride) % total];
+            candidates[found].score = peer_score(m, requester);
+            candidates[found].peer = m->peer;
             found++;
-            char peer_info[100]; // temporary buffer to store one peers information
-            sprintf(peer_info, "%s:%d\n", 
-                    registered_files[i].peer_ip, 
-                    registered_files[i].peer_port); // Creates a string like "192.168.1.5:9000\n" and writes to peer_info buffer
-            strcat(temp, peer_info); // concats peer_info to temp to get final buffer to write to response
         }
-    }
-    
-    if (found > 0) {
-        sprintf(response, "PEERS %d\n%s", found, temp);
-        printf("✓ Found %d peer(s) with file: %s\n", found, filename);
+        qsort(candidates, found, sizeof(RankedPeer), compare_ranked);
+
+        for (count = 0; count < limit && count < found; count++) {
+            memcpy(p, &candidates[count].peer->ip, 4);
+            p = put_u16(p + 4, candidates[count].peer->port);
+        }
     } else {
-        sprintf(response, "ERROR File not found\n");
-        printf("✗ No peers have file: %s\n", filename);
+        while (count < limit && k < total) {
+            PeerNode *peer = swarm->members[(start + (uint64_t)k * stride) % total]->peer;
+            memcpy(p, &peer->ip, 4);    // Already network byte order
+            p = put_u16(p + 4, peer->port);
+            count++;
+            k++;
+        }
+
+        if (k < total) next_cursor = ((uint64_t)seed << 48) | ((uint64_t)total << 24) | k;
     }
+
+    unsigned char *h = reply;
+    *h++ = 0;
+    *h++ = 0;
+    h = put_u16(h, (uint16_t)count);
+    h = put_u32(h, total);
+    put_u64(h, next_cursor);
+
+    return (int)(p - reply);
+}
+
+static void print_membership(Membership *m, void *arg) {
+    int *index = (int*)arg;
+    char ip_str[16];
+    inet_ntop(AF_INET, &m->peer->ip, ip_str, sizeof(ip_str));
+    printf("%d. %s (from %s:%d)\n", ++(*index), m->swarm->filename, ip_str, m->peer->port);
 }
 
-// Function to print all registered files
+// Function to print registry status
+// Small registries are listed in full, big ones only as counters
 void print_all_files() {
+    if (quiet) return;
+
     printf("\n=== Registered Files ===\n");
-    if (file_count == 0) {
+    long total = registry_membership_count();
+    if (total == 0) {
         printf("(No files registered yet)\n");
-    }
-    for (int i = 0; i < file_count; i++) {
-        printf("%d. %s (from %s:%d)\n", 
-               i+1,
-               registered_files[i].filename,
-               registered_files[i].peer_ip,
-               registered_files[i].peer_port);
+    } else if (total <= PRINT_ALL_LIMIT) {
+        int index = 0;
+        registry_for_each(print_membership, &index);
+    } else {
+        printf("%ld files, %ld peers, %ld registrations\n",
+               registry_swarm_count(), registry_peer_count(), total);
     }
     printf("========================\n\n");
 }
 
-int main() {
 
-    int server_fd, client_fd;
-    struct sockaddr_in address, client_addr;
-    int addrlen = sizeof(address);
-    socklen_t client_len = sizeof(client_addr);
-    char buffer[1024] = {0};
-    char response[1024] = {0};
-    
-    printf("========================================\n");
-    printf("   P2P File Transfer - Tracker Server  \n");
-    printf("========================================\n");
-    printf("Starting tracker on port %d...\n", TRACKER_PORT);
-    
-    // Create socket
-    server_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (server_fd == 0) {
+
+// Make a socket non-blocking so one slow client can never stall the loop
+int set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0) return -1;
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+// Create a listening socket on tracker_port
+// SO_REUSEPORT lets every event loop own its own listener on the same port,
+// the kernel then spreads incoming connections across them
+int create_listener() {
+    int server_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (server_fd < 0) {
         printf("✗ Socket creation failed\n");
-        exit(1);
+        return -1;
     }
-    printf("✓ Socket created\n");
-    
-    
+
     int opt = 1;
 
     /*
@@ -107,99 +421,647 @@ int main() {
     server_fd : which socket
     SOL_SOCKET : Socket level option (general for all protocols)
     SO_REUSEADDR : Allow reuse of local addresses. Without this, if you stop the server and restart it immediately, you'll get "Address already in use" error
+    SO_REUSEPORT : Allow several sockets to bind the same port (one per event loop)
     */
     setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
-    
+    setsockopt(server_fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt));
 
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
     address.sin_family = AF_INET;
     address.sin_addr.s_addr = INADDR_ANY;  // Listen on all interfaces
-    address.sin_port = htons(TRACKER_PORT); // htons : host to network server : for converting port number, TRACKER_PORT from protocols.h i.e. 8080
-    
+    address.sin_port = htons(tracker_port); // htons : host to network server : for converting port number, TRACKER_PORT from protocols.h i.e. 8080
 
     // Bind associates the socket with an address (IP + port)
     if (bind(server_fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
         printf("✗ Bind failed\n");
         close(server_fd);
-        exit(1);
+        return -1;
     }
-    printf("✓ Bound to 0.0.0.0:%d (listening on all network interfaces)\n", TRACKER_PORT);
-    
 
-    // Listen marks socket to accept connections(Backlog : 3 i.e. maximum 3 waiting in queue)
-    if (listen(server_fd, 3) < 0) {
+    // Listen marks socket to accept connections (backlog = how many may wait in queue)
+    if (listen(server_fd, listen_backlog) < 0) {
         printf("✗ Listen failed\n");
         close(server_fd);
-        exit(1);
+        return -1;
     }
-    printf("✓ Listening for connections...\n");
-    printf("========================================\n");
-    
 
-    // MAIN LOOP: Handle multiple clients forever
+    if (set_nonblocking(server_fd) < 0) {
+        close(server_fd);
+        return -1;
+    }
+
+    return server_fd;
+}
+
+void close_connection(int epoll_fd, Connection *conn) {
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+    close(conn->fd);
+    free(conn->out_buf);
+    free(conn);
+}
+
+// Bytes queued for the client and not sent yet
+static int output_pending(Connection *conn) {
+    return conn->out_len - conn->out_sent;
+}
+
+// Watch for EPOLLOUT while replies wait, and for EPOLLIN unless too many do
+// (or the client has nothing more to send)
+static void update_events(int epoll_fd, Connection *conn) {
+    unsigned int events = 0;
+    if (!conn->read_closed && output_pending(conn) < CONN_OUTPUT_LIMIT) events |= EPOLLIN;
+    if (output_pending(conn) > 0) events |= EPOLLOUT;
+    if (events == conn->events) return;
+
+    struct epoll_event ev;
+    ev.events = events;
+    ev.data.ptr = conn;
+    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, conn->fd, &ev);
+    conn->events = events;
+}
+
+// Queue a reply for the client
+// We try to send right away, whatever the socket does not accept is kept
+// in out_buf and flushed later when epoll reports the socket writable
+int queue_reply(int epoll_fd, Connection *conn, const char *data, int len) {
+    // Nothing waiting in front of us: try to send directly
+    if (conn->out_len == conn->out_sent) {
+        conn->out_len = 0;
+        conn->out_sent = 0;
+
+        while (len > 0) {
+            ssize_t sent = send(conn->fd, data, len, MSG_NOSIGNAL);
+            if (sent < 0) {
+                if (errno == EINTR) continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+                return -1;
+            }
+            data += sent;
+            len -= sent;
+        }
+
+        if (len == 0) return 0;
+    }
+
+    // Keep the rest for later (after what is still waiting, moved to the front)
+    if (output_pending(conn) + len > CONN_OUTPUT_HARD_LIMIT) {
+        LOG("✗ %s doesn't read its replies, dropping it\n", conn->client_ip);
+        return -1;
+    }
+    if (conn->out_sent > 0) {
+        memmove(conn->out_buf, conn->out_buf + conn->out_sent, output_pending(conn));
+        conn->out_len -= conn->out_sent;
+        conn->out_sent = 0;
+    }
+    if (conn->out_len + len > conn->out_cap) {
+        int new_cap = conn->out_cap ? conn->out_cap : 1024;
+        while (new_cap < conn->out_len + len) new_cap *= 2;
+
+        char *grown = realloc(conn->out_buf, new_cap);
+        if (!grown) return -1;
+        conn->out_buf = grown;
+        conn->out_cap = new_cap;
+    }
+    memcpy(conn->out_buf + conn->out_len, data, len);
+    conn->out_len += len;
+
+    // Ask epoll to tell us when the socket can take more
+    update_events(epoll_fd, conn);
+    return 0;
+}
+
+// Send as much of the pending output as the socket accepts
+int flush_pending(int epoll_fd, Connection *conn) {
+    while (conn->out_sent < conn->out_len) {
+        ssize_t sent = send(conn->fd, conn->out_buf + conn->out_sent,
+                            conn->out_len - conn->out_sent, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            return -1;
+        }
+        conn->out_sent += sent;
+    }
+
+    // Everything is out: stop watching for EPOLLOUT
+    if (conn->out_sent == conn->out_len) {
+        conn->out_len = 0;
+        conn->out_sent = 0;
+        if (conn->read_closed) return -1;  // Last reply of a half-closed client is out
+    }
+
+    // Read commands again once the client has caught up
+    update_events(epoll_fd, conn);
+    return 0;
+}
+
+// Handle one filename line of a REGISTER_BATCH or QUERY_BATCH
+int handle_batch_line(int epoll_fd, Connection *conn, char *line) {
+    char filename[MAX_FILENAME];
+    char root[HASH_HEX_SIZE] = "";
+    int completion = 100;
+
+    // Line is "<filename>", "<filename> <completion>" or "<filename> <completion> <root>"
+    if (sscanf(line, "%99s %d %64s", filename, &completion, root) < 1) filename[0] = '\0';
+    if (!valid_root(root)) root[0] = '\0';
+
+    conn->batch_remaining--;
+
+    if (conn->batch_type == BATCH_REGISTER) {
+        pthread_rwlock_wrlock(&registry_lock);
+        if (filename[0] && add_file(filename, conn->client_addr, conn->batch_port, completion, root, time(NULL)) > 0) {
+            conn->batch_added++;
+        }
+        if (conn->batch_remaining == 0) print_all_files();
+        pthread_rwlock_unlock(&registry_lock);
+
+        if (conn->batch_remaining == 0) {
+            char response[64];
+            int len = sprintf(response, "OK %d\n", conn->batch_added);
+            conn->batch_type = BATCH_NONE;
+            LOG("✓ Batch registered %d file(s) from %s\n", conn->batch_added, conn->client_ip);
+            return queue_reply(epoll_fd, conn, response, len);
+        }
+        return 0;
+    }
+
+    // BATCH_QUERY: answer each file as its line arrives
+    unsigned char reply[COMPACT_HEADER_SIZE + COMPACT_MAX_PEERS * COMPACT_PEER_SIZE];
+
+    pthread_rwlock_rdlock(&registry_lock);
+    int len = find_peers_compact(filename, conn->batch_limit, 0, conn->client_addr, 1, reply);
+    pthread_rwlock_unlock(&registry_lock);
+
+    if (conn->batch_remaining == 0) conn->batch_type = BATCH_NONE;
+    return queue_reply(epoll_fd, conn, (char*)reply, len);
+}
+
+// Handle one complete command line from a client
+int handle_command(int epoll_fd, Connection *conn, char *line) {
+    char response[1024] = {0};
+
+    // Inside a batch every line is a filename
+    if (conn->batch_type != BATCH_NONE) {
+        return handle_batch_line(epoll_fd, conn, line);
+    }
+
+    LOG("✓ Received from %s: %s\n", conn->client_ip, line);
+
+    // ============ Handle REGISTER_BATCH command ============
+    if (strncmp(line, "REGISTER_BATCH", 14) == 0) {
+        int peer_port, count;
+
+        if (sscanf(line, "REGISTER_BATCH %d %d", &peer_port, &count) != 2 ||
+            count < 1 || count > BATCH_MAX_FILES) {
+            return queue_reply(epoll_fd, conn, "ERROR Bad REGISTER_BATCH\n", 25);
+        }
+
+        conn->batch_type = BATCH_REGISTER;
+        conn->batch_remaining = count;
+        conn->batch_port = peer_port;
+        conn->batch_added = 0;
+        return 0;
+    }
+    // ============ Handle QUERY_BATCH command ============
+    else if (strncmp(line, "QUERY_BATCH", 11) == 0) {
+        int limit, count;
+
+        if (sscanf(line, "QUERY_BATCH %d %d", &limit, &count) != 2 ||
+            count < 1 || count > BATCH_MAX_FILES) {
+            return queue_reply(epoll_fd, conn, "ERROR Bad QUERY_BATCH\n", 22);
+        }
+
+        conn->batch_type = BATCH_QUERY;
+        conn->batch_remaining = count;
+        conn->batch_limit = limit;
+        return 0;
+    }
+    // ============ Handle REGISTER command ============
+    else if (strncmp(line, "REGISTER", 8) == 0) {
+        char filename[MAX_FILENAME];
+        char root[HASH_HEX_SIZE] = "";   // Optional, old peers don't know content roots
+        int peer_port;
+        int completion = 100;   // Optional, old peers only share complete files
+
+        if (sscanf(line, "REGISTER %99s %d %d %64s", filename, &peer_port, &completion, root) < 2) {
+            return queue_reply(epoll_fd, conn, "ERROR Bad REGISTER\n", 19);
+        }
+        if (!valid_root(root)) root[0] = '\0';
+
+        // Store with REAL IP (from socket, not from message)
+        pthread_rwlock_wrlock(&registry_lock);
+        int added = add_file(filename, conn->client_addr, peer_port, completion, root, time(NULL));
+        if (added > 0) print_all_files();
+        pthread_rwlock_unlock(&registry_lock);
+
+        if (added == -2) {
+            return queue_reply(epoll_fd, conn, "ERROR Different content\n", 24);
+        }
+        if (added == -3) {
+            return queue_reply(epoll_fd, conn, "ERROR Outdated content\n", 23);
+        }
+        if (added < 0) {
+            return queue_reply(epoll_fd, conn, "ERROR Registry full\n", 20);
+        }
+        LOG("✓ Sent: OK\n");
+        return queue_reply(epoll_fd, conn, "OK\n", 3);
+    }
+    // ============ Handle UNREGISTER command ============
+    else if (strncmp(line, "UNREGISTER", 10) == 0) {
+        char filename[MAX_FILENAME];
+        int peer_port;
+
+        if (sscanf(line, "UNREGISTER %99s %d", filename, &peer_port) != 2) {
+            return queue_reply(epoll_fd, conn, "ERROR Bad UNREGISTER\n", 21);
+        }
+
+        pthread_rwlock_wrlock(&registry_lock);
+        int removed = remove_file(filename, conn->client_addr, peer_port);
+        pthread_rwlock_unlock(&registry_lock);
+
+        if (!removed) {
+            return queue_reply(epoll_fd, conn, "ERROR Not registered\n", 21);
+        }
+        return queue_reply(epoll_fd, conn, "OK\n", 3);
+    }
+    // ============ Handle ANNOUNCE command ============
+    else if (strncmp(line, "ANNOUNCE", 8) == 0) {
+        int peer_port;
+        int uploads = 0, upload_kbps = 0;   // Optional load report
+
+        if (sscanf(line, "ANNOUNCE %d %d %d", &peer_port, &uploads, &upload_kbps) < 1) {
+            return queue_reply(epoll_fd, conn, "ERROR Bad ANNOUNCE\n", 19);
+        }
+
+        pthread_rwlock_wrlock(&registry_lock);
+        PeerNode *peer = registry_touch(conn->client_addr, (uint16_t)peer_port, time(NULL));
+        if (peer) {
+            peer->active_uploads = uploads;
+            peer->upload_kbps = upload_kbps;
+        }
+        pthread_rwlock_unlock(&registry_lock);
+
+        // Tracker does not know this peer (expired or restarted): ask it to REGISTER again
+        if (!peer) {
+            return queue_reply(epoll_fd, conn, "UNKNOWN\n", 8);
+        }
+        return queue_reply(epoll_fd, conn, "OK\n", 3);
+    }
+    // ============ Handle ROOT command ============
+    else if (strncmp(line, "ROOT", 4) == 0) {
+        char filename[MAX_FILENAME];
+
+        if (sscanf(line, "ROOT %99s", filename) != 1) {
+            return queue_reply(epoll_fd, conn, "ERROR Bad ROOT\n", 15);
+        }
+
+        pthread_rwlock_rdlock(&registry_lock);
+        Swarm *swarm = registry_find_swarm(filename);
+        int len = (swarm && swarm->root[0])
+            ? snprintf(response, sizeof(response), "ROOT %s\n", swarm->root)
+            : snprintf(response, sizeof(response), "ERROR No root\n");
+        pthread_rwlock_unlock(&registry_lock);
+
+        return queue_reply(epoll_fd, conn, response, len);
+    }
+    // ============ Handle QUERY_COMPACT command ============
+    else if (strncmp(line, "QUERY_COMPACT", 13) == 0) {
+        char filename[MAX_FILENAME];
+        int limit = COMPACT_MAX_PEERS;
+        unsigned long long cursor = 0;
+        int ranked = 0;
+        unsigned char reply[COMPACT_HEADER_SIZE + COMPACT_MAX_PEERS * COMPACT_PEER_SIZE];
+
+        if (sscanf(line, "QUERY_COMPACT %99s %d %llu %d", filename, &limit, &cursor, &ranked) < 1) {
+            return queue_reply(epoll_fd, conn, "ERROR Bad QUERY_COMPACT\n", 24);
+        }
+
+        pthread_rwlock_rdlock(&registry_lock);
+        int len = find_peers_compact(filename, limit, cursor, conn->client_addr, ranked, reply);
+        pthread_rwlock_unlock(&registry_lock);
+
+        return queue_reply(epoll_fd, conn, (char*)reply, len);
+    }
+    // ============ Handle QUERY command ============
+    else if (strncmp(line, "QUERY", 5) == 0) {
+        char filename[MAX_FILENAME];
+
+        if (sscanf(line, "QUERY %99s", filename) != 1) {
+            return queue_reply(epoll_fd, conn, "ERROR Bad QUERY\n", 16);
+        }
+        LOG("✓ Searching for: %s\n", filename);
+
+        pthread_rwlock_rdlock(&registry_lock);
+        find_peers(filename, response, sizeof(response));
+        pthread_rwlock_unlock(&registry_lock);
+
+        LOG("✓ Sent response\n");
+        return queue_reply(epoll_fd, conn, response, strlen(response));
+    }
+    // ============ Handle unknown command ============
+    else {
+        LOG("✗ Unknown command\n");
+        return queue_reply(epoll_fd, conn, "ERROR Unknown command\n", 22);
+    }
+}
+
+// Split everything buffered so far into '\n' terminated commands
+// A read may hold half a command, or several commands at once
+int process_input(int epoll_fd, Connection *conn) {
+    int start = 0;
+
+    for (int i = 0; i < conn->in_len; i++) {
+        if (conn->in_buf[i] != '\n') continue;
+
+        conn->in_buf[i] = '\0';
+        if (i > start && conn->in_buf[i - 1] == '\r') conn->in_buf[i - 1] = '\0';
+
+        if (conn->in_buf[start] != '\0') {
+            if (handle_command(epoll_fd, conn, conn->in_buf + start) < 0) return -1;
+        }
+        start = i + 1;
+    }
+
+    // Keep the unfinished tail for the next read
+    conn->in_len -= start;
+    memmove(conn->in_buf, conn->in_buf + start, conn->in_len);
+
+    if (conn->in_len == CONN_BUFFER_SIZE) {
+        LOG("✗ Command too long from %s\n", conn->client_ip);
+        return -1;
+    }
+    return 0;
+}
+
+// Read whatever the client sent, returns -1 when the connection should close
+int handle_readable(int epoll_fd, Connection *conn) {
     while (1) {
+        ssize_t bytes_read = read(conn->fd, conn->in_buf + conn->in_len,
+                                  CONN_BUFFER_SIZE - conn->in_len);
+        if (bytes_read > 0) {
+            conn->in_len += bytes_read;
+            if (process_input(epoll_fd, conn) < 0) return -1;
+
+            // Too many replies waiting: the rest waits until the client reads them
+            if (output_pending(conn) >= CONN_OUTPUT_LIMIT) return 0;
+            continue;
+        }
 
-        printf("\n[Waiting for client...]\n");
-        
+        if (bytes_read == 0) {
+            // Client closed. Old clients may not end the last command with '\n'
+            if (conn->in_len > 0) {
+                conn->in_buf[conn->in_len] = '\n';
+                conn->in_len++;
+                if (process_input(epoll_fd, conn) < 0) return -1;
+            }
+
+            // It may only have shut down its sending side (shutdown(SHUT_WR), nc):
+            // keep the connection until the replies still queued are sent
+            if (output_pending(conn) == 0) return -1;
+            conn->read_closed = 1;
+            update_events(epoll_fd, conn);
+            return 0;
+        }
+
+        if (errno == EINTR) continue;
+        if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+        return -1;
+    }
+}
+
+// Accept every connection waiting on the listener
+void accept_clients(int epoll_fd, int server_fd) {
+    while (1) {
+        struct sockaddr_in client_addr;
+        socklen_t client_len = sizeof(client_addr);
 
-        // Accept connection
-        client_fd = accept(server_fd, (struct sockaddr *)&client_addr, &client_len);
+        int client_fd = accept(server_fd, (struct sockaddr *)&client_addr, &client_len);
         if (client_fd < 0) {
-            printf("✗ Accept failed\n");
+            if (errno == EINTR) continue;
+            return;  // EAGAIN: queue drained (or a real error, try again on next event)
+        }
+
+        Connection *conn = calloc(1, sizeof(Connection));
+        if (!conn || set_nonblocking(client_fd) < 0) {
+            free(conn);
+            close(client_fd);
             continue;
         }
-        
+        conn->fd = client_fd;
+        conn->client_addr = client_addr.sin_addr.s_addr;
 
         // Get client's IP address (REAL IP from network)
-        char client_ip[16]; 
-        inet_ntop(AF_INET, &client_addr.sin_addr, client_ip, sizeof(client_ip)); // converts binary IP to human-readable string
-        printf("✓ Client connected from %s\n", client_ip);
-        
-        // Read message from client
-        memset(buffer, 0, sizeof(buffer)); // memset : Memory set - fills memory with a specific value
-        int bytes_read = read(client_fd, buffer, 1024); 
-        
-        if (bytes_read > 0) {
-            buffer[bytes_read] = '\0';
-            printf("✓ Received: %s", buffer);
-            
-            // ============ Handle REGISTER command ============
-            if (strncmp(buffer, "REGISTER", 8) == 0) {
-                char filename[MAX_FILENAME];
-                int peer_port;
-                
-                sscanf(buffer, "REGISTER %s %d", filename, &peer_port);
-                
-                // Store with REAL IP (from socket, not from message)
-                add_file(filename, client_ip, peer_port);
-                print_all_files();
-                
-                send(client_fd, "OK\n", 3, 0);
-                printf("✓ Sent: OK\n");
+        inet_ntop(AF_INET, &client_addr.sin_addr, conn->client_ip, sizeof(conn->client_ip)); // converts binary IP to human-readable string
+
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.ptr = conn;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client_fd, &ev) < 0) {
+            close(client_fd);
+            free(conn);
+            continue;
+        }
+        conn->events = EPOLLIN;
+
+        LOG("✓ Client connected from %s\n", conn->client_ip);
+    }
+}
+
+static void log_expired_peer(PeerNode *peer) {
+    persist_log_expire(peer->ip, peer->port);
+}
+
+// Drop peers that stopped announcing (and check on log compaction)
+// Every loop calls this after epoll_wait(); only the first one each second does the work
+void expire_stale_peers() {
+    time_t now = time(NULL);
+    if (__atomic_load_n(&last_expire_check, __ATOMIC_RELAXED) == now) return;
+
+    pthread_rwlock_wrlock(&registry_lock);
+    if (last_expire_check != now) {
+        __atomic_store_n(&last_expire_check, now, __ATOMIC_RELAXED);
+        int expired = registry_expire(now, persistence_enabled ? log_expired_peer : NULL);
+        if (expired > 0) {
+            LOG("✓ Expired %d stale peer(s)\n", expired);
+            print_all_files();
+        }
+        if (persistence_enabled) persist_tick();
+    }
+    pthread_rwlock_unlock(&registry_lock);
+}
+
+// One event loop: owns a listener and all the clients it accepted
+void* event_loop(void *arg) {
+    int server_fd = *(int*)arg;
+    free(arg);
+
+    int epoll_fd = epoll_create1(0);
+    if (epoll_fd < 0) {
+        printf("✗ epoll_create1 failed\n");
+        close(server_fd);
+        return NULL;
+    }
+
+    // The listener is registered with a NULL pointer so we can tell it apart
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, server_fd, &ev);
+
+    struct epoll_event events[MAX_EVENTS];
+
+    // MAIN LOOP: Handle all clients of this loop forever
+    while (1) {
+        // Wake up at least once a second to expire stale peers
+        int n = epoll_wait(epoll_fd, events, MAX_EVENTS, 1000);
+        expire_stale_peers();
+
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            printf("✗ epoll_wait failed\n");
+            break;
+        }
+
+        for (int i = 0; i < n; i++) {
+            Connection *conn = events[i].data.ptr;
+
+            if (conn == NULL) {
+                accept_clients(epoll_fd, server_fd);
+                continue;
+            }
+
+            if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+                close_connection(epoll_fd, conn);
+                continue;
             }
-            // ============ Handle QUERY command ============
-            else if (strncmp(buffer, "QUERY", 5) == 0) {
-                char filename[MAX_FILENAME];
-                
-                sscanf(buffer, "QUERY %s", filename);
-                printf("✓ Searching for: %s\n", filename);
-                
-                memset(response, 0, sizeof(response));
-                find_peers(filename, response);
-                
-                send(client_fd, response, strlen(response), 0);
-                printf("✓ Sent response\n");
+
+            if ((events[i].events & EPOLLOUT) && flush_pending(epoll_fd, conn) < 0) {
+                close_connection(epoll_fd, conn);
+                continue;
             }
-            // ============ Handle unknown command ============
-            else {
-                printf("✗ Unknown command\n");
-                send(client_fd, "ERROR Unknown command\n", 22, 0);
+
+            if ((events[i].events & EPOLLIN) && handle_readable(epoll_fd, conn) < 0) {
+                close_connection(epoll_fd, conn);
+                continue;
             }
         }
-        
-        close(client_fd);
-        printf("[Connection closed]\n");
     }
-    
+
+    close(epoll_fd);
     close(server_fd);
+    return NULL;
+}
+
+void print_usage(char *prog) {
+    printf("Usage: %s [-t event_loops] [-b backlog] [-d state_dir] [-n] [-q] [-p port]\n", prog);
+    printf("  -t  Number of event loops (default: one per CPU core)\n");
+    printf("  -b  Listen backlog (default: %d)\n", TRACKER_BACKLOG);
+    printf("  -d  Directory for saved registry state (default: %s)\n", TRACKER_STATE_DIR);
+    printf("  -n  Do not save or load registry state\n");
+    printf("  -q  Quiet: no per-command logging\n");
+    printf("  -p  Port to listen on (default: %d)\n", TRACKER_PORT);
+}
+
+int main(int argc, char *argv[]) {
+    int num_loops = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    char *state_dir = TRACKER_STATE_DIR;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "t:b:d:nqp:h")) != -1) {
+        switch (opt) {
+            case 't':
+                num_loops = atoi(optarg);
+                break;
+            case 'b':
+                listen_backlog = atoi(optarg);
+                break;
+            case 'd':
+                state_dir = optarg;
+                break;
+            case 'n':
+                persistence_enabled = 0;
+                break;
+            case 'q':
+                quiet = 1;
+                break;
+            case 'p':
+                tracker_port = atoi(optarg);
+                break;
+            default:
+                print_usage(argv[0]);
+                exit(opt == 'h' ? 0 : 1);
+        }
+    }
+    if (num_loops < 1) num_loops = 1;
+    if (listen_backlog < 1) listen_backlog = TRACKER_BACKLOG;
+
+    pthread_rwlockattr_t lock_attr;
+    pthread_rwlockattr_init(&lock_attr);
+    pthread_rwlockattr_setkind_np(&lock_attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&registry_lock, &lock_attr);
+    pthread_rwlockattr_destroy(&lock_attr);
+
+    if (registry_init(time(NULL)) < 0) {
+        printf("✗ Cannot allocate registry\n");
+        exit(1);
+    }
+
+    // Bring back the registry from the last run
+    if (persistence_enabled) {
+        struct timespec begin, end;
+        clock_gettime(CLOCK_MONOTONIC, &begin);
+
+        long loaded = persist_open(state_dir, time(NULL));
+        if (loaded < 0) {
+            printf("✗ Cannot open tracker state in %s/\n", state_dir);
+            exit(1);
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        double ms = (end.tv_sec - begin.tv_sec) * 1000.0 + (end.tv_nsec - begin.tv_nsec) / 1e6;
+        printf("✓ Restored %ld registrations from %s/ (%ld records, %.1f ms)\n",
+               registry_membership_count(), state_dir, loaded, ms);
+    }
+
+    printf("========================================\n");
+    printf("   P2P File Transfer - Tracker Server  \n");
+    printf("========================================\n");
+    printf("Starting tracker on port %d...\n", tracker_port);
+
+    // Every client is a file descriptor: allow as many as the hard limit permits
+    struct rlimit fd_limit;
+    if (getrlimit(RLIMIT_NOFILE, &fd_limit) == 0 && fd_limit.rlim_cur < fd_limit.rlim_max) {
+        fd_limit.rlim_cur = fd_limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &fd_limit);
+    }
+
+    // Every loop gets its own listener, all bound to the same port
+    int listeners[num_loops];
+    for (int i = 0; i < num_loops; i++) {
+        listeners[i] = create_listener();
+        if (listeners[i] < 0) {
+            exit(1);
+        }
+    }
+    printf("✓ Bound to 0.0.0.0:%d (listening on all network interfaces)\n", tracker_port);
+    printf("✓ Listening for connections (%d event loop(s), backlog %d)...\n",
+           num_loops, listen_backlog);
+    printf("========================================\n");
+
+    pthread_t loops[num_loops];
+    for (int i = 0; i < num_loops; i++) {
+        int *server_fd_ptr = malloc(sizeof(int));
+        *server_fd_ptr = listeners[i];
+        if (pthread_create(&loops[i], NULL, event_loop, server_fd_ptr) != 0) {
+            printf("✗ Failed to start event loop %d\n", i);
+            exit(1);
+        }
+    }
+
+    for (int i = 0; i < num_loops; i++) {
+        pthread_join(loops[i], NULL);
+    }
+
     return 0;
-}
\ No newline at end of file
+}
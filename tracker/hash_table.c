@@ -0,0 +1,103 @@
+#include <stdlib.h>
+#include "hash_table.h"
+
+int hash_table_init(HashTable *table, size_t initial_buckets) {
+    size_t buckets = 16;
+    while (buckets < initial_buckets) buckets *= 2;
+
+    table->buckets = (HashEntry**)calloc(buckets, sizeof(HashEntry*));
+    if (!table->buckets) return -1;
+
+    table->bucket_count = buckets;
+    table->count = 0;
+    return 0;
+}
+
+// Double the bucket array and relink every entry
+// Doubling keeps inserts O(1) amortized no matter how big the table gets
+static void hash_table_grow(HashTable *table) {
+    size_t new_count = table->bucket_count * 2;
+    HashEntry **new_buckets = (HashEntry**)calloc(new_count, sizeof(HashEntry*));
+    if (!new_buckets) return;  // Keep working with longer chains
+
+    for (size_t i = 0; i < table->bucket_count; i++) {
+        HashEntry *entry = table->buckets[i];
+        while (entry) {
+            HashEntry *next = entry->next;
+            size_t slot = entry->hash & (new_count - 1);
+            entry->next = new_buckets[slot];
+            new_buckets[slot] = entry;
+            entry = next;
+        }
+    }
+
+    free(table->buckets);
+    table->buckets = new_buckets;
+    table->bucket_count = new_count;
+}
+
+void hash_table_reserve(HashTable *table, size_t count) {
+    while (table->bucket_count < count) {
+        size_t before = table->bucket_count;
+        hash_table_grow(table);
+        if (table->bucket_count == before) return;  // Out of memory
+    }
+}
+
+void hash_table_insert(HashTable *table, HashEntry *entry, uint64_t hash) {
+    // Keep load factor <= 1 so chains stay short
+    if (table->count >= table->bucket_count) {
+        hash_table_grow(table);
+    }
+
+    size_t slot = hash & (table->bucket_count - 1);
+    entry->hash = hash;
+    entry->next = table->buckets[slot];
+    table->buckets[slot] = entry;
+    table->count++;
+}
+
+void hash_table_remove(HashTable *table, HashEntry *entry) {
+    HashEntry **link = &table->buckets[entry->hash & (table->bucket_count - 1)];
+
+    while (*link) {
+        if (*link == entry) {
+            *link = entry->next;
+            entry->next = NULL;
+            table->count--;
+            return;
+        }
+        link = &(*link)->next;
+    }
+}
+
+HashEntry *hash_table_chain(HashTable *table, uint64_t hash) {
+    return table->buckets[hash & (table->bucket_count - 1)];
+}
+
+void hash_table_free(HashTable *table) {
+    free(table->buckets);
+    table->buckets = NULL;
+    table->bucket_count = 0;
+    table->count = 0;
+}
+
+// FNV-1a: simple and good enough for filenames
+uint64_t hash_string(const char *str) {
+    uint64_t hash = 1469598103934665603ULL;
+    while (*str) {
+        hash ^= (unsigned char)*str++;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+// splitmix64 finalizer: spreads nearby integers (ip:port keys) across buckets
+uint64_t hash_u64(uint64_t value) {
+    value ^= value >> 30;
+    value *= 0xbf58476d1ce4e5b9ULL;
+    value ^= value >> 27;
+    value *= 0x94d049bb133111ebULL;
+    value ^= value >> 31;
+    return value;
+}
@@ -0,0 +1,44 @@
+#ifndef HASH_TABLE_H
+#define HASH_TABLE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Intrusive chained hash table
+// Structs that live in a table put a HashEntry as their FIRST member, so a
+// HashEntry* can be cast back to the containing struct. The table never
+// allocates entries, it only links them.
+typedef struct HashEntry {
+    struct HashEntry *next;
+    uint64_t hash;
+} HashEntry;
+
+typedef struct {
+    HashEntry **buckets;
+    size_t bucket_count;   // always a power of two
+    size_t count;
+} HashTable;
+
+// Initialize table (initial_buckets is rounded up to a power of two)
+int hash_table_init(HashTable *table, size_t initial_buckets);
+
+// Link an entry, growing the table when it gets too full
+void hash_table_insert(HashTable *table, HashEntry *entry, uint64_t hash);
+
+// Grow the bucket array up front for `count` entries (saves rehashing during bulk loads)
+void hash_table_reserve(HashTable *table, size_t count);
+
+// Unlink an entry that is in the table
+void hash_table_remove(HashTable *table, HashEntry *entry);
+
+// First entry of the chain that may hold `hash` (follow ->next, compare ->hash and key)
+HashEntry *hash_table_chain(HashTable *table, uint64_t hash);
+
+// Free bucket array (entries belong to the caller)
+void hash_table_free(HashTable *table);
+
+// Hash helpers
+uint64_t hash_string(const char *str);
+uint64_t hash_u64(uint64_t value);
+
+#endif
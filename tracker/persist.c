@@ -0,0 +1,408 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "persist.h"
+#include "registry.h"
+
+#define SNAPSHOT_MAGIC "P2PSNAP1"
+#define LOG_MAGIC      "P2PLOG01"
+#define MAGIC_SIZE 8
+#define RECORD_HEADER_SIZE 8
+
+// Don't bother compacting small logs
+#define COMPACT_MIN_RECORDS 100000
+
+static char snapshot_path[512];
+static char log_path[512];
+static char old_log_path[520];   // The log being folded into a snapshot right now
+static int log_fd = -1;
+static long log_records = 0;
+static int log_dirty = 0;         // Set under the registry lock, cleared by sync_thread
+
+// sync_thread fsyncs a dup() of log_fd; log_mutex only covers swapping the fd
+static pthread_mutex_t log_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Child process writing a snapshot (0 = none)
+static pid_t compact_pid = 0;
+static long compact_records = 0;
+
+// Encode one record into buf, returns its size
+static int encode_record(unsigned char *buf, char type, const char *filename,
+                         uint32_t ip, uint16_t port) {
+    int len = filename ? (int)strlen(filename) : 0;
+    if (len > 255) len = 255;
+
+    buf[0] = (unsigned char)type;
+    buf[1] = (unsigned char)len;
+    buf[2] = port >> 8;
+    buf[3] = port & 0xff;
+    memcpy(buf + 4, &ip, 4);
+    if (len > 0) memcpy(buf + RECORD_HEADER_SIZE, filename, len);
+
+    return RECORD_HEADER_SIZE + len;
+}
+
+// Encode a completion record: the filename, then the percent as one byte
+static int encode_completion(unsigned char *buf, const char *filename,
+                             uint32_t ip, uint16_t port, int completion) {
+    int size = encode_record(buf, 'C', filename, ip, port);
+    if (size == RECORD_HEADER_SIZE + 255) size--;  // Keep room for the percent
+
+    buf[1] = size - RECORD_HEADER_SIZE + 1;
+    buf[size] = (unsigned char)completion;
+    return size + 1;
+}
+
+// Apply one record to the registry
+static void apply_record(const unsigned char *rec, time_t now) {
+    char filename[MAX_FILENAME];
+    int len = rec[1];
+    uint16_t port = (rec[2] << 8) | rec[3];
+    uint32_t ip;
+    memcpy(&ip, rec + 4, 4);
+
+    // A root record ends in the root, a completion record in the percent: the filename is the rest
+    int name_len = (rec[0] == 'H') ? len - (HASH_HEX_SIZE - 1) : (rec[0] == 'C') ? len - 1 : len;
+    if (name_len < 0 || name_len >= MAX_FILENAME) return;
+    memcpy(filename, rec + RECORD_HEADER_SIZE, name_len);
+    filename[name_len] = '\0';
+
+    if (rec[0] == 'H') {
+        // The swarm exists: its first 'R' record came before this one.
+        // A later 'H' is a new version, the root it replaces becomes an old root
+        Swarm *swarm = registry_find_swarm(filename);
+        if (swarm) {
+            char root[HASH_HEX_SIZE];
+            memcpy(root, rec + RECORD_HEADER_SIZE + name_len, HASH_HEX_SIZE - 1);
+            root[HASH_HEX_SIZE - 1] = '\0';
+            registry_set_root(swarm, root);
+        }
+    } else if (rec[0] == 'R') {
+        registry_add(filename, ip, port, 100, now);
+    } else if (rec[0] == 'C') {
+        Membership *m = registry_find_membership(filename, ip, port);
+        int completion = rec[RECORD_HEADER_SIZE + name_len];
+        if (m) m->completion = (completion > 100) ? 100 : completion;
+    } else if (rec[0] == 'U') {
+        registry_remove(filename, ip, port);
+    } else if (rec[0] == 'E') {
+        PeerNode *peer = registry_find_peer(ip, port);
+        if (peer) registry_remove_peer(peer);
+    }
+}
+
+// mmap a state file and replay its records
+// A torn record at the end (crash in the middle of a write) is ignored
+static long replay_file(const char *path, const char *magic, time_t now, off_t *valid_size) {
+    *valid_size = 0;
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return 0;  // No saved state yet
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size < MAGIC_SIZE) {
+        close(fd);
+        return 0;
+    }
+
+    unsigned char *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) return -1;
+
+    if (memcmp(data, magic, MAGIC_SIZE) != 0) {
+        printf("✗ %s is not a tracker state file, ignoring it\n", path);
+        munmap(data, st.st_size);
+        return 0;
+    }
+
+    // Tell the kernel we read front to back
+    madvise(data, st.st_size, MADV_SEQUENTIAL | MADV_WILLNEED);
+
+    // Records are at least ~16 bytes: size the registry once instead of growing it record by record
+    registry_reserve(registry_membership_count() + st.st_size / 16);
+
+    long records = 0;
+    off_t pos = MAGIC_SIZE;
+    while (pos + RECORD_HEADER_SIZE <= st.st_size) {
+        int len = data[pos + 1];
+        if (pos + RECORD_HEADER_SIZE + len > st.st_size) break;
+
+        apply_record(data + pos, now);
+        pos += RECORD_HEADER_SIZE + len;
+        records++;
+    }
+
+    *valid_size = pos;
+    munmap(data, st.st_size);
+    return records;
+}
+
+// Switch appends to another log file (closes the old one)
+static void set_log_fd(int fd) {
+    pthread_mutex_lock(&log_mutex);
+    if (log_fd >= 0) close(log_fd);
+    log_fd = fd;
+    pthread_mutex_unlock(&log_mutex);
+}
+
+// Start an empty log (sync_thread makes it durable within a second)
+static int reset_log() {
+    int fd = open(log_path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+    if (fd < 0) return -1;
+
+    if (write(fd, LOG_MAGIC, MAGIC_SIZE) != MAGIC_SIZE) {
+        close(fd);
+        return -1;
+    }
+    set_log_fd(fd);
+    log_records = 0;
+    __atomic_store_n(&log_dirty, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+static void append_encoded(unsigned char *buf, int size) {
+    if (log_fd < 0) return;
+
+    if (write(log_fd, buf, size) != size) {
+        printf("✗ Cannot append to %s\n", log_path);
+        return;
+    }
+    log_records++;
+    __atomic_store_n(&log_dirty, 1, __ATOMIC_RELAXED);
+}
+
+static void append_record(char type, const char *filename, uint32_t ip, uint16_t port) {
+    unsigned char buf[RECORD_HEADER_SIZE + 256];
+    append_encoded(buf, encode_record(buf, type, filename, ip, port));
+}
+
+void persist_log_register(const char *filename, uint32_t ip, uint16_t port) {
+    append_record('R', filename, ip, port);
+}
+
+void persist_log_unregister(const char *filename, uint32_t ip, uint16_t port) {
+    append_record('U', filename, ip, port);
+}
+
+void persist_log_expire(uint32_t ip, uint16_t port) {
+    append_record('E', NULL, ip, port);
+}
+
+void persist_log_root(const char *filename, const char *root) {
+    char name[MAX_FILENAME + HASH_HEX_SIZE];
+    snprintf(name, sizeof(name), "%s%s", filename, root);
+    append_record('H', name, 0, 0);
+}
+
+void persist_log_completion(const char *filename, uint32_t ip, uint16_t port, int completion) {
+    unsigned char buf[RECORD_HEADER_SIZE + 256];
+    append_encoded(buf, encode_completion(buf, filename, ip, port, completion));
+}
+
+// Snapshot output, buffered by hand: the child that writes it stays off stdio
+typedef struct {
+    int fd;
+    int failed;
+    int len;
+    unsigned char buf[1 << 20];
+} SnapshotWriter;
+
+static void snapshot_write(SnapshotWriter *w, const unsigned char *data, int size) {
+    if (w->len + size > (int)sizeof(w->buf)) {
+        if (write(w->fd, w->buf, w->len) != w->len) w->failed = 1;
+        w->len = 0;
+    }
+    memcpy(w->buf + w->len, data, size);
+    w->len += size;
+}
+
+static void write_snapshot_record(Membership *m, void *arg) {
+    SnapshotWriter *w = (SnapshotWriter*)arg;
+    unsigned char buf[RECORD_HEADER_SIZE + 256];
+    snapshot_write(w, buf, encode_record(buf, 'R', m->swarm->filename, m->peer->ip, m->peer->port));
+
+    // A complete copy needs no 'C' record
+    if (m->completion < 100) {
+        snapshot_write(w, buf, encode_completion(buf, m->swarm->filename, m->peer->ip, m->peer->port, m->completion));
+    }
+
+    // The swarm's roots once, right after the record that creates the swarm on
+    // replay: its old roots oldest first, then the current one, which replaces them
+    if (m->swarm_slot == 0 && m->swarm->root[0]) {
+        char name[MAX_FILENAME + HASH_HEX_SIZE];
+        for (int i = 0; i < m->swarm->old_root_count; i++) {
+            snprintf(name, sizeof(name), "%s%s", m->swarm->filename, m->swarm->old_roots[i]);
+            snapshot_write(w, buf, encode_record(buf, 'H', name, 0, 0));
+        }
+        snprintf(name, sizeof(name), "%s%s", m->swarm->filename, m->swarm->root);
+        snapshot_write(w, buf, encode_record(buf, 'H', name, 0, 0));
+    }
+}
+
+// Write the whole registry to a new snapshot
+// The snapshot is written to a temp file and renamed over the old one, so a
+// crash at any point leaves either the old or the new snapshot intact.
+static int write_snapshot() {
+    static SnapshotWriter w;
+    char tmp_path[520];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", snapshot_path);
+
+    w.fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (w.fd < 0) return -1;
+    w.failed = 0;
+    w.len = 0;
+
+    snapshot_write(&w, (const unsigned char*)SNAPSHOT_MAGIC, MAGIC_SIZE);
+    registry_for_each(write_snapshot_record, &w);
+    if (w.len > 0 && write(w.fd, w.buf, w.len) != w.len) w.failed = 1;
+
+    if (w.failed || fsync(w.fd) != 0) {
+        close(w.fd);
+        unlink(tmp_path);
+        return -1;
+    }
+    close(w.fd);
+
+    if (rename(tmp_path, snapshot_path) < 0) {
+        unlink(tmp_path);
+        return -1;
+    }
+    return 0;
+}
+
+// Fold the log into a snapshot without holding up the event loops.
+// Under the registry lock we only rotate: the log becomes registry.log.old
+// and new records go to a fresh log. A fork()ed child then writes the
+// snapshot from its copy-on-write view of the registry (which is exactly
+// snapshot + old log) and deletes the old log.
+// On startup the old log is replayed between the snapshot and the new log,
+// so a crash at any point loses nothing. A crash after the rename but before
+// the old log is deleted only means its records get replayed twice, which
+// ends in the same registry.
+// If the last child failed, its old log is still there and must not be
+// overwritten: the child is just started again, without rotating.
+static int start_compaction() {
+    int old_fd = -1;
+    compact_records = log_records;
+
+    if (access(old_log_path, F_OK) == 0) {
+        // Retry: the snapshot covers the current log too, which is replayed again harmlessly
+    } else if (rename(log_path, old_log_path) < 0) {
+        return -1;
+    } else {
+        pthread_mutex_lock(&log_mutex);
+        old_fd = dup(log_fd);
+        pthread_mutex_unlock(&log_mutex);
+
+        if (reset_log() < 0) {
+            // Keep appending to the old log where it is (log_fd still points at it)
+            if (old_fd >= 0) close(old_fd);
+            rename(old_log_path, log_path);
+            return -1;
+        }
+    }
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        // Child: the tail of the old log may not be synced yet, the snapshot must be
+        if (old_fd >= 0) fdatasync(old_fd);
+        if (write_snapshot() < 0) _exit(1);
+        unlink(old_log_path);
+        _exit(0);
+    }
+    if (old_fd >= 0) close(old_fd);
+    if (pid < 0) return -1;  // The old log stays and is replayed on startup
+
+    compact_pid = pid;
+    return 0;
+}
+
+// Background thread: fsync the log once a second when something was appended
+// The sync runs on a dup() of the fd, so the event loops never wait for the disk
+static void *sync_thread(void *arg) {
+    (void)arg;
+    while (1) {
+        sleep(1);
+        if (!__atomic_exchange_n(&log_dirty, 0, __ATOMIC_RELAXED)) continue;
+
+        pthread_mutex_lock(&log_mutex);
+        int fd = (log_fd >= 0) ? dup(log_fd) : -1;
+        pthread_mutex_unlock(&log_mutex);
+
+        if (fd >= 0) {
+            fdatasync(fd);
+            close(fd);
+        }
+    }
+    return NULL;
+}
+
+long persist_open(const char *dir, time_t now) {
+    mkdir(dir, 0755);
+    snprintf(snapshot_path, sizeof(snapshot_path), "%s/registry.snap", dir);
+    snprintf(log_path, sizeof(log_path), "%s/registry.log", dir);
+    snprintf(old_log_path, sizeof(old_log_path), "%s/registry.log.old", dir);
+
+    off_t valid_size;
+    long snapshot_records = replay_file(snapshot_path, SNAPSHOT_MAGIC, now, &valid_size);
+    if (snapshot_records < 0) return -1;
+
+    // Left over from a compaction that didn't finish
+    long old_records = replay_file(old_log_path, LOG_MAGIC, now, &valid_size);
+    if (old_records < 0) return -1;
+
+    long replayed = replay_file(log_path, LOG_MAGIC, now, &valid_size);
+    if (replayed < 0) return -1;
+
+    if (old_records > 0) {
+        // Fold it in now, before anybody waits on us: a later rotation would overwrite it
+        if (write_snapshot() < 0) return -1;
+        unlink(old_log_path);
+        if (reset_log() < 0) return -1;
+    } else if (valid_size == 0) {
+        // No usable log: start a new one
+        unlink(old_log_path);
+        if (reset_log() < 0) return -1;
+    } else {
+        log_fd = open(log_path, O_WRONLY | O_APPEND);
+        if (log_fd < 0) return -1;
+
+        // Cut off a torn record so new records start on a boundary
+        if (ftruncate(log_fd, valid_size) < 0) return -1;
+        log_records = replayed;
+    }
+
+    pthread_t syncer;
+    if (pthread_create(&syncer, NULL, sync_thread, NULL) != 0) return -1;
+    pthread_detach(syncer);
+
+    return snapshot_records + old_records + replayed;
+}
+
+void persist_tick() {
+    if (log_fd < 0) return;
+
+    // A snapshot is being written: see whether it is done
+    if (compact_pid > 0) {
+        int status;
+        if (waitpid(compact_pid, &status, WNOHANG) == 0) return;
+        compact_pid = 0;
+
+        if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+            printf("✓ Compacted %ld log records into snapshot\n", compact_records);
+        } else {
+            printf("✗ Snapshot compaction failed (the old log is kept)\n");
+        }
+    }
+
+    if (log_records > COMPACT_MIN_RECORDS && log_records > registry_membership_count()) {
+        if (start_compaction() < 0) printf("✗ Cannot start snapshot compaction\n");
+    }
+}
@@ -0,0 +1,53 @@
+#ifndef PERSIST_H
+#define PERSIST_H
+
+#include <stdint.h>
+#include <time.h>
+
+// Crash-safe tracker state
+//
+//   <dir>/registry.snap    : compacted snapshot, one REGISTER record per registration
+//   <dir>/registry.log     : append-only log of REGISTER / UNREGISTER / EXPIRE events
+//   <dir>/registry.log.old : the log a snapshot is being written from (only while it is)
+//
+// On startup the snapshot, the old log and then the log are mmap'd and replayed
+// into the registry. Every change is appended to the log with one write()
+// (survives a process crash right away) and a background thread fsyncs the log
+// once a second (survives a machine crash with at most one second lost). When
+// the log grows bigger than the registry itself it is folded into a fresh
+// snapshot by a fork()ed child, so neither the fsync nor the snapshot holds
+// the registry lock while it waits for the disk.
+//
+// Record layout (same in both files):
+//   type (1)  'R' register, 'U' unregister, 'E' peer expired, 'H' content root,
+//             'C' completion
+//   len  (1)  filename length (0 for 'E', filename + 64 for 'H', filename + 1 for 'C')
+//   port (2)  big-endian
+//   ip   (4)  network byte order
+//   name (len bytes, no '\0'; for 'H' the filename, then the root in hex;
+//         for 'C' the filename, then the percent as one byte)
+//
+// A later 'H' for the same file is a new version: the root it replaces is
+// remembered as an old root (refused if a peer registers it again).
+// An 'R' record alone means a complete copy (100%), as in state files written
+// before 'C' existed. A peer with less gets a 'C' right after its 'R', and
+// another whenever its completion changes. Load is not saved: it is back with
+// the peer's next ANNOUNCE.
+//
+// Like the registry, the caller holds the registry lock.
+
+// Load saved state into the registry and open the log. Returns records loaded, -1 on error
+long persist_open(const char *dir, time_t now);
+
+// Append events to the log
+void persist_log_register(const char *filename, uint32_t ip, uint16_t port);
+void persist_log_unregister(const char *filename, uint32_t ip, uint16_t port);
+void persist_log_expire(uint32_t ip, uint16_t port);
+void persist_log_root(const char *filename, const char *root);
+void persist_log_completion(const char *filename, uint32_t ip, uint16_t port, int completion);
+
+// Once a second: start compacting the log into a snapshot when it grew too big,
+// and collect the child that did the last one
+void persist_tick();
+
+#endif
@@ -0,0 +1,285 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include "registry.h"
+
+static HashTable swarms;
+static HashTable peers;
+static HashTable memberships;
+static TimerWheel peer_expiry;
+
+int registry_init(time_t now) {
+    timer_wheel_init(&peer_expiry, now);
+    if (hash_table_init(&swarms, 1024) < 0) return -1;
+    if (hash_table_init(&peers, 1024) < 0) return -1;
+    if (hash_table_init(&memberships, 4096) < 0) return -1;
+    return 0;
+}
+
+void registry_reserve(long registrations) {
+    hash_table_reserve(&swarms, registrations);
+    hash_table_reserve(&peers, registrations / 8);
+    hash_table_reserve(&memberships, registrations);
+}
+
+static uint64_t peer_key(uint32_t ip, uint16_t port) {
+    return ((uint64_t)ip << 16) | port;
+}
+
+static uint64_t membership_hash(Swarm *swarm, PeerNode *peer) {
+    return hash_u64((uint64_t)(uintptr_t)swarm ^ hash_u64((uint64_t)(uintptr_t)peer));
+}
+
+// Grow a Membership* array so one more element fits
+static int reserve_slot(Membership ***array, int count, int *cap) {
+    if (count < *cap) return 0;
+
+    int new_cap = *cap ? *cap * 2 : 4;
+    Membership **grown = (Membership**)realloc(*array, new_cap * sizeof(Membership*));
+    if (!grown) return -1;
+
+    *array = grown;
+    *cap = new_cap;
+    return 0;
+}
+
+Swarm *registry_find_swarm(const char *filename) {
+    uint64_t hash = hash_string(filename);
+
+    for (HashEntry *e = hash_table_chain(&swarms, hash); e; e = e->next) {
+        Swarm *swarm = (Swarm*)e;
+        if (e->hash == hash && strcmp(swarm->filename, filename) == 0) {
+            return swarm;
+        }
+    }
+    return NULL;
+}
+
+PeerNode *registry_find_peer(uint32_t ip, uint16_t port) {
+    uint64_t hash = hash_u64(peer_key(ip, port));
+
+    for (HashEntry *e = hash_table_chain(&peers, hash); e; e = e->next) {
+        PeerNode *peer = (PeerNode*)e;
+        if (e->hash == hash && peer->ip == ip && peer->port == port) {
+            return peer;
+        }
+    }
+    return NULL;
+}
+
+static Membership *find_membership(Swarm *swarm, PeerNode *peer) {
+    uint64_t hash = membership_hash(swarm, peer);
+
+    for (HashEntry *e = hash_table_chain(&memberships, hash); e; e = e->next) {
+        Membership *m = (Membership*)e;
+        if (e->hash == hash && m->swarm == swarm && m->peer == peer) {
+            return m;
+        }
+    }
+    return NULL;
+}
+
+static Swarm *get_or_create_swarm(const char *filename) {
+    Swarm *swarm = registry_find_swarm(filename);
+    if (swarm) return swarm;
+
+    swarm = (Swarm*)calloc(1, sizeof(Swarm));
+    if (!swarm) return NULL;
+
+    strncpy(swarm->filename, filename, MAX_FILENAME - 1);
+    hash_table_insert(&swarms, &swarm->entry, hash_string(swarm->filename));
+    return swarm;
+}
+
+static PeerNode *get_or_create_peer(uint32_t ip, uint16_t port) {
+    PeerNode *peer = registry_find_peer(ip, port);
+    if (peer) return peer;
+
+    peer = (PeerNode*)calloc(1, sizeof(PeerNode));
+    if (!peer) return NULL;
+
+    peer->ip = ip;
+    peer->port = port;
+    hash_table_insert(&peers, &peer->entry, hash_u64(peer_key(ip, port)));
+    return peer;
+}
+
+static void free_swarm_if_empty(Swarm *swarm) {
+    if (swarm->member_count > 0) return;
+
+    hash_table_remove(&swarms, &swarm->entry);
+    free(swarm->members);
+    free(swarm->old_roots);
+    free(swarm);
+}
+
+static void free_peer_if_empty(PeerNode *peer) {
+    if (peer->file_count > 0) return;
+
+    timer_wheel_cancel(&peer->expiry);
+    hash_table_remove(&peers, &peer->entry);
+    free(peer->files);
+    free(peer);
+}
+
+static void touch_peer(PeerNode *peer, time_t now) {
+    peer->last_seen = now;
+    timer_wheel_schedule(&peer_expiry, &peer->expiry, now + PEER_TTL);
+}
+
+int registry_add(const char *filename, uint32_t ip, uint16_t port, int completion, time_t now) {
+    Swarm *swarm = get_or_create_swarm(filename);
+    if (!swarm) return -1;
+
+    PeerNode *peer = get_or_create_peer(ip, port);
+    if (!peer) {
+        free_swarm_if_empty(swarm);
+        return -1;
+    }
+
+    touch_peer(peer, now);
+
+    if (completion < 0) completion = 0;
+    if (completion > 100) completion = 100;
+
+    // Same peer announcing the same file again: only its progress may have changed
+    Membership *existing = find_membership(swarm, peer);
+    if (existing) {
+        existing->completion = completion;
+        return 0;
+    }
+
+    Membership *m = (Membership*)calloc(1, sizeof(Membership));
+    if (!m ||
+        reserve_slot(&swarm->members, swarm->member_count, &swarm->member_cap) < 0 ||
+        reserve_slot(&peer->files, peer->file_count, &peer->file_cap) < 0) {
+        free(m);
+        free_swarm_if_empty(swarm);
+        free_peer_if_empty(peer);
+        return -1;
+    }
+
+    m->swarm = swarm;
+    m->peer = peer;
+    m->completion = completion;
+    m->swarm_slot = swarm->member_count;
+    m->peer_slot = peer->file_count;
+    swarm->members[swarm->member_count++] = m;
+    peer->files[peer->file_count++] = m;
+
+    hash_table_insert(&memberships, &m->entry, membership_hash(swarm, peer));
+    return 1;
+}
+
+void registry_set_root(Swarm *swarm, const char *root) {
+    if (strcmp(swarm->root, root) == 0) return;
+
+    if (swarm->root[0]) {
+        if (!swarm->old_roots) swarm->old_roots = calloc(SWARM_OLD_ROOTS, HASH_HEX_SIZE);
+        if (swarm->old_roots) {
+            // Full: forget the oldest
+            if (swarm->old_root_count == SWARM_OLD_ROOTS) {
+                memmove(swarm->old_roots[0], swarm->old_roots[1], (SWARM_OLD_ROOTS - 1) * HASH_HEX_SIZE);
+                swarm->old_root_count--;
+            }
+            strcpy(swarm->old_roots[swarm->old_root_count++], swarm->root);
+        }
+    }
+    strncpy(swarm->root, root, HASH_HEX_SIZE - 1);
+    swarm->root[HASH_HEX_SIZE - 1] = '\0';
+}
+
+int registry_root_superseded(Swarm *swarm, const char *root) {
+    for (int i = 0; i < swarm->old_root_count; i++) {
+        if (strcmp(swarm->old_roots[i], root) == 0) return 1;
+    }
+    return 0;
+}
+
+// Unlink a membership from both arrays by moving the last element into its slot
+static void unlink_membership(Membership *m) {
+    Swarm *swarm = m->swarm;
+    PeerNode *peer = m->peer;
+
+    Membership *last = swarm->members[--swarm->member_count];
+    swarm->members[m->swarm_slot] = last;
+    last->swarm_slot = m->swarm_slot;
+
+    last = peer->files[--peer->file_count];
+    peer->files[m->peer_slot] = last;
+    last->peer_slot = m->peer_slot;
+
+    hash_table_remove(&memberships, &m->entry);
+    free(m);
+}
+
+Membership *registry_find_membership(const char *filename, uint32_t ip, uint16_t port) {
+    Swarm *swarm = registry_find_swarm(filename);
+    PeerNode *peer = registry_find_peer(ip, port);
+    return (swarm && peer) ? find_membership(swarm, peer) : NULL;
+}
+
+int registry_remove(const char *filename, uint32_t ip, uint16_t port) {
+    Swarm *swarm = registry_find_swarm(filename);
+    PeerNode *peer = registry_find_peer(ip, port);
+    if (!swarm || !peer) return 0;
+
+    Membership *m = find_membership(swarm, peer);
+    if (!m) return 0;
+
+    unlink_membership(m);
+    free_swarm_if_empty(swarm);
+    free_peer_if_empty(peer);
+    return 1;
+}
+
+void registry_remove_peer(PeerNode *peer) {
+    while (peer->file_count > 0) {
+        Swarm *swarm = peer->files[peer->file_count - 1]->swarm;
+        unlink_membership(peer->files[peer->file_count - 1]);
+        free_swarm_if_empty(swarm);
+    }
+    free_peer_if_empty(peer);
+}
+
+PeerNode *registry_touch(uint32_t ip, uint16_t port, time_t now) {
+    PeerNode *peer = registry_find_peer(ip, port);
+    if (peer) touch_peer(peer, now);
+    return peer;
+}
+
+static void expire_peer(TimerNode *node, void *arg) {
+    PeerNode *peer = (PeerNode*)((char*)node - offsetof(PeerNode, expiry));
+    void (*on_expire)(PeerNode *peer) = arg;
+
+    if (on_expire) on_expire(peer);
+    registry_remove_peer(peer);
+}
+
+int registry_expire(time_t now, void (*on_expire)(PeerNode *peer)) {
+    return timer_wheel_advance(&peer_expiry, now, expire_peer, (void*)on_expire);
+}
+
+long registry_swarm_count() {
+    return (long)swarms.count;
+}
+
+long registry_peer_count() {
+    return (long)peers.count;
+}
+
+long registry_membership_count() {
+    return (long)memberships.count;
+}
+
+void registry_for_each(void (*fn)(Membership *m, void *arg), void *arg) {
+    for (size_t i = 0; i < swarms.bucket_count; i++) {
+        for (HashEntry *e = swarms.buckets[i]; e; e = e->next) {
+            Swarm *swarm = (Swarm*)e;
+            for (int j = 0; j < swarm->member_count; j++) {
+                fn(swarm->members[j], arg);
+            }
+        }
+    }
+}
@@ -0,0 +1,113 @@
+#ifndef REGISTRY_H
+#define REGISTRY_H
+
+#include <stdint.h>
+#include "../common/protocol.h"
+#include "hash_table.h"
+#include "timer_wheel.h"
+
+// Tracker registry: which peers share which files
+//
+//   swarms      : filename -> Swarm (set of peers sharing that file)
+//   peers       : ip:port  -> PeerNode (set of files that peer shares)
+//   memberships : (Swarm, PeerNode) -> Membership, one per registration
+//
+// A Membership sits in both its swarm's array and its peer's array and
+// remembers its slot in each, so removing it is a swap-with-last on both
+// sides: O(1) insert, lookup and removal however big the registry grows.
+//
+// Peers stay alive only while they keep announcing: every REGISTER or
+// ANNOUNCE pushes the peer's expiry to now + PEER_TTL on a timer wheel, and
+// registry_expire() drops peers whose expiry has passed.
+//
+// None of these functions lock; the caller holds the registry lock.
+
+// Old content roots remembered per swarm (see registry_set_root)
+#define SWARM_OLD_ROOTS 4
+
+typedef struct Swarm Swarm;
+typedef struct PeerNode PeerNode;
+
+typedef struct {
+    HashEntry entry;    // Must be first (see hash_table.h)
+    Swarm *swarm;
+    PeerNode *peer;
+    int swarm_slot;     // Index in swarm->members
+    int peer_slot;      // Index in peer->files
+    int completion;     // Percent of the file this peer has (reported in REGISTER)
+} Membership;
+
+struct Swarm {
+    HashEntry entry;
+    char filename[MAX_FILENAME];
+    char root[HASH_HEX_SIZE];   // Content root (hex) of the current version, "" = none yet
+    char (*old_roots)[HASH_HEX_SIZE];   // Roots it had before, oldest first (NULL until replaced)
+    int old_root_count;
+    Membership **members;
+    int member_count;
+    int member_cap;
+};
+
+struct PeerNode {
+    HashEntry entry;
+    uint32_t ip;        // Network byte order
+    uint16_t port;      // Host byte order
+    TimerNode expiry;   // Fires PEER_TTL seconds after the last announce
+    time_t last_seen;
+    int active_uploads; // Load reported in the last ANNOUNCE
+    int upload_kbps;
+    Membership **files;
+    int file_count;
+    int file_cap;
+};
+
+// Initialize empty registry
+int registry_init(time_t now);
+
+// Size the indexes for about `registrations` entries before a bulk load
+void registry_reserve(long registrations);
+
+// Register filename at ip:port holding `completion` percent of it
+// (also refreshes the peer's liveness and updates completion if already registered)
+// Returns 1 if added, 0 if already registered, -1 on error
+int registry_add(const char *filename, uint32_t ip, uint16_t port, int completion, time_t now);
+
+// Heartbeat: keep every registration of ip:port alive for another PEER_TTL
+// Returns the peer, or NULL if the tracker does not know it (it must re-REGISTER)
+PeerNode *registry_touch(uint32_t ip, uint16_t port, time_t now);
+
+// Drop peers that have not announced for PEER_TTL seconds. Returns how many
+// on_expire (may be NULL) is called for each peer just before it is removed
+int registry_expire(time_t now, void (*on_expire)(PeerNode *peer));
+
+// Give a swarm a content root. A different root it had is kept among its
+// last SWARM_OLD_ROOTS old roots, so an older version can be told apart
+void registry_set_root(Swarm *swarm, const char *root);
+
+// Was root the content of this swarm before its current root? 1 = yes
+int registry_root_superseded(Swarm *swarm, const char *root);
+
+// Remove one registration. Returns 1 if removed, 0 if it did not exist
+int registry_remove(const char *filename, uint32_t ip, uint16_t port);
+
+// Remove a peer from every swarm it is in
+void registry_remove_peer(PeerNode *peer);
+
+// Look up a swarm (NULL if nobody shares the file)
+Swarm *registry_find_swarm(const char *filename);
+
+// Look up a peer (NULL if it has no registrations)
+PeerNode *registry_find_peer(uint32_t ip, uint16_t port);
+
+// Look up one registration (NULL if ip:port does not share the file)
+Membership *registry_find_membership(const char *filename, uint32_t ip, uint16_t port);
+
+// Counters for status output
+long registry_swarm_count();
+long registry_peer_count();
+long registry_membership_count();
+
+// Call fn on every registration (for status output and snapshots)
+void registry_for_each(void (*fn)(Membership *m, void *arg), void *arg);
+
+#endif
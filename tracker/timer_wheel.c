@@ -0,0 +1,68 @@
+#include <stddef.h>
+#include "timer_wheel.h"
+
+static void list_init(TimerNode *head) {
+    head->prev = head;
+    head->next = head;
+}
+
+void timer_wheel_init(TimerWheel *wheel, time_t now) {
+    for (int i = 0; i < WHEEL_SLOTS; i++) {
+        list_init(&wheel->slots[i]);
+    }
+    wheel->current = now;
+}
+
+void timer_wheel_cancel(TimerNode *node) {
+    if (!node->scheduled) return;
+
+    node->prev->next = node->next;
+    node->next->prev = node->prev;
+    node->prev = node->next = NULL;
+    node->scheduled = 0;
+}
+
+void timer_wheel_schedule(TimerWheel *wheel, TimerNode *node, time_t expires) {
+    timer_wheel_cancel(node);
+
+    // Never schedule into a slot the wheel has already passed
+    if (expires <= wheel->current) expires = wheel->current + 1;
+
+    TimerNode *head = &wheel->slots[expires % WHEEL_SLOTS];
+    node->expires = expires;
+    node->next = head;
+    node->prev = head->prev;
+    head->prev->next = node;
+    head->prev = node;
+    node->scheduled = 1;
+}
+
+int timer_wheel_advance(TimerWheel *wheel, time_t now,
+                        void (*on_expire)(TimerNode *node, void *arg), void *arg) {
+    int fired = 0;
+
+    // After a long pause one full turn already covers every slot
+    if (now - wheel->current > WHEEL_SLOTS) {
+        wheel->current = now - WHEEL_SLOTS;
+    }
+
+    while (wheel->current < now) {
+        wheel->current++;
+        TimerNode *head = &wheel->slots[wheel->current % WHEEL_SLOTS];
+
+        TimerNode *node = head->next;
+        while (node != head) {
+            TimerNode *next = node->next;
+
+            // Timers more than one turn away share the slot; leave them for a later turn
+            if (node->expires <= now) {
+                timer_wheel_cancel(node);
+                on_expire(node, arg);
+                fired++;
+            }
+            node = next;
+        }
+    }
+
+    return fired;
+}
@@ -0,0 +1,38 @@
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include <time.h>
+
+// Hashed timer wheel with one-second slots
+// A timer lives in slot (expires % WHEEL_SLOTS). Scheduling and cancelling
+// are O(1) list operations, and each tick only looks at the one slot whose
+// second just passed, so expiring N timers costs O(N) overall, not O(N) per tick.
+#define WHEEL_SLOTS 256
+
+typedef struct TimerNode {
+    struct TimerNode *prev;
+    struct TimerNode *next;
+    time_t expires;
+    int scheduled;
+} TimerNode;
+
+typedef struct {
+    TimerNode slots[WHEEL_SLOTS];   // Each slot is a circular list head
+    time_t current;                 // Last second processed
+} TimerWheel;
+
+// Initialize wheel starting at `now`
+void timer_wheel_init(TimerWheel *wheel, time_t now);
+
+// (Re)schedule a timer to fire at `expires`
+void timer_wheel_schedule(TimerWheel *wheel, TimerNode *node, time_t expires);
+
+// Remove a timer (no-op if it is not scheduled)
+void timer_wheel_cancel(TimerNode *node);
+
+// Fire every timer that expired up to `now`
+// The callback may free the node; it is already unlinked when called
+int timer_wheel_advance(TimerWheel *wheel, time_t now,
+                        void (*on_expire)(TimerNode *node, void *arg), void *arg);
+
+#endif
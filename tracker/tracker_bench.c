@@ -0,0 +1,391 @@
+// Tracker load generator and latency benchmark
+//
+// Starts tracker.out on loopback (or attaches to a running one with -a), opens
+// thousands of connections that each act as a synthetic peer, and drives a
+// closed loop of REGISTER / QUERY_COMPACT commands: every connection sends one
+// command, waits for the full reply, records the latency and sends the next.
+// Prints throughput and p50/p99/p999 latency per command type.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "../common/protocol.h"
+
+#define BENCH_PORT 18080
+#define MAX_EVENTS 256
+#define QUERY_LIMIT 50
+
+#define OP_REGISTER 0
+#define OP_QUERY 1
+
+// Settings (see print_usage)
+int num_connections = 1000;
+int duration_sec = 10;
+int register_percent = 20;
+int num_files = 10000;
+int num_threads = 4;
+int tracker_loops = 0;          // 0 = tracker default (one per core)
+int bench_port = BENCH_PORT;
+int attach_only = 0;
+char *tracker_path = "./tracker.out";
+
+volatile int running = 1;
+
+// Latency samples in microseconds, one growable array per command type
+typedef struct {
+    unsigned int *samples;
+    long count;
+    long cap;
+} LatencyLog;
+
+// One synthetic peer
+typedef struct {
+    int fd;
+    int peer_port;          // Port this synthetic peer registers with
+    int op;                 // Command in flight
+    struct timespec sent_at;
+    unsigned int rand_state;
+
+    // Reply bytes received so far
+    unsigned char reply[COMPACT_HEADER_SIZE + COMPACT_MAX_PEERS * COMPACT_PEER_SIZE];
+    int reply_len;
+} BenchConn;
+
+typedef struct {
+    int first_conn;
+    int conn_count;
+    long errors;
+    LatencyLog latency[2];
+} BenchThread;
+
+static void log_latency(LatencyLog *log, unsigned int usec) {
+    if (log->count == log->cap) {
+        long new_cap = log->cap ? log->cap * 2 : 1 << 16;
+        unsigned int *grown = realloc(log->samples, new_cap * sizeof(unsigned int));
+        if (!grown) return;
+        log->samples = grown;
+        log->cap = new_cap;
+    }
+    log->samples[log->count++] = usec;
+}
+
+static long elapsed_usec(struct timespec *from, struct timespec *to) {
+    return (to->tv_sec - from->tv_sec) * 1000000L + (to->tv_nsec - from->tv_nsec) / 1000;
+}
+
+static int connect_tracker() {
+    struct sockaddr_in addr;
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+
+    int opt = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(bench_port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Send the next command of this connection
+static int send_command(BenchConn *conn) {
+    char message[256];
+    int file = rand_r(&conn->rand_state) % num_files;
+    int len;
+
+    if ((rand_r(&conn->rand_state) % 100) < register_percent) {
+        conn->op = OP_REGISTER;
+        len = sprintf(message, "REGISTER bench_file_%d.dat %d\n", file, conn->peer_port);
+    } else {
+        conn->op = OP_QUERY;
+        len = sprintf(message, "QUERY_COMPACT bench_file_%d.dat %d 0\n", file, QUERY_LIMIT);
+    }
+
+    conn->reply_len = 0;
+    clock_gettime(CLOCK_MONOTONIC, &conn->sent_at);
+
+    // Commands are tiny, a fresh socket buffer always takes them whole
+    return send(conn->fd, message, len, MSG_NOSIGNAL) == len ? 0 : -1;
+}
+
+// Returns 1 when the reply is complete, 0 if more bytes are needed
+static int reply_complete(BenchConn *conn) {
+    if (conn->op == OP_REGISTER) {
+        return conn->reply_len > 0 && conn->reply[conn->reply_len - 1] == '\n';
+    }
+
+    if (conn->reply_len < COMPACT_HEADER_SIZE) return 0;
+    int count = (conn->reply[2] << 8) | conn->reply[3];
+    return conn->reply_len >= COMPACT_HEADER_SIZE + count * COMPACT_PEER_SIZE;
+}
+
+static BenchConn *connections;
+
+void* bench_thread(void *arg) {
+    BenchThread *t = arg;
+    struct epoll_event events[MAX_EVENTS];
+
+    int epoll_fd = epoll_create1(0);
+    if (epoll_fd < 0) return NULL;
+
+    for (int i = t->first_conn; i < t->first_conn + t->conn_count; i++) {
+        BenchConn *conn = &connections[i];
+        fcntl(conn->fd, F_SETFL, fcntl(conn->fd, F_GETFL, 0) | O_NONBLOCK);
+
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.ptr = conn;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, conn->fd, &ev);
+
+        if (send_command(conn) < 0) t->errors++;
+    }
+
+    while (running) {
+        int n = epoll_wait(epoll_fd, events, MAX_EVENTS, 100);
+
+        for (int i = 0; i < n; i++) {
+            BenchConn *conn = events[i].data.ptr;
+
+            int bytes = read(conn->fd, conn->reply + conn->reply_len,
+                             sizeof(conn->reply) - conn->reply_len);
+            if (bytes <= 0) {
+                if (bytes < 0 && errno == EAGAIN) continue;
+                // Tracker dropped us: count it and stop using this connection
+                t->errors++;
+                epoll_ctl(epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+                continue;
+            }
+            conn->reply_len += bytes;
+
+            if (!reply_complete(conn)) continue;
+
+            struct timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            log_latency(&t->latency[conn->op], (unsigned int)elapsed_usec(&conn->sent_at, &now));
+
+            if (running && send_command(conn) < 0) t->errors++;
+        }
+    }
+
+    close(epoll_fd);
+    return NULL;
+}
+
+static int compare_uint(const void *a, const void *b) {
+    unsigned int x = *(const unsigned int*)a;
+    unsigned int y = *(const unsigned int*)b;
+    return (x > y) - (x < y);
+}
+
+static unsigned int percentile(LatencyLog *log, double p) {
+    if (log->count == 0) return 0;
+    long index = (long)(p * (log->count - 1));
+    return log->samples[index];
+}
+
+static void print_report(char *name, LatencyLog *log, double seconds) {
+    qsort(log->samples, log->count, sizeof(unsigned int), compare_uint);
+
+    printf("%-14s %10ld ops %11.0f ops/s   p50 %6u us   p99 %6u us   p999 %6u us   max %6u us\n",
+           name, log->count, log->count / seconds,
+           percentile(log, 0.50), percentile(log, 0.99), percentile(log, 0.999),
+           log->count ? log->samples[log->count - 1] : 0);
+}
+
+// Start tracker.out on bench_port, returns its pid
+static pid_t spawn_tracker() {
+    pid_t pid = fork();
+    if (pid < 0) return -1;
+
+    if (pid == 0) {
+        char port[16], loops[16];
+        sprintf(port, "%d", bench_port);
+        sprintf(loops, "%d", tracker_loops);
+
+        int devnull = open("/dev/null", O_WRONLY);
+        if (devnull >= 0) dup2(devnull, STDOUT_FILENO);
+
+        if (tracker_loops > 0) {
+            execl(tracker_path, tracker_path, "-n", "-q", "-p", port, "-t", loops, (char*)NULL);
+        } else {
+            execl(tracker_path, tracker_path, "-n", "-q", "-p", port, (char*)NULL);
+        }
+        _exit(127);
+    }
+
+    return pid;
+}
+
+void print_usage(char *prog) {
+    printf("Usage: %s [options]\n", prog);
+    printf("  -c  Concurrent connections / synthetic peers (default: %d)\n", num_connections);
+    printf("  -d  Duration in seconds (default: %d)\n", duration_sec);
+    printf("  -r  Percent of commands that are REGISTER, rest QUERY_COMPACT (default: %d)\n", register_percent);
+    printf("  -f  Number of distinct files (default: %d)\n", num_files);
+    printf("  -w  Benchmark threads (default: %d)\n", num_threads);
+    printf("  -t  Tracker event loops (default: tracker default)\n");
+    printf("  -x  Tracker binary (default: %s)\n", tracker_path);
+    printf("  -p  Port (default: %d)\n", BENCH_PORT);
+    printf("  -a  Attach to a tracker already running on the port instead of starting one\n");
+}
+
+int main(int argc, char *argv[]) {
+    int opt;
+
+    while ((opt = getopt(argc, argv, "c:d:r:f:w:t:x:p:ah")) != -1) {
+        switch (opt) {
+            case 'c': num_connections = atoi(optarg); break;
+            case 'd': duration_sec = atoi(optarg); break;
+            case 'r': register_percent = atoi(optarg); break;
+            case 'f': num_files = atoi(optarg); break;
+            case 'w': num_threads = atoi(optarg); break;
+            case 't': tracker_loops = atoi(optarg); break;
+            case 'x': tracker_path = optarg; break;
+            case 'p': bench_port = atoi(optarg); break;
+            case 'a': attach_only = 1; break;
+            default:
+                print_usage(argv[0]);
+                exit(opt == 'h' ? 0 : 1);
+        }
+    }
+    if (num_connections < 1 || num_threads < 1 || num_files < 1 || duration_sec < 1) {
+        print_usage(argv[0]);
+        exit(1);
+    }
+    if (num_threads > num_connections) num_threads = num_connections;
+
+    // Thousands of sockets need a high fd limit
+    struct rlimit fd_limit;
+    if (getrlimit(RLIMIT_NOFILE, &fd_limit) == 0) {
+        fd_limit.rlim_cur = fd_limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &fd_limit);
+        if ((rlim_t)num_connections + 64 > fd_limit.rlim_cur) {
+            printf("✗ fd limit %ld is too low for %d connections\n",
+                   (long)fd_limit.rlim_cur, num_connections);
+            exit(1);
+        }
+    }
+
+    printf("========================================\n");
+    printf("        Tracker Benchmark\n");
+    printf("========================================\n");
+    printf("Connections: %d   Threads: %d   Duration: %ds\n", num_connections, num_threads, duration_sec);
+    printf("Mix: %d%% REGISTER / %d%% QUERY_COMPACT over %d files\n",
+           register_percent, 100 - register_percent, num_files);
+
+    pid_t tracker_pid = -1;
+    if (!attach_only) {
+        tracker_pid = spawn_tracker();
+        if (tracker_pid < 0) {
+            printf("✗ Cannot start %s\n", tracker_path);
+            exit(1);
+        }
+        printf("✓ Started %s on 127.0.0.1:%d (pid %d)\n", tracker_path, bench_port, tracker_pid);
+    }
+
+    // Wait for the tracker to accept connections
+    int probe = -1;
+    for (int i = 0; i < 50 && probe < 0; i++) {
+        probe = connect_tracker();
+        if (probe < 0) usleep(100000);
+    }
+    if (probe < 0) {
+        printf("✗ Tracker not reachable on port %d\n", bench_port);
+        if (tracker_pid > 0) kill(tracker_pid, SIGTERM);
+        exit(1);
+    }
+    close(probe);
+
+    connections = calloc(num_connections, sizeof(BenchConn));
+    for (int i = 0; i < num_connections; i++) {
+        connections[i].fd = connect_tracker();
+        if (connections[i].fd < 0) {
+            printf("✗ Could only open %d connections\n", i);
+            if (tracker_pid > 0) kill(tracker_pid, SIGTERM);
+            exit(1);
+        }
+        connections[i].peer_port = 10000 + (i % 50000);
+        connections[i].rand_state = 12345u + i;
+    }
+    printf("✓ Opened %d connections\n", num_connections);
+
+    // Split connections across threads
+    BenchThread *threads = calloc(num_threads, sizeof(BenchThread));
+    pthread_t *tids = calloc(num_threads, sizeof(pthread_t));
+    int per_thread = num_connections / num_threads;
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for (int i = 0; i < num_threads; i++) {
+        threads[i].first_conn = i * per_thread;
+        threads[i].conn_count = (i == num_threads - 1) ? num_connections - i * per_thread : per_thread;
+        pthread_create(&tids[i], NULL, bench_thread, &threads[i]);
+    }
+
+    sleep(duration_sec);
+    running = 0;
+
+    for (int i = 0; i < num_threads; i++) {
+        pthread_join(tids[i], NULL);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double seconds = elapsed_usec(&start, &end) / 1e6;
+
+    // Merge per-thread samples
+    LatencyLog merged[2] = {{0}};
+    LatencyLog all = {0};
+    long errors = 0;
+    for (int i = 0; i < num_threads; i++) {
+        errors += threads[i].errors;
+        for (int op = 0; op < 2; op++) {
+            for (long j = 0; j < threads[i].latency[op].count; j++) {
+                log_latency(&merged[op], threads[i].latency[op].samples[j]);
+                log_latency(&all, threads[i].latency[op].samples[j]);
+            }
+            free(threads[i].latency[op].samples);
+        }
+    }
+
+    printf("\n");
+    print_report("REGISTER", &merged[OP_REGISTER], seconds);
+    print_report("QUERY_COMPACT", &merged[OP_QUERY], seconds);
+    print_report("ALL", &all, seconds);
+    printf("Errors: %ld\n", errors);
+    printf("========================================\n");
+
+    for (int i = 0; i < num_connections; i++) {
+        close(connections[i].fd);
+    }
+    if (tracker_pid > 0) {
+        kill(tracker_pid, SIGTERM);
+        waitpid(tracker_pid, NULL, 0);
+    }
+
+    free(merged[0].samples);
+    free(merged[1].samples);
+    free(all.samples);
+    free(connections);
+    free(threads);
+    free(tids);
+    return 0;
+}